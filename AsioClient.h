@@ -24,15 +24,19 @@
 
 // PRE-REQUISITES: 
 //#include "../../MMDevice/DeviceUtils.h"
+//#include "GrblPrimitives.h"
 //#include <sstream>
 //#include <cstdio>
 //
 //#include <deque> 
+//#include <algorithm> 
+//#include <cstring> 
 //#include <iostream> 
 //#include <boost/bind.hpp> 
 //#include <boost/asio.hpp> 
 //#include <boost/asio/serial_port.hpp> 
 //#include <boost/thread.hpp> 
+//#include <boost/array.hpp> 
 
 #ifndef ASIOCLIENT_H
 #define ASIOCLIENT_H
@@ -50,6 +54,14 @@ public:
       : active_(true), 
       io_service_(io_service), 
       serialPortImplementation_(io_service, device),
+      write_head_(0),
+      write_count_(0),
+      write_in_flight_(0),
+      write_in_progress_(false),
+      read_head_(0),
+      read_tail_(0),
+      read_paused_(0),
+      read_paused_work_(0),
       pSerialPortAdapter_(pPort),
       device_(device),
       shutDownInProgress_(false)
@@ -139,22 +151,45 @@ public:
          pSerialPortAdapter_->LogMessage(("error setting flow_control in AsioClient(): "+boost::lexical_cast<std::string,int>(anError.value()) + " " + anError.message()).c_str(), false);
    }
 
-   void WriteOneCharacterAsynchronously(const char msg) // pass the write data to the DoWrite function via the io service in the other thread 
+   void WriteOneCharacterAsynchronously(const char msg) // pass the write data to the io service in the other thread 
    { 
-	   int cz = sizeof(msg);
-	   if( 1!=cz)
-	   {
-		   return;
-	   }
-      io_service_.post(boost::bind(&AsioClient::DoWrite, this, msg)); 
+      WriteCharactersAsynchronously(&msg, 1);
    }
 
-   void WriteCharactersAsynchronously(const char* pmsg, int len) // pass the write data to the DoWrite function via the io service in the other thread 
+   void WriteCharactersAsynchronously(const char* pmsg, int len) // pass the write data to the io service in the other thread 
    { 
-
-      for( int ii =0; ii < len; ++ii)
+      // the data is copied into the write ring right here; the io service is only
+      // woken if no write is in progress, otherwise WriteComplete picks it up
+      while( 0 < len)
       {
-         io_service_.post(boost::bind(&AsioClient::DoWrite, this, *(pmsg+ii))); 
+         bool startWrite = false;
+         int copied = 0;
+         do{
+         MMThreadGuard g(writeBufferLock_);
+         copied = (int)std::min<size_t>(len, write_ring_size - write_count_);
+         size_t tail = (write_head_ + write_count_) % write_ring_size;
+         for( int ii = 0; ii < copied; )
+         {
+            // at most two contiguous pieces because of the wrap around
+            size_t piece = std::min<size_t>(copied - ii, write_ring_size - tail);
+            memcpy(&write_ring_[tail], pmsg + ii, piece);
+            ii += (int)piece;
+            tail = (tail + piece) % write_ring_size;
+         }
+         write_count_ += copied;
+         if( 0 < copied && !write_in_progress_)
+         {
+            write_in_progress_ = true;
+            startWrite = true;
+         }
+         }while(bfalse_s);
+
+         if( startWrite)
+            io_service_.post(boost::bind(&AsioClient::WriteStart, this)); 
+         if( 0 == copied)
+            CDeviceUtils::SleepMs(1); // ring is full, wait for the port to drain it
+         pmsg += copied;
+         len -= copied;
       }
    }
 
@@ -200,45 +235,86 @@ public:
 
    void Purge(void)
    {
-      // clear read buffer;
-      do{
-      MMThreadGuard g(readBufferLock_);
-      data_read_.clear();
-      }while(bfalse_s);
+      // clear read buffer; only the consumer moves the read index, so this
+      // must be called from the thread that reads
+      ConsumeTo((unsigned long)GrblAtomicLoad(&read_head_));
 
-      // clear write buffer
+      // clear write buffer, except what async_write is already sending
       do{
       MMThreadGuard g(writeBufferLock_);
-      write_msgs_.clear(); // buffered write data 
+      write_count_ = write_in_flight_;
       }while(bfalse_s);
    }
 
 
+   // The receive ring has a single producer, the io service thread, and a
+   // single consumer, the thread calling the Read/Peek functions below.
+
    // read one character, ret. is false if no characters are available.
    bool ReadOneCharacter(char& msg)
    {
-      bool retval = false;
-      MMThreadGuard g(readBufferLock_);
-      if( 0 < data_read_.size())
-      {
-         retval = true;
-         msg = data_read_.front();
-         data_read_.pop_front();
-      }
-      return retval;
+      unsigned long tail = (unsigned long)GrblAtomicLoad(&read_tail_);
+      if( tail == (unsigned long)GrblAtomicLoad(&read_head_))
+         return false;
+      msg = read_ring_[tail & read_ring_mask];
+      ConsumeTo(tail + 1);
+      return true;
+   }
+
+   // copies a complete line, without its \r\n terminator, and removes it from
+   // the ring; ret. is false if no complete line has arrived yet.
+   bool ReadLine(std::string& line)
+   {
+      unsigned long length;
+      if( !FindLine(line, length))
+         return false;
+      unsigned long tail = (unsigned long)GrblAtomicLoad(&read_tail_);
+      ConsumeTo(tail + length);
+      return true;
+   }
+
+   // like ReadLine, but leaves the line in the ring
+   bool PeekLine(std::string& line)
+   {
+      unsigned long length;
+      return FindLine(line, length);
    }
 
    void ShutDownInProgress(const bool v){ shutDownInProgress_ = v;};
 
 
 private: 
-   static const int max_read_length = 512; // maximum amount of data to read in one operation 
+   static const size_t write_ring_size = 4096; // capacity of the pending write data 
+   static const size_t read_ring_size = 8192; // capacity of the received data, a power of 2 
+   static const size_t read_ring_mask = read_ring_size - 1;
    void ReadStart(void) 
    { // Start an asynchronous read and call ReadComplete when it completes or fails 
+      if( !active_)
+         return;
+      // read straight into the free part of the ring
+      unsigned long head = (unsigned long)GrblAtomicLoad(&read_head_);
+      unsigned long used = head - (unsigned long)GrblAtomicLoad(&read_tail_);
+      if( read_ring_size == used)
+      {
+         // the consumer has fallen that far behind: stop reading and leave the
+         // data to the driver until it has made room. Whichever of the two
+         // clears the flag starts the next read, so exactly one of them does.
+         // Without a read armed, the io service needs work to keep running.
+         if( 0 == read_paused_work_)
+            read_paused_work_ = new boost::asio::io_service::work(io_service_);
+         GrblAtomicStore(&read_paused_, 1);
+         used = head - (unsigned long)GrblAtomicLoad(&read_tail_);
+         if( read_ring_size == used || !GrblAtomicCompareExchange(&read_paused_, 1, 0))
+            return;
+      }
+      delete read_paused_work_;
+      read_paused_work_ = 0;
+      size_t contiguous = std::min<size_t>(read_ring_size - used, read_ring_size - (head & read_ring_mask));
+      boost::asio::mutable_buffers_1 target = boost::asio::buffer(&read_ring_[head & read_ring_mask], contiguous);
       try
       {
          MMThreadGuard g(implementationLock_);
-         serialPortImplementation_.async_read_some(boost::asio::buffer(read_msg_, max_read_length), 
+         serialPortImplementation_.async_read_some(target, 
             boost::bind(&AsioClient::ReadComplete, 
             this, 
             boost::asio::placeholders::error, 
@@ -253,16 +329,9 @@ private:
    void ReadComplete(const boost::system::error_code& error, size_t bytes_transferred) 
    { // the asynchronous read operation has now completed or failed and returned an error 
       if (!error) 
-      { // read completed, so process the data 
-         do  // just a scope for the guard...
-         {
-            MMThreadGuard g(readBufferLock_);
-            for(unsigned int ib = 0; ib < bytes_transferred; ++ib)
-            {
-               data_read_.push_back(read_msg_[ib]);
-            }
-         }while(bfalse_s);
-         CDeviceUtils::SleepMs(1);
+      { // read completed, publish the data to the consumer 
+         unsigned long head = (unsigned long)GrblAtomicLoad(&read_head_);
+         GrblAtomicStore(&read_head_, (long)(head + bytes_transferred));
          ReadStart(); // start waiting for another asynchronous read again 
       } 
       else 
@@ -275,43 +344,81 @@ private:
    } 
 
 
-   // for asynchronous write operations:
-   void DoWrite(const char msg) 
-   { // callback to handle write call from outside this class 
-      std::auto_ptr<MMThreadGuard> apwg( new MMThreadGuard(writeBufferLock_));
-      bool write_in_progress = !write_msgs_.empty(); // is there anything currently being written? 
-      write_msgs_.push_back(msg); // store in write buffer 
-
-      // unlock the thread guard here
-      MMThreadGuard* pg = apwg.release();
-      delete pg;
-
-      if (!write_in_progress) // if nothing is currently being written, then start 
-         WriteStart(); 
-   } 
+   // called by the consumer: frees the ring up to tail, and restarts reading
+   // if the io service has stopped because the ring was full
+   void ConsumeTo(unsigned long tail)
+   {
+      GrblAtomicStore(&read_tail_, (long)tail);
+      if( GrblAtomicCompareExchange(&read_paused_, 1, 0))
+         io_service_.post(boost::bind(&AsioClient::ReadStart, this));
+   }
+
+   // looks for \n from the read index on, in at most two contiguous pieces
+   bool FindLine(std::string& line, unsigned long& length)
+   {
+      unsigned long tail = (unsigned long)GrblAtomicLoad(&read_tail_);
+      unsigned long available = (unsigned long)GrblAtomicLoad(&read_head_) - tail;
+      size_t start = tail & read_ring_mask;
+      size_t first = std::min<size_t>(available, read_ring_size - start);
+      const char* eol = (const char*)memchr(&read_ring_[start], '\n', first);
+      size_t eolOffset;
+      if( 0 != eol)
+         eolOffset = eol - &read_ring_[start];
+      else
+      {
+         eol = (const char*)memchr(&read_ring_[0], '\n', available - first);
+         if( 0 == eol)
+            return false;
+         eolOffset = first + (eol - &read_ring_[0]);
+      }
+      length = (unsigned long)(eolOffset + 1);
+      size_t content = eolOffset;
+      if( 0 < content && '\r' == read_ring_[(tail + content - 1) & read_ring_mask])
+         --content;
+      line.resize(content);
+      size_t piece = std::min(content, first);
+      if( 0 < piece)
+         memcpy(&line[0], &read_ring_[start], piece);
+      if( piece < content)
+         memcpy(&line[piece], &read_ring_[0], content - piece);
+      return true;
+   }
 
+   // for asynchronous write operations:
    void WriteStart(void) 
-   { // Start an asynchronous write and call WriteComplete when it completes or fails 
+   { // Start a gathered asynchronous write of everything pending and call WriteComplete when it completes or fails 
       MMThreadGuard g(writeBufferLock_);
+      if( 0 == write_count_)
+      {
+         write_in_progress_ = false;
+         return;
+      }
+      size_t first = std::min(write_count_, write_ring_size - write_head_);
+      boost::array<boost::asio::const_buffer, 2> buffers = {{
+         boost::asio::buffer(&write_ring_[write_head_], first),
+         boost::asio::buffer(&write_ring_[0], write_count_ - first) }};
+      write_in_flight_ = write_count_;
       boost::asio::async_write(serialPortImplementation_, 
-         boost::asio::buffer(&write_msgs_.front(), 1), 
+         buffers, 
          boost::bind(&AsioClient::WriteComplete, 
          this, 
          boost::asio::placeholders::error)); 
    } 
 
    void WriteComplete(const boost::system::error_code& error) 
-   { // the asynchronous read operation has now completed or failed and returned an error 
+   { // the asynchronous write operation has now completed or failed and returned an error 
       if (!error) 
-      { // write completed, so send next write data 
-         std::auto_ptr<MMThreadGuard> apwg( new MMThreadGuard(writeBufferLock_));
-         if ( 0 < write_msgs_.size())
-            write_msgs_.pop_front(); // remove the completed data 
-         bool anythingThere = !write_msgs_.empty();
-
-         // unlock the thread guard here
-         MMThreadGuard* pg = apwg.release();
-         delete pg;
+      { // write completed, so send whatever has been queued meanwhile 
+         bool anythingThere = false;
+         do{
+         MMThreadGuard g(writeBufferLock_);
+         write_head_ = (write_head_ + write_in_flight_) % write_ring_size;
+         write_count_ -= write_in_flight_;
+         write_in_flight_ = 0;
+         anythingThere = (0 < write_count_);
+         if( !anythingThere)
+            write_in_progress_ = false;
+         }while(bfalse_s);
 
          if (anythingThere) // if there is anthing left to be written 
             WriteStart(); // then start sending the next item in the buffer 
@@ -319,6 +426,12 @@ private:
       else 
       {
          pSerialPortAdapter_->LogMessage("error in WriteComplete: ", true);
+         do{
+         MMThreadGuard g(writeBufferLock_);
+         write_count_ = 0;
+         write_in_flight_ = 0;
+         write_in_progress_ = false;
+         }while(bfalse_s);
          DoClose(error); 
       }
    } 
@@ -346,6 +459,9 @@ private:
          serialPortImplementation_.close(); 
       }
       active_ = false; 
+      // lets the io service run out of work if reading was paused
+      delete read_paused_work_;
+      read_paused_work_ = 0;
    } 
 
 
@@ -353,13 +469,19 @@ private:
    bool active_; // remains true while this object is still operating 
    boost::asio::io_service& io_service_; // the main IO service that runs this connection 
    boost::asio::serial_port serialPortImplementation_; // the serial port this instance is connected to 
-   char read_msg_[max_read_length]; // data read from the socket 
-   std::deque<char> write_msgs_; // buffered write data 
-   std::deque<char> data_read_;
+   char write_ring_[write_ring_size]; // pending write data, never reallocated while async_write reads it 
+   size_t write_head_; // oldest pending byte 
+   size_t write_count_; // pending bytes, including those in flight 
+   size_t write_in_flight_; // bytes handed to the current async_write 
+   bool write_in_progress_; // a WriteStart is posted or an async_write is running 
+   char read_ring_[read_ring_size]; // received data, written by the io service thread only 
+   volatile long read_head_; // bytes received so far, moved by the producer 
+   volatile long read_tail_; // bytes consumed so far, moved by the consumer 
+   volatile long read_paused_; // 1 while no read is armed because the ring is full 
+   boost::asio::io_service::work* read_paused_work_; // held by the io service thread while reading is paused 
    SerialPort* pSerialPortAdapter_;
    std::string device_;
 
-   MMThreadLock readBufferLock_;
    MMThreadLock writeBufferLock_;
    MMThreadLock serviceLock_;
    MMThreadLock implementationLock_;
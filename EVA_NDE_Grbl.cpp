@@ -14,8 +14,10 @@
 
 #include "EVA_NDE_Grbl.h"
 #include "XYStage.h"
+#include "GrblDetector.h"
 #include "../../MMDevice/ModuleInterface.h"
 #include <sstream>
+#include <algorithm>
 #include <cstdio>
 
 #ifdef WIN32
@@ -38,6 +40,34 @@ const int g_Max_MMVersion = 10;
 const char* g_versionProp = "Version";
 const char* g_normalLogicString = "Normal";
 const char* g_invertedLogicString = "Inverted";
+const char* g_transportProp = "Transport";
+const char* g_transportMMPort = "MMPort";
+const char* g_transportNative = "Native";
+const char* g_transportSimulator = "Simulator";
+// longest time the bootloader and firmware take to start after the port opens
+const double g_controllerStartTimeoutMs = 2500.0;
+const char* g_metricsSnapshotProp = "MetricsSnapshot";
+const char* g_metricsIdle = "Idle";
+const char* g_metricsWrite = "Write";
+const char* g_metricsReset = "Reset";
+const char* g_trafficDumpProp = "TrafficDump";
+const char* g_trafficIdle = "Idle";
+const char* g_trafficWrite = "Write";
+const char* g_positionHistoryExportProp = "PositionHistoryExport";
+const char* g_positionHistoryIdle = "Idle";
+const char* g_positionHistoryWrite = "Write";
+// status queries older than this have lost their reply
+const double g_statusQueryLifetimeMs = 1000.0;
+// allowed for motion the trajectory model cannot estimate, such as homing
+const double g_unknownMotionMs = 60000.0;
+// the estimated time left for the queued moves is stretched by this and
+// g_motionMarginMs before a late reply or a late stop counts as a stall
+const double g_motionMarginFactor = 1.5;
+const double g_motionMarginMs = 1000.0;
+// how often WaitForMotionEnd wakes up to look at the estimate again
+const double g_motionRecheckMs = 250.0;
+// longest the I/O thread waits for input with no reply due earlier
+const double g_ioIdleMs = 100.0;
 
 // static lock
 MMThreadLock CEVA_NDE_GrblHub::lock_;
@@ -98,6 +128,191 @@ std::vector<std::string> split(const std::string &s, char delim) {
     return elems;
 }
 
+// feeds a prepared list of lines to CEVA_NDE_GrblHub::StreamCommands
+class VectorLineSource : public GrblLineSource
+{
+public:
+   VectorLineSource(const std::vector<std::string>& lines) : lines_(lines), next_(0) {}
+   bool NextLine(std::string& line)
+   {
+      if (next_ >= lines_.size())
+         return false;
+      line = lines_[next_++];
+      return true;
+   }
+private:
+   const std::vector<std::string>& lines_;
+   size_t next_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// StatusPollerThread class
+// (keeps the status snapshot of the hub fresh)
+///////////////////////////////////////////////////////////////////////////////
+
+class CEVA_NDE_GrblHub::StatusPollerThread : public MMDeviceThreadBase
+{
+   public:
+      StatusPollerThread(CEVA_NDE_GrblHub* hub) : stop_(false), hub_(hub) {}
+      virtual ~StatusPollerThread() {}
+
+      int svc()
+      {
+         while (!stop_)
+         {
+            double interval = hub_->GetStatusPollIntervalMs();
+            if (interval > 0.0)
+               hub_->GetStatus();
+            else
+               interval = 100.0; // polling disabled, check again later
+            CDeviceUtils::SleepMs((long) interval);
+         }
+         return 0;
+      }
+      void Stop() {stop_ = true;}
+
+   private:
+      volatile bool stop_;
+      CEVA_NDE_GrblHub* hub_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// IoThread class
+// (owns the port: writes the submitted lines and reads all replies)
+///////////////////////////////////////////////////////////////////////////////
+
+class CEVA_NDE_GrblHub::IoThread : public MMDeviceThreadBase
+{
+   public:
+      IoThread(CEVA_NDE_GrblHub* hub) : stop_(false), hub_(hub) {}
+      virtual ~IoThread() {}
+
+      int svc()
+      {
+         hub_->RunIo(stop_);
+         return 0;
+      }
+      void Stop() {stop_ = true;}
+
+   private:
+      volatile bool stop_;
+      CEVA_NDE_GrblHub* hub_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// MotionFence class
+// (submits G4 P0 when asked, its 'ok' tells that the planner has drained)
+///////////////////////////////////////////////////////////////////////////////
+
+class CEVA_NDE_GrblHub::MotionFence : public GrblCommandCallback
+{
+   public:
+      // the reply takes as long as the moves ahead of it, which the hub
+      // allows for on top of the timeout
+      MotionFence(CEVA_NDE_GrblHub* hub) : hub_(hub), request_(GrblCommand("G4P0", 60000.0), this), pending_(0) {}
+
+      // at most one fence is in flight, later requests are covered by it
+      void Request()
+      {
+         if (GrblAtomicCompareExchange(&pending_, 0, 1) && hub_->Submit(request_) != DEVICE_OK)
+            GrblAtomicStore(&pending_, 0);
+      }
+      void CommandCompleted(GrblCommandRequest& /*request*/)
+      {
+         GrblAtomicStore(&pending_, 0);
+      }
+
+   private:
+      CEVA_NDE_GrblHub* hub_;
+      GrblCommandRequest request_;
+      volatile long pending_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// SettingsCheck class
+// (dumps $$ in the background to confirm settings taken from the cache)
+///////////////////////////////////////////////////////////////////////////////
+
+class CEVA_NDE_GrblHub::SettingsCheck : public GrblCommandCallback
+{
+   public:
+      SettingsCheck(CEVA_NDE_GrblHub* hub) : hub_(hub), request_(GrblCommand("$$"), this), pending_(0) {}
+
+      // at most one check is in flight
+      void Request()
+      {
+         if (GrblAtomicCompareExchange(&pending_, 0, 1) && hub_->Submit(request_) != DEVICE_OK)
+            GrblAtomicStore(&pending_, 0);
+      }
+      // on the I/O thread, which guards the port
+      void CommandCompleted(GrblCommandRequest& request)
+      {
+         hub_->SettingsCheckedH(request);
+         GrblAtomicStore(&pending_, 0);
+      }
+
+   private:
+      CEVA_NDE_GrblHub* hub_;
+      GrblCommandRequest request_;
+      volatile long pending_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// MMPortTransport class
+// (talks to the board through the Micro-Manager serial port device)
+///////////////////////////////////////////////////////////////////////////////
+
+class CEVA_NDE_GrblHub::MMPortTransport : public GrblTransport
+{
+   public:
+      MMPortTransport(CEVA_NDE_GrblHub* hub) : hub_(hub), woken_(0) {}
+
+      int Write(const unsigned char* data, unsigned len)
+      {
+         return hub_->WriteToComPort(hub_->port_.c_str(), data, len);
+      }
+
+      int Read(unsigned char* data, unsigned maxLen, unsigned long& bytesRead, double timeoutMs)
+      {
+         // the port only offers non-blocking reads, so poll until the timeout
+         double deadlineMs = GrblNowMs() + timeoutMs;
+         for (;;)
+         {
+            int ret = hub_->ReadFromComPort(hub_->port_.c_str(), data, maxLen, bytesRead);
+            if (ret != DEVICE_OK || bytesRead > 0 || GrblNowMs() >= deadlineMs)
+               return ret;
+            if (GrblAtomicCompareExchange(&woken_, 1, 0))
+               return DEVICE_OK;
+            CDeviceUtils::SleepMs(1);
+         }
+      }
+
+      int Purge()
+      {
+         return hub_->PurgeComPort(hub_->port_.c_str());
+      }
+
+      void Wake()
+      {
+         GrblAtomicStore(&woken_, 1);
+      }
+
+   private:
+      CEVA_NDE_GrblHub* hub_;
+      volatile long woken_;
+};
+
+// registers the calling thread as the one reading replies from the port,
+// see CEVA_NDE_GrblHub::WaitForRealtimeReply
+class ActiveReaderGuard
+{
+public:
+   ActiveReaderGuard(volatile long& readers) : readers_(readers) {GrblAtomicIncrement(&readers_);}
+   ~ActiveReaderGuard() {GrblAtomicDecrement(&readers_);}
+private:
+   volatile long& readers_;
+};
+
 template <class Type>
 Type stringToNum(const std::string& str)
 {
@@ -118,6 +333,45 @@ initialized_ (false)
 
    timedOutputActive_ = false;
 
+   streamedBytes_ = 0;
+   rxBufferSize_ = GRBL_RX_BUFFER_SIZE;
+   ioThread_ = 0;
+   ioRunning_ = 0;
+   submitters_ = 0;
+
+   poller_ = 0;
+   commandOverheadMs_ = 0.0;
+   commandCount_ = 0;
+   transportName_ = g_transportMMPort;
+   mmTransport_ = new MMPortTransport(this);
+   nativeTransport_ = new NativeSerialTransport();
+   transport_ = mmTransport_;
+   simulator_ = 0;
+   simulatorBaudRate_ = 9600;
+   simulatorLineLatencyMs_ = 1.0;
+   parametersValid_ = false;
+   parametersVersion_ = 0;
+   activeReaders_ = 0;
+   statusReports_ = 0;
+   resets_ = 0;
+   lastQueryMs_ = 0.0;
+   motionWritten_ = 0;
+   motionAcked_ = 0;
+   motionDone_ = 0;
+   fence_ = new MotionFence(this);
+   settingsCheck_ = new SettingsCheck(this);
+   predictPosition_ = 1;
+   byteTimeMs_ = 10000.0 / 9600.0;
+   positionHistory_ = 0;
+   positionHistorySize_ = 65536;
+   positionHistoryFile_ = "EVA_NDE_Grbl-positions.csv";
+   statusPollIntervalMs_ = 50.0;
+   maxStatusAgeMs_ = 100.0;
+   metricsFile_ = "EVA_NDE_Grbl-metrics.jsonl";
+   trafficFile_ = "EVA_NDE_Grbl-traffic.bin";
+   trafficDumpOnError_ = 1;
+   baudRates_ = "115200,57600,9600";
+
    WPos[0] = 0.0;
    WPos[1] = 0.0;
    WPos[2] = 0.0;
@@ -134,11 +388,43 @@ initialized_ (false)
    errorText << "The firmware version on the EVA_NDE_Grbl is not compatible with this adapter.  Please use firmware version ";
 
    SetErrorText(ERR_VERSION_MISMATCH, errorText.str().c_str());
+   SetErrorText(ERR_COMMAND_REJECTED, "The EVA_NDE_Grbl controller answered a streamed command with an error");
+   SetErrorText(ERR_CONTROLLER_RESET, "The EVA_NDE_Grbl controller was reset while commands were in flight");
+   SetErrorText(ERR_MOTION_STALLED, "The EVA_NDE_Grbl stage did not finish its moves in the time they should take");
+   SetErrorText(ERR_LINE_TOO_LONG, "G-code line does not fit into the receive buffer of the EVA_NDE_Grbl controller");
 
    CPropertyAction* pAct  = new CPropertyAction(this, &CEVA_NDE_GrblHub::OnPort);
    //CreateProperty("ComPort", "Undifined", MM::String, false, pAct);
    CreateProperty(MM::g_Keyword_Port, "Undefined", MM::String, false, pAct, true);
 
+   pAct = new CPropertyAction(this, &CEVA_NDE_GrblHub::OnSettingsCacheDir);
+   CreateProperty("SettingsCacheDir", "", MM::String, false, pAct, true);
+
+   // tried in order by device detection, after the rate that worked last
+   pAct = new CPropertyAction(this, &CEVA_NDE_GrblHub::OnBaudRates);
+   CreateProperty("BaudRates", baudRates_.c_str(), MM::String, false, pAct, true);
+
+   // samples of the position history, 40 bytes each
+   pAct = new CPropertyAction(this, &CEVA_NDE_GrblHub::OnPositionHistorySize);
+   CreateProperty("PositionHistorySize", CDeviceUtils::ConvertToString(positionHistorySize_), MM::Integer, false, pAct, true);
+
+   pAct = new CPropertyAction(this, &CEVA_NDE_GrblHub::OnTransport);
+   CreateProperty(g_transportProp, g_transportMMPort, MM::String, false, pAct, true);
+   AddAllowedValue(g_transportProp, g_transportMMPort);
+   AddAllowedValue(g_transportProp, g_transportNative);
+   AddAllowedValue(g_transportProp, g_transportSimulator);
+
+   pAct = new CPropertyAction(this, &CEVA_NDE_GrblHub::OnSimulatorBaudRate);
+   CreateProperty("SimulatorBaudRate", CDeviceUtils::ConvertToString(simulatorBaudRate_), MM::Integer, false, pAct, true);
+   AddAllowedValue("SimulatorBaudRate", "9600");
+   AddAllowedValue("SimulatorBaudRate", "19200");
+   AddAllowedValue("SimulatorBaudRate", "38400");
+   AddAllowedValue("SimulatorBaudRate", "57600");
+   AddAllowedValue("SimulatorBaudRate", "115200");
+
+   pAct = new CPropertyAction(this, &CEVA_NDE_GrblHub::OnSimulatorLineLatency);
+   CreateProperty("SimulatorLineLatencyMs", CDeviceUtils::ConvertToString(simulatorLineLatencyMs_), MM::Float, false, pAct, true);
+
    pAct = new CPropertyAction(this, &CEVA_NDE_GrblHub::OnStatus);
    CreateProperty("Status", "-", MM::String, true, pAct);  //read only
 }
@@ -146,7 +432,11 @@ initialized_ (false)
 CEVA_NDE_GrblHub::~CEVA_NDE_GrblHub()
 {
    Shutdown();
-
+   delete nativeTransport_;
+   delete mmTransport_;
+   delete positionHistory_;
+   delete fence_;
+   delete settingsCheck_;
 }
 
 void CEVA_NDE_GrblHub::GetName(char* name) const
@@ -156,47 +446,283 @@ void CEVA_NDE_GrblHub::GetName(char* name) const
 
 bool CEVA_NDE_GrblHub::Busy()
 {
-   return false;
+   if (!IsMoving())
+      return false;
+   RequestMotionFence();
+   return true;
 }
 
-// private and expects caller to:
-// 1. guard the port
-// 2. purge the port
-int CEVA_NDE_GrblHub::GetStatus()
+void CEVA_NDE_GrblHub::RequestMotionFence()
 {
-   std::string cmd;
-   cmd.assign("?"); // x step/mm
-   std::string returnString;
-   int ret = SendCommand(cmd,returnString);
+   if (IsMoving())
+      fence_->Request();
+}
+
+/**
+ * Waits for the planner to drain. Completion is noticed by the thread reading
+ * the port, from the 'ok' of a G4 P0 fence or an Idle status report, and
+ * wakes the waiters at once.
+ */
+int CEVA_NDE_GrblHub::WaitForMotion(double deadlineMs)
+{
+   if (!IsMoving())
+      return DEVICE_OK;
+   RequestMotionFence();
+   motionCondition_.Lock();
+   while (IsMoving() && motionCondition_.WaitUntil(deadlineMs))
+      ;
+   bool moving = IsMoving();
+   motionCondition_.Unlock();
+   return moving ? DEVICE_SERIAL_TIMEOUT : DEVICE_OK;
+}
+
+/**
+ * Waits for the planner to drain like WaitForMotion, with the deadline taken
+ * from the trajectory model rather than fixed, so that a stage that has
+ * stopped short is noticed as soon as its moves are overdue. The deadline is
+ * estimated again whenever more motion is written while waiting.
+ */
+int CEVA_NDE_GrblHub::WaitForMotionEnd(double slackMs)
+{
+   if (!IsMoving())
+      return DEVICE_OK;
+   RequestMotionFence();
+   double deadlineMs = 0.0;
+   long written = 0;
+   bool estimated = false;
+   motionCondition_.Lock();
+   while (IsMoving())
+   {
+      double nowMs = GrblNowMs();
+      long current = GrblAtomicLoad(&motionWritten_);
+      if (!estimated || current != written)
+      {
+         double endMs;
+         if (!GetMotionEndMs(endMs))
+            endMs = nowMs + g_unknownMotionMs;
+         deadlineMs = endMs + slackMs;
+         written = current;
+         estimated = true;
+      }
+      if (nowMs >= deadlineMs)
+         break;
+      motionCondition_.WaitUntil(nowMs + g_motionRecheckMs < deadlineMs ? nowMs + g_motionRecheckMs : deadlineMs);
+   }
+   bool moving = IsMoving();
+   motionCondition_.Unlock();
+   if (!moving)
+      return DEVICE_OK;
+   metrics_.Increment(GrblMetrics::MOTION_STALLS);
+   LogMessage("motion did not finish in the estimated time");
+   return ERR_MOTION_STALLED;
+}
+
+bool CEVA_NDE_GrblHub::GetMotionEndMs(double& endMs)
+{
+   double nowMs = GrblNowMs();
+   if (!IsMoving())
+   {
+      endMs = nowMs;
+      return true;
+   }
+   return trajectory_.EstimateEndMs(nowMs, endMs);
+}
+
+GrblMachineLimits CEVA_NDE_GrblHub::GetMachineLimits() const
+{
+   GrblMachineLimits limits;
+   machineLimits_.Read(limits);
+   return limits;
+}
+
+// private and expects caller to guard the port
+// how much longer than usual the reply to the next line may take: Grbl holds
+// it back while its planner is full, and for a dwell until the planner has
+// drained and the dwell is over
+double CEVA_NDE_GrblHub::ReplyAllowanceMsH(double dwellMs)
+{
+   double endMs;
+   if (!GetMotionEndMs(endMs))
+      return dwellMs + g_unknownMotionMs;
+   double remainingMs = endMs - GrblNowMs();
+   if (remainingMs <= 0.0 && !IsMoving())
+      return dwellMs;
+   return dwellMs + g_motionMarginFactor * (remainingMs > 0.0 ? remainingMs : 0.0) + g_motionMarginMs;
+}
+
+// private and expects caller to guard the port
+// the controller has answered a line, with ok if accepted; if drained, its
+// planner is empty now. Grbl queues a move before it answers, so a drained
+// planner after the answer means that the move has finished.
+void CEVA_NDE_GrblHub::MotionAcknowledgedH(bool motion, bool accepted, bool drained)
+{
+   if (motion)
+   {
+      GrblAtomicIncrement(&motionAcked_);
+      // the move was queued when the controller began to send "ok\r\n"
+      trajectory_.Acknowledge(accepted, GrblNowMs() - 4.0 * byteTimeMs_);
+   }
+   if (drained)
+      MotionDoneH();
+}
+
+// private and expects caller to guard the port
+// every motion line answered so far has finished
+void CEVA_NDE_GrblHub::MotionDoneH()
+{
+   long acked = GrblAtomicLoad(&motionAcked_);
+   if (GrblAtomicLoad(&motionDone_) == acked)
+      return;
+   motionCondition_.Lock();
+   GrblAtomicStore(&motionDone_, acked);
+   motionCondition_.NotifyAll();
+   motionCondition_.Unlock();
+}
+
+// private and expects caller to guard the port
+// the answers to the motion lines in flight are lost; if flushed, the
+// controller has dropped them as well and stands still
+void CEVA_NDE_GrblHub::MotionAbortedH(bool flushed)
+{
+   GrblAtomicStore(&motionAcked_, GrblAtomicLoad(&motionWritten_));
+   trajectory_.Abort();
+   if (flushed)
+      MotionDoneH();
+}
+
+// Requests a status report with the real-time '?' and waits until it has been
+// published to the status snapshot. The report is read by whichever thread is
+// reading the port at the time, so commands in flight are not disturbed.
+int CEVA_NDE_GrblHub::GetStatus(double timeoutMs)
+{
+   if(!portAvailable_)
+	   return ERR_NO_PORT_SET;
+   GrblLatencyTimer timer(metrics_, GrblMetrics::STATUS);
+   long reports = GrblAtomicLoad(&statusReports_);
+   {
+      // the report is timed halfway between the query and the reply
+      MMThreadGuard guard(queryLock_);
+      lastQueryMs_ = GrblNowMs();
+   }
+   int ret = SendRealtime(GRBL_RT_STATUS);
    if (ret != DEVICE_OK)
    {
 	 LogMessage("command send failed!");
     return ret;
    }
-   std::vector<std::string> tokenInput;
-	char* pEnd;
-   	CDeviceUtils::Tokenize(returnString, tokenInput, "<>,:\r\n");
-   //sample: <Idle,MPos:0.000,0.000,0.000,WPos:0.000,0.000,0.000>
-	if(tokenInput.size() != 9)
-	{
-		LogMessage(returnString.c_str());
-		LogMessage("echo error!");
-		return DEVICE_ERR;
-	}
-	status.assign(tokenInput[0].c_str());
-	MPos[0] = stringToNum<double>(tokenInput[2]);
-	MPos[1] = stringToNum<double>(tokenInput[3]);
-	MPos[2] = stringToNum<double>(tokenInput[4]);
-	WPos[0] = stringToNum<double>(tokenInput[6]);
-	WPos[1] = stringToNum<double>(tokenInput[7]);
-	WPos[2] = stringToNum<double>(tokenInput[8]);
+   return WaitForRealtimeReply(&statusReports_, reports, timeoutMs);
+}
+
+// private and expects caller to guard the port
+// parses a report like <Idle,MPos:0.000,0.000,0.000,WPos:0.000,0.000,0.000>
+int CEVA_NDE_GrblHub::ParseStatusReportH(const std::string& report)
+{
+   GrblStatusSnapshot snapshot;
+   if (!ParseGrblStatusReport(report.data(), report.data() + report.length(), snapshot))
+   {
+      LogMessage(report.c_str());
+      LogMessage("echo error!");
+      return DEVICE_ERR;
+   }
+   snapshot.timestampMs = GrblNowMs();
+   statusSnapshot_.Write(snapshot);
+   CountRealtimeReply(&statusReports_);
+   // reports are read in order with the answers, so the moves answered so
+   // far were queued before this report was made
+   bool idle = strcmp(snapshot.status, "Idle") == 0;
+   if (idle)
+      MotionDoneH();
+   // the report was made before its bytes had crossed the line
+   double madeMs = snapshot.timestampMs - (report.length() + 2) * byteTimeMs_;
+   double error = trajectory_.Correct(snapshot.WPos, idle, madeMs);
+   if (error >= 0.0)
+      metrics_.RecordPredictionError(1000.0 * error);
+
+   if (positionHistory_)
+   {
+      // Grbl answers all '?' that arrived before the report was made with
+      // this one report, so it was made after the last of them. A query sent
+      // after madeMs is left to the next report; the earlier ones it replaced
+      // are not kept, the window then starts at madeMs.
+      double queryMs = madeMs;
+      {
+         MMThreadGuard guard(queryLock_);
+         if (lastQueryMs_ > 0.0 && lastQueryMs_ <= madeMs)
+         {
+            if (snapshot.timestampMs - lastQueryMs_ < g_statusQueryLifetimeMs)
+               queryMs = lastQueryMs_;
+            lastQueryMs_ = 0.0;
+         }
+      }
+      GrblPositionSample sample;
+      sample.timeMs = 0.5 * (queryMs + snapshot.timestampMs);
+      for (int i = 0; i < 3; ++i)
+         sample.MPos[i] = snapshot.MPos[i];
+      positionHistory_->Add(sample);
+   }
+
+   status.assign(snapshot.status);
+   for (int i = 0; i < 3; ++i)
+   {
+      MPos[i] = snapshot.MPos[i];
+      WPos[i] = snapshot.WPos[i];
+   }
+   return DEVICE_OK;
+}
+
+/**
+ * Predicts the position from the trapezoidal profiles of the moves the
+ * controller has taken, at $5 seek rate or the programmed feed and $8
+ * acceleration, so it is known to well under a millisecond between status
+ * reports. Each report corrects the model; the distances it was off by are
+ * kept in the PredictionErrorNm histogram.
+ */
+bool CEVA_NDE_GrblHub::PredictPosition(double timeMs, double position[2])
+{
+   if (!predictPosition_)
+      return false;
+   GrblStatusSnapshot snapshot;
+   if (statusSnapshot_.Read(snapshot) == 0)
+      return false;
+   double work[2];
+   if (!trajectory_.Predict(timeMs, work))
+      return false;
+   // the model follows the G-code, which is in work coordinates
+   for (int i = 0; i < 2; ++i)
+      position[i] = work[i] + snapshot.MPos[i] - snapshot.WPos[i];
+   return true;
+}
+
+int CEVA_NDE_GrblHub::GetPositionAt(double timeMs, double position[3])
+{
+   if (!positionHistory_ || !positionHistory_->GetPositionAt(timeMs, position))
+      return ERR_UNKNOWN_POSITION;
    return DEVICE_OK;
+}
+
+void CEVA_NDE_GrblHub::ExportPositionHistory(std::vector<GrblPositionSample>& samples, double sinceMs)
+{
+   samples.clear();
+   if (positionHistory_)
+      positionHistory_->Export(samples, sinceMs);
+}
 
+int CEVA_NDE_GrblHub::GetStatusSnapshot(GrblStatusSnapshot& snapshot, double maxAgeMs)
+{
+   if (statusSnapshot_.Read(snapshot) != 0 && GrblNowMs() - snapshot.timestampMs <= maxAgeMs)
+      return DEVICE_OK;
+   // no report yet or too old, ask the controller
+   int ret = GetStatus();
+   if (ret != DEVICE_OK)
+      return ret;
+   statusSnapshot_.Read(snapshot);
+   return DEVICE_OK;
 }
+
 int CEVA_NDE_GrblHub::SetSync(int axis, double value ){
    std::string cmd;
-   char buff[20];
-   sprintf(buff, "M108P%.3fQ%d", value,axis);
+   char buff[64];
+   snprintf(buff, sizeof(buff), "M108P%.3fQ%d", value,axis);
    cmd.assign(buff); 
    std::string returnString;
    int ret = SendCommand(cmd,returnString);
@@ -204,15 +730,15 @@ int CEVA_NDE_GrblHub::SetSync(int axis, double value ){
 }
 int CEVA_NDE_GrblHub::SetParameter(int index, double value){
    std::string cmd;
-   char buff[20];
-   sprintf(buff, "$%d=%.3f", index,value);
+   char buff[64];
+   snprintf(buff, sizeof(buff), "$%d=%.3f", index,value);
    cmd.assign(buff); 
    std::string returnString;
-   int ret = SendCommand(cmd,returnString);
-   return ret;
+   // SendCommand reads back what the firmware actually stored
+   return SendCommand(cmd,returnString);
 }
 //int CEVA_NDE_GrblHub::Reset(){
-//	MMThreadGuard(this->executeLock_);
+//	MMThreadGuard guard(this->executeLock_);
 //   std::string cmd;
 //   char buff[]={0x18,0x00};
 //   cmd.assign(buff); 
@@ -267,38 +793,182 @@ int CEVA_NDE_GrblHub::GetParameters()
 	*/
    if(!portAvailable_)
 	   return ERR_NO_PORT_SET;
+   GrblSettingsCache cache = GetSettingsCache();
+   {
+      MMThreadGuard guard(executeLock_);
+      if (parametersValid_)
+         return DEVICE_OK;
+
+      std::string banner;
+      std::vector<double> cached;
+      // an unknown banner means no reset has been seen yet, the cache still applies
+      if (cache.Load(banner, cached) && cached.size() == PARAMETERS_COUNT &&
+         (version_.empty() || version_ == banner))
+      {
+         parameters = cached;
+         cachedBanner_ = banner;
+         parametersValid_ = true;
+         ParametersChangedH();
+         // but the firmware may have been flashed or its settings changed by
+         // another program since, so it is only used until $$ has answered
+         if (version_.empty())
+            settingsCheck_->Request();
+         return DEVICE_OK;
+      }
+   }
+
+   // not under the lock, the I/O thread needs it to answer $$
+   std::vector<double> values;
+   int ret = ReadParameters(values);
+   if (ret != DEVICE_OK)
+      return ret;
+   MMThreadGuard guard(executeLock_);
+   parameters = values;
+   parametersValid_ = true;
+   ParametersChangedH();
+   cachedBanner_ = version_;
+   if (!cache.Save(version_, parameters))
+      LogMessage("Could not write settings cache " + cache.GetPath());
+   return DEVICE_OK;
+}
+
+// dumps the settings with $$
+int CEVA_NDE_GrblHub::ReadParameters(std::vector<double>& values)
+{
    std::string cmd;
-   cmd.assign("$$"); // x step/mm
+   cmd.assign("$$");
    std::string returnString;
    int ret = SendCommand(cmd,returnString);
    if (ret != DEVICE_OK)
     return ret;
-   
+   return ParseParameters(returnString, values);
+}
+
+// the values of a $$ dump, in order
+int CEVA_NDE_GrblHub::ParseParameters(const std::string& dump, std::vector<double>& values)
+{
    	std::vector<std::string> tokenInput;
 
-	char* pEnd;
-   	CDeviceUtils::Tokenize(returnString, tokenInput, "$=()\r\n");
+   	CDeviceUtils::Tokenize(dump, tokenInput, "$=()\r\n");
    if(tokenInput.size() != PARAMETERS_COUNT*3)
 	   return DEVICE_ERR;
-   parameters.clear();
+   values.clear();
    std::vector<std::string>::iterator it;
    for (it=tokenInput.begin(); it!=tokenInput.end(); it+=3)
    {
 	   std::string str = *(it+1);
-	   parameters.push_back(stringToNum<double>(str));
+	   values.push_back(stringToNum<double>(str));
    }
    return DEVICE_OK;
 
 }
+
+// the cache file of the controller on port_, which follows it to another port
+GrblSettingsCache CEVA_NDE_GrblHub::GetSettingsCache() const
+{
+   return GrblSettingsCache(settingsCacheDir_, GrblPortScanner::GetDeviceId(port_));
+}
+
+// private and expects caller to guard the port
+// replaces settings taken from the cache if the controller reports others
+void CEVA_NDE_GrblHub::SettingsCheckedH(const GrblCommandRequest& request)
+{
+   std::vector<double> values;
+   if (request.GetResult() != DEVICE_OK || ParseParameters(request.GetResponse(), values) != DEVICE_OK)
+   {
+      // unconfirmed, the next GetParameters tries again
+      parametersValid_ = false;
+      return;
+   }
+   // invalidated meanwhile, or confirmed
+   if (!parametersValid_ || values == parameters)
+      return;
+   LogMessage("Cached settings differ from the controller, replaced");
+   parameters = values;
+   ParametersChangedH();
+   cachedBanner_ = version_;
+   GrblSettingsCache cache = GetSettingsCache();
+   if (!cache.Save(version_, parameters))
+      LogMessage("Could not write settings cache " + cache.GetPath());
+}
+
+// private and expects caller to guard the port
+// publishes newly loaded settings
+void CEVA_NDE_GrblHub::ParametersChangedH()
+{
+   GrblMachineLimits limits;
+   if (limits.FromParameters(parameters))
+   {
+      trajectory_.SetLimits(limits);
+      machineLimits_.Write(limits);
+   }
+   GrblAtomicIncrement(&parametersVersion_);
+}
+
+// private and expects caller to guard the port
+// adds a line about to be written to the trajectory model, before modal_
+// has observed it
+void CEVA_NDE_GrblHub::PlanLineH(const std::string& line)
+{
+   if (line.compare(0, 2, "$H") == 0)
+   {
+      // where homing ends is only known from the next report
+      trajectory_.AddUnknownMove();
+      return;
+   }
+   if (line.length() == 0 || line[0] == '$')
+      return;
+   double values[3];
+   int axes = ParseGrblAxisWords(line, values);
+   if (axes == 0)
+      return;
+   if (!IsGrblMotionLine(line))
+   {
+      // G10 and G92 shift the work coordinates the model is kept in
+      trajectory_.Invalidate();
+      return;
+   }
+   GrblModalState state = modal_;
+   state.Observe(line);
+   if (state.GetUnits() != GrblModalState::MILLIMETERS ||
+      state.GetDistance() == GrblModalState::DISTANCE_UNKNOWN ||
+      state.GetMotion() == GrblModalState::MOTION_UNKNOWN)
+   {
+      trajectory_.AddUnknownMove();
+      return;
+   }
+   trajectory_.AddMove(values, axes, state.GetDistance() == GrblModalState::RELATIVE_DISTANCE,
+      state.GetMotion() == GrblModalState::RAPID, state.GetFeed());
+}
+
+// the next GetParameters reads the settings from the controller again
+void CEVA_NDE_GrblHub::InvalidateParameters()
+{
+   MMThreadGuard guard(executeLock_);
+   InvalidateParametersH();
+}
+
+// private and expects caller to guard the port
+void CEVA_NDE_GrblHub::InvalidateParametersH()
+{
+   parametersValid_ = false;
+   GetSettingsCache().Remove();
+}
+
 int CEVA_NDE_GrblHub::SendCommand(std::string command, std::string &returnString)
+{
+   return SendCommand(GrblCommand(command), returnString);
+}
+
+int CEVA_NDE_GrblHub::SendCommand(const GrblCommand& command, std::string &returnString)
 {
    if(!portAvailable_)
 	   return ERR_NO_PORT_SET;
-   // needs a lock because the other Thread will also use this function
-   MMThreadGuard(this->executeLock_);
-   PurgeComPortH();
+   if(command.line.length() == 1 && IsRealtimeCommand(command.line[0]))
+	   return SendRealtimeCommand(command.line[0], returnString);
+   GrblLatencyTimer timer(metrics_, GrblMetrics::Classify(command));
    int ret = DEVICE_OK;
-   	if(command.c_str()[0] == '$' && command.c_str()[1] == 'H') 
+   	if(command.IsHoming()) 
 	{
 		// Check that we have a controller:
 		ret = GetStatus();
@@ -307,118 +977,769 @@ int CEVA_NDE_GrblHub::SendCommand(std::string command, std::string &returnString
 		ret = GetParameters();
 		if( DEVICE_OK != ret)
 		return ret;
-	   	SetAnswerTimeoutMs(60000.0);
 	}
-   else if(command.c_str()[0] == '$' || command.c_str()[0] == '?')
-	  SetAnswerTimeoutMs(5000.0);//for long command
-   else
-	  SetAnswerTimeoutMs(300.0); //for normal command
+   GrblCommandRequest request(command);
+   ret = Submit(request);
+   if (ret != DEVICE_OK)
+      return ret;
+   request.Wait();
+   ret = GetCommandResult(request, returnString);
+   // the ok of $N= has invalidated the settings, reload them so that the
+   // machine limits and the step scale follow
+   if (ret == DEVICE_OK && IsGrblSettingLine(command.line))
+      ret = GetParameters();
+   return ret;
+}
 
-   ret = SetCommandComPortH(command.c_str(),"\n");
+/**
+ * Sends a motion line in millimetres, adding only the G90/G91, G0/G1, G21 and
+ * F words that the controller's modal state does not already have, so a move
+ * takes one round trip and as few bytes as possible. axisWords holds the axis
+ * words only, e.g. X1.5Y2.
+ */
+int CEVA_NDE_GrblHub::SendMotion(GrblModalState::Distance distance, GrblModalState::Motion motion,
+   const std::string& axisWords, double feedMmPerMin, std::string& returnString)
+{
+   if(!portAvailable_)
+	   return ERR_NO_PORT_SET;
+   GrblLatencyTimer timer(metrics_, GrblMetrics::MOTION);
+   // encoded by the I/O thread against the state the line will meet
+   GrblCommandRequest request(distance, motion, axisWords, feedMmPerMin);
+   int ret = Submit(request);
    if (ret != DEVICE_OK)
+      return ret;
+   request.Wait();
+   return GetCommandResult(request, returnString);
+}
+
+/**
+ * Hands a request to the I/O thread without waiting for the port. Requests
+ * are written in the order they were submitted, each as soon as it fits into
+ * the receive buffer of the controller, so lines from several threads are in
+ * flight together instead of each waiting for the reply to the one before.
+ */
+int CEVA_NDE_GrblHub::Submit(GrblCommandRequest& request)
+{
+   GrblAtomicIncrement(&submitters_);
+   if (!GrblAtomicLoad(&ioRunning_))
    {
-	    LogMessage(std::string("command write fail"));
-	   return ret;
-   }
-   std::string an;
-   if(command.c_str()[0] == 0x18 ){
-        CDeviceUtils::SleepMs(600);
-	    ret = GetParameters();
-	    returnString.assign("ok");
-		LogMessage(std::string("Reset!"));
-		return DEVICE_OK;
-   }
-   else if(command.c_str()[0] == '$' || command.c_str()[0] == '?'){
-
-		ret = GetSerialAnswerComPortH(an,"ok\r\n");
-	   //ret = comPort->Read(answer,3,charsRead);
-	   if (ret != DEVICE_OK)
-	   {
-		   LogMessage(std::string("answer get error!"));
-		  return ret;
-	   }
-	   returnString.assign(an);
-	   return DEVICE_OK;
-
-   }
-   else{ 
-	   try
-	   {
-
-			ret = GetSerialAnswerComPortH(an,"\r\n");
-		   //ret = comPort->Read(answer,3,charsRead);
-		   if (ret != DEVICE_OK)
-		   {
-			   LogMessage(std::string("answer get error!_"));
-			  return ret;
-		   }
-		   LogMessage(std::string(an),true);
-		   //sample:>>? >><Idle,MPos:0.000,0.000,0.000,WPos:0.000,0.000,0.000>
-		   if (an.length() <1)
-			  return DEVICE_ERR;
-		   returnString.assign(an);
-		   if (returnString.find("ok") != std::string::npos)
-			   return DEVICE_OK;
-		   else
-			   return DEVICE_ERR;
-	   }
-	   catch(...)
-	   {
-		  LogMessage("Exception in send command!");
-		  return DEVICE_ERR;
-	   }
+      GrblAtomicDecrement(&submitters_);
+      return ERR_NO_PORT_SET;
+   }
+   request.Prepare(GrblNowMs());
+   commandQueue_.Push(&request);
+   transport_->Wake();
+   GrblAtomicDecrement(&submitters_);
+   return DEVICE_OK;
+}
 
+// the reply to an answered request, as SendCommand returns it
+int CEVA_NDE_GrblHub::GetCommandResult(const GrblCommandRequest& request, std::string& returnString)
+{
+   int ret = request.GetResult();
+   if (ret != DEVICE_OK && ret != DEVICE_ERR)
+      return ret;
+   if (ret == DEVICE_OK && request.command_.IsSystemCommand())
+   {
+      // settings and homing output, without the final ok
+      returnString.assign(request.GetResponse());
+      return DEVICE_OK;
    }
+   returnString.assign(request.GetResponse() + request.GetAck());
+   return ret;
 }
 
-MM::DeviceDetectionStatus CEVA_NDE_GrblHub::DetectDevice(void)
+/**
+ * Writes a single-byte real-time command. Grbl picks these out of the serial
+ * stream as they arrive, so they need no newline, are never queued and may be
+ * sent while other commands are in flight.
+ */
+int CEVA_NDE_GrblHub::SendRealtime(char command)
 {
-  if (initialized_)
-      return MM::CanCommunicate;
+   if(!portAvailable_)
+	   return ERR_NO_PORT_SET;
+   GrblLatencyTimer timer(metrics_, GrblMetrics::REALTIME);
+   return WriteToComPortH((const unsigned char*) &command, 1);
+}
 
-   // all conditions must be satisfied...
-   MM::DeviceDetectionStatus result = MM::Misconfigured;
-   char answerTO[MM::MaxStrLength];
-   
-   try
-   {
-      std::string portLowerCase = port_;
-      for( std::string::iterator its = portLowerCase.begin(); its != portLowerCase.end(); ++its)
-      {
-         *its = (char)tolower(*its);
-      }
-      if( 0< portLowerCase.length() &&  0 != portLowerCase.compare("undefined")  && 0 != portLowerCase.compare("unknown") )
-      {
-         result = MM::CanNotCommunicate;
-         // record the default answer time out
-         GetCoreCallback()->GetDeviceProperty(port_.c_str(), "AnswerTimeout", answerTO);
+int CEVA_NDE_GrblHub::FeedHold()
+{
+   return SendRealtime(GRBL_RT_FEED_HOLD);
+}
 
-         // device specific default communication parameters
-         // for Arduino Duemilanova
-         GetCoreCallback()->SetDeviceProperty(port_.c_str(), MM::g_Keyword_Handshaking, "Off");
-         GetCoreCallback()->SetDeviceProperty(port_.c_str(), MM::g_Keyword_BaudRate, "9600" );
-         GetCoreCallback()->SetDeviceProperty(port_.c_str(), MM::g_Keyword_StopBits, "1");
-         // Arduino timed out in GetControllerVersion even if AnswerTimeout  = 300 ms
+int CEVA_NDE_GrblHub::CycleStart()
+{
+   return SendRealtime(GRBL_RT_CYCLE_START);
+}
+
+/**
+ * Soft reset (Ctrl-X): the controller stops, drops all queued lines and
+ * prints its startup banner. Settings are read again afterwards.
+ */
+int CEVA_NDE_GrblHub::SoftReset()
+{
+   long resets = GrblAtomicLoad(&resets_);
+   int ret = SendRealtime(GRBL_RT_RESET);
+   if (ret != DEVICE_OK)
+      return ret;
+   ret = WaitForRealtimeReply(&resets_, resets, 2000.0);
+   if (ret != DEVICE_OK)
+      return ret;
+   LogMessage(std::string("Reset!"));
+   return GetParameters();
+}
+
+bool CEVA_NDE_GrblHub::IsRealtimeCommand(char command)
+{
+   return command == GRBL_RT_STATUS || command == GRBL_RT_FEED_HOLD ||
+      command == GRBL_RT_CYCLE_START || command == GRBL_RT_RESET;
+}
+
+// real-time commands written through the Command property or SendCommand
+int CEVA_NDE_GrblHub::SendRealtimeCommand(char command, std::string& returnString)
+{
+   int ret;
+   if (command == GRBL_RT_STATUS)
+   {
+      ret = GetStatus();
+      if (ret != DEVICE_OK)
+         return ret;
+      GrblStatusSnapshot s;
+      statusSnapshot_.Read(s);
+      char buff[160];
+      snprintf(buff, sizeof(buff), "<%s,MPos:%.3f,%.3f,%.3f,WPos:%.3f,%.3f,%.3f>",
+         s.status, s.MPos[0], s.MPos[1], s.MPos[2], s.WPos[0], s.WPos[1], s.WPos[2]);
+      returnString.assign(buff);
+      return DEVICE_OK;
+   }
+   if (command == GRBL_RT_RESET)
+      ret = SoftReset();
+   else
+      ret = SendRealtime(command);
+   if (ret == DEVICE_OK)
+      returnString.assign("ok");
+   return ret;
+}
+
+/**
+ * Waits until a real-time reply has been counted in *counter. Once the I/O
+ * thread runs, it reads the port, dispatches the reply and signals
+ * replyCondition_; before that the port is read here. Must not be called by
+ * a thread that is itself registered in activeReaders_.
+ */
+int CEVA_NDE_GrblHub::WaitForRealtimeReply(volatile long* counter, long seen, double timeoutMs)
+{
+   double deadlineMs = GrblNowMs() + timeoutMs;
+   while (GrblAtomicLoad(counter) == seen)
+   {
+      if (GrblNowMs() > deadlineMs)
+      {
+         metrics_.Increment(GrblMetrics::TIMEOUTS);
+         recorder_.Record(GrblTraceRecord::TIMEOUT);
+         return DEVICE_SERIAL_TIMEOUT;
+      }
+      if (GrblAtomicLoad(&activeReaders_) > 0)
+      {
+         // rechecked now and then in case the I/O thread stops meanwhile
+         double untilMs = std::min(deadlineMs, GrblNowMs() + g_ioIdleMs);
+         replyCondition_.Lock();
+         while (GrblAtomicLoad(counter) == seen && replyCondition_.WaitUntil(untilMs))
+            ;
+         replyCondition_.Unlock();
+         continue;
+      }
+      MMThreadGuard guard(executeLock_);
+      if (GrblAtomicLoad(counter) != seen)
+         break;
+      std::string line;
+      int ret = ReadLineH(line, deadlineMs);
+      if (ret != DEVICE_OK)
+         return ret;
+      DispatchReplyH(line);
+   }
+   return DEVICE_OK;
+}
+
+// counts a status report or a reset and wakes WaitForRealtimeReply
+void CEVA_NDE_GrblHub::CountRealtimeReply(volatile long* counter)
+{
+   replyCondition_.Lock();
+   GrblAtomicIncrement(counter);
+   replyCondition_.NotifyAll();
+   replyCondition_.Unlock();
+}
+
+// private and expects caller to guard the port
+// status reports and the startup banner are consumed here, whoever reads them
+CEVA_NDE_GrblHub::ReplyType CEVA_NDE_GrblHub::DispatchReplyH(const std::string& line)
+{
+   if (line.compare(0, 2, "ok") == 0)
+      return REPLY_OK;
+   if (line.compare(0, 5, "error") == 0)
+   {
+      metrics_.Increment(GrblMetrics::ERROR_REPLIES);
+      return REPLY_ERROR;
+   }
+   if (line.length() > 0 && line[0] == '<')
+   {
+      ParseStatusReportH(line);
+      return REPLY_STATUS;
+   }
+   if (line.compare(0, 4, "Grbl") == 0)
+   {
+      // sample: Grbl 0.8c ['$' for help]
+      // the controller has been reset and dropped everything in flight
+      version_ = line;
+      // settings cached for another firmware no longer apply
+      if (!cachedBanner_.empty() && cachedBanner_ != version_)
+         parametersValid_ = false;
+      modal_.Invalidate();
+      MotionAbortedH(true);
+      CountRealtimeReply(&resets_);
+      return REPLY_RESET;
+   }
+   if (line.compare(0, 5, "ALARM") == 0)
+   {
+      modal_.Invalidate();
+      // the controller has stopped and ignores motion until it is reset
+      MotionAbortedH(true);
+   }
+   return REPLY_MESSAGE;
+}
+
+// private and expects caller to guard the port
+// splits the next complete line off the received bytes, without its terminator
+bool CEVA_NDE_GrblHub::TakeLineH(std::string& line)
+{
+   std::string::size_type eol = rxBuffer_.find('\n');
+   if (eol == std::string::npos)
+      return false;
+   std::string::size_type len = eol;
+   if (len > 0 && rxBuffer_[len - 1] == '\r')
+      --len;
+   line.assign(rxBuffer_, 0, len);
+   rxBuffer_.erase(0, eol + 1);
+   return true;
+}
+
+// private and expects caller to guard the port
+// reads one line from the port, without its terminator
+int CEVA_NDE_GrblHub::ReadLineH(std::string& line, double deadlineMs, bool countTimeout)
+{
+   while (!TakeLineH(line))
+   {
+      double remainingMs = deadlineMs - GrblNowMs();
+      if (remainingMs < 0.0)
+      {
+         if (countTimeout)
+         {
+            metrics_.Increment(GrblMetrics::TIMEOUTS);
+            recorder_.Record(GrblTraceRecord::TIMEOUT);
+         }
+         return DEVICE_SERIAL_TIMEOUT;
+      }
+      unsigned char buff[128];
+      unsigned long read = 0;
+      int ret = ReadFromComPortH(buff, sizeof(buff), read, remainingMs);
+      if (ret != DEVICE_OK)
+         return ret;
+      rxBuffer_.append((const char*) buff, read);
+   }
+   return DEVICE_OK;
+}
+
+// private and expects caller to guard the port
+// waits until the controller is running: its startup banner after the reset
+// that opening the port causes, or the reply to a status query if the board
+// did not reset. The query is repeated, so the wait ends as soon as the
+// bootloader has handed over rather than after a fixed delay.
+int CEVA_NDE_GrblHub::WaitForControllerH(double timeoutMs)
+{
+   double deadlineMs = GrblNowMs() + timeoutMs;
+   for (;;)
+   {
+      double pollEndMs = GrblNowMs() + 100.0;
+      if (pollEndMs > deadlineMs)
+         pollEndMs = deadlineMs;
+      const unsigned char query = GRBL_RT_STATUS;
+      int ret = WriteToComPortH(&query, 1);
+      if (ret != DEVICE_OK)
+         return ret;
+      std::string line;
+      // a wrong baud rate or the bootloader give no lines, or garbage
+      while ((ret = ReadLineH(line, pollEndMs, false)) == DEVICE_OK)
+      {
+         ReplyType type = DispatchReplyH(line);
+         if (type == REPLY_RESET || type == REPLY_STATUS)
+            return DEVICE_OK;
+      }
+      if (ret != DEVICE_SERIAL_TIMEOUT)
+         return ret;
+      if (GrblNowMs() >= deadlineMs)
+         return ERR_BOARD_NOT_FOUND;
+   }
+}
+
+// the loop of the I/O thread
+void CEVA_NDE_GrblHub::RunIo(volatile bool& stop)
+{
+   // replies to real-time commands are dispatched here as well
+   ActiveReaderGuard reader(activeReaders_);
+   while (!stop)
+      PumpIo();
+}
+
+// one round of the I/O thread: handles the replies received, writes what
+// fits and waits for input, a wake-up from Submit or the next deadline
+void CEVA_NDE_GrblHub::PumpIo()
+{
+   double waitMs = g_ioIdleMs;
+   {
+      MMThreadGuard guard(executeLock_);
+      std::string line;
+      while (TakeLineH(line))
+         HandleReplyH(line);
+      TakeRequestsH();
+      WriteRequestsH();
+      if (!streamedLines_.empty())
+      {
+         // replies come in order, the oldest line is the one waited for
+         double remainingMs = streamedLines_.front().deadlineMs - GrblNowMs();
+         if (remainingMs < 0.0)
+         {
+            metrics_.Increment(GrblMetrics::TIMEOUTS);
+            recorder_.Record(GrblTraceRecord::TIMEOUT);
+            LinesLostH(DEVICE_SERIAL_TIMEOUT);
+            return;
+         }
+         if (remainingMs < waitMs)
+            waitMs = remainingMs;
+      }
+   }
+
+   // not under the lock, so that the status poller and real-time commands
+   // never wait for the port
+   unsigned char buff[128];
+   unsigned long read = 0;
+   int ret = ReadFromComPortH(buff, sizeof(buff), read, waitMs);
+   if (ret == DEVICE_OK)
+   {
+      MMThreadGuard guard(executeLock_);
+      rxBuffer_.append((const char*) buff, read);
+      return;
+   }
+   {
+      MMThreadGuard guard(executeLock_);
+      LinesLostH(ret);
+   }
+   CDeviceUtils::SleepMs(10);
+}
+
+// private and expects caller to guard the port
+// moves the submitted requests to waitingRequests_, in order
+void CEVA_NDE_GrblHub::TakeRequestsH()
+{
+   GrblCommandRequest* request;
+   while ((request = commandQueue_.Pop()) != 0)
+      waitingRequests_.push_back(request);
+}
+
+// private and expects caller to guard the port
+// writes the waiting requests for as long as their lines fit into the
+// receive buffer of the controller, using Grbl's character-counting flow
+// control. A stream keeps later requests waiting until all of its lines
+// have been answered.
+void CEVA_NDE_GrblHub::WriteRequestsH()
+{
+   while (!waitingRequests_.empty())
+   {
+      GrblCommandRequest* request = waitingRequests_.front();
+      if (request->kind_ == GrblCommandRequest::STREAM)
+      {
+         while (!request->sourceDone_)
+         {
+            if (!request->hasNextLine_)
+            {
+               if (!request->source_->NextLine(request->nextLine_))
+               {
+                  request->sourceDone_ = true;
+                  break;
+               }
+               request->hasNextLine_ = true;
+            }
+            unsigned len = (unsigned) request->nextLine_.length() + 1;
+            if (len > (unsigned) rxBufferSize_)
+            {
+               request->result_ = ERR_LINE_TOO_LONG;
+               request->sourceDone_ = true;
+               break;
+            }
+            // wait until the controller has consumed enough of its receive buffer
+            if (streamedBytes_ + len > (unsigned) rxBufferSize_)
+               return;
+            request->hasNextLine_ = false;
+            int ret = WriteLineH(request, request->linesWritten_ + 1, request->nextLine_);
+            if (ret != DEVICE_OK)
+            {
+               request->result_ = ret;
+               request->sourceDone_ = true;
+            }
+         }
+         if (request->linesAnswered_ < request->linesWritten_)
+            return;
+         FinishStreamH(request);
+         continue;
+      }
+
+      if (request->kind_ == GrblCommandRequest::MOTION)
+         request->command_ = GrblCommand(modal_.Encode(request->distance_, request->motion_,
+            request->axisWords_, request->feedMmPerMin_));
+      unsigned len = (unsigned) request->command_.line.length() + 1;
+      // a line longer than the buffer is written once nothing else is in flight
+      if (!streamedLines_.empty() && streamedBytes_ + len > (unsigned) rxBufferSize_)
+         return;
+      waitingRequests_.pop_front();
+      int ret = WriteLineH(request, 1, request->command_.line);
+      if (ret != DEVICE_OK)
+         request->Complete(ret);
+   }
+}
+
+// private and expects caller to guard the port
+// writes line number of request and puts it in flight
+int CEVA_NDE_GrblHub::WriteLineH(GrblCommandRequest* request, unsigned long number, const std::string& text)
+{
+   std::string line = text + "\n";
+   int ret = WriteToComPortH((const unsigned char*) line.c_str(), (unsigned) line.length());
+   if (ret != DEVICE_OK)
+   {
+      LogMessage(std::string("command write fail"));
+      return ret;
+   }
+   double nowMs = GrblNowMs();
+   StreamedLine written(request, number, (unsigned) line.length(), text);
+   double timeoutMs = request->kind_ == GrblCommandRequest::STREAM ?
+      GrblCommand::DefaultTimeoutMs(text) : request->command_.timeoutMs;
+   // the reply waits for the moves and dwells ahead of the line, homing has
+   // its own timeout
+   if ((written.motion && !written.homing) || written.dwell)
+   {
+      double dwellMs = written.dwellMs;
+      for (size_t i = 0; i < streamedLines_.size(); ++i)
+         dwellMs += streamedLines_[i].dwellMs;
+      timeoutMs += ReplyAllowanceMsH(dwellMs);
+   }
+   written.timeoutMs = timeoutMs;
+   if (streamedLines_.empty())
+      written.deadlineMs = nowMs + timeoutMs;
+   if (written.motion)
+      GrblAtomicIncrement(&motionWritten_);
+   PlanLineH(text);
+   // taken as applied until the reply says otherwise
+   if (written.homing)
+      modal_.Invalidate();
+   else if (text.length() == 0 || text[0] != '$')
+      modal_.Observe(text);
+   streamedLines_.push_back(written);
+   streamedBytes_ += written.length;
+   ++request->linesWritten_;
+   if (request->kind_ != GrblCommandRequest::STREAM)
+   {
+      // time spent before the command reached the port
+      double waitedMs = nowMs - request->submittedMs_;
+      metrics_.RecordLatency(GrblMetrics::LOCK_WAIT, 1000.0 * waitedMs);
+      commandOverheadMs_ += waitedMs;
+      ++commandCount_;
+   }
+   return DEVICE_OK;
+}
+
+// private and expects caller to guard the port
+// status reports and the startup banner are dispatched, anything else
+// belongs to the oldest line in flight
+void CEVA_NDE_GrblHub::HandleReplyH(const std::string& line)
+{
+   switch (DispatchReplyH(line))
+   {
+      case REPLY_OK:
+      case REPLY_ERROR:
+         LineAnsweredH(line);
+         break;
+      case REPLY_RESET:
+         LinesLostH(ERR_CONTROLLER_RESET);
+         break;
+      case REPLY_MESSAGE:
+         if (line.length() > 0 && !streamedLines_.empty())
+            streamedLines_.front().request->response_ += line + "\r\n";
+         break;
+      default:
+         break;
+   }
+}
+
+// private and expects caller to guard the port
+// the controller has answered the oldest line in flight with ack
+void CEVA_NDE_GrblHub::LineAnsweredH(const std::string& ack)
+{
+   if (streamedLines_.empty())
+      return; // stray reply to a line that has been given up on
+   StreamedLine answered = streamedLines_.front();
+   streamedLines_.pop_front();
+   streamedBytes_ -= answered.length;
+   if (!streamedLines_.empty())
+      streamedLines_.front().deadlineMs = GrblNowMs() + streamedLines_.front().timeoutMs;
+   bool accepted = ack.compare(0, 2, "ok") == 0;
+   if (!accepted)
+      modal_.Invalidate(); // the line may have been applied in part
+   // homing and dwells answer once the machine has stopped
+   MotionAcknowledgedH(answered.motion, accepted, accepted && (answered.homing || answered.dwell));
+   // whoever sent it, $N= has changed what parameters holds
+   if (accepted && answered.setting)
+      InvalidateParametersH();
+
+   GrblCommandRequest* request = answered.request;
+   if (request->kind_ != GrblCommandRequest::STREAM)
+   {
+      request->ack_ = ack;
+      request->Complete(accepted ? DEVICE_OK : DEVICE_ERR);
+      return;
+   }
+   ++request->linesAnswered_;
+   if (accepted)
+   {
+      request->source_->LineAcknowledged(answered.number);
+      return;
+   }
+   std::ostringstream os;
+   os << "streamed line " << answered.number << " rejected: " << ack;
+   LogMessage(os.str().c_str());
+   if (request->result_ == DEVICE_OK)
+      request->result_ = ERR_COMMAND_REJECTED;
+   request->sourceDone_ = true;
+}
+
+// private and expects caller to guard the port
+// the replies to the lines in flight will not come, fails their requests
+void CEVA_NDE_GrblHub::LinesLostH(int error)
+{
+   if (streamedLines_.empty())
+      return;
+   std::deque<StreamedLine> lost;
+   lost.swap(streamedLines_);
+   streamedBytes_ = 0;
+   LogMessage(std::string("answer get error!"));
+   modal_.Invalidate();
+   if (error != ERR_CONTROLLER_RESET)
+   {
+      MotionAbortedH(false);
+      // a late answer would otherwise be taken for the reply to the next line
+      PurgeComPortH();
+   }
+   DumpTrafficOnError(error);
+   for (size_t i = 0; i < lost.size(); ++i)
+   {
+      GrblCommandRequest* request = lost[i].request;
+      if (request->kind_ != GrblCommandRequest::STREAM)
+      {
+         request->Complete(error);
+         continue;
+      }
+      // the stream is finished by WriteRequestsH
+      ++request->linesAnswered_;
+      if (request->result_ == DEVICE_OK)
+         request->result_ = error;
+      request->sourceDone_ = true;
+   }
+}
+
+// private and expects caller to guard the port
+// all lines of the stream at the front of waitingRequests_ are answered
+void CEVA_NDE_GrblHub::FinishStreamH(GrblCommandRequest* request)
+{
+   waitingRequests_.pop_front();
+   int ret = request->result_;
+   // lost lines have been cleaned up after by LinesLostH
+   if (ret == ERR_COMMAND_REJECTED || ret == ERR_LINE_TOO_LONG)
+   {
+      modal_.Invalidate();
+      MotionAbortedH(false);
+      DumpTrafficOnError(ret);
+   }
+   request->Complete(ret);
+}
+
+// private and expects caller to guard the port
+// with the I/O thread stopped: answers every request that is left with error
+void CEVA_NDE_GrblHub::CancelRequestsH(int error)
+{
+   LinesLostH(error);
+   TakeRequestsH();
+   while (!waitingRequests_.empty())
+   {
+      GrblCommandRequest* request = waitingRequests_.front();
+      waitingRequests_.pop_front();
+      if (request->result_ == DEVICE_OK)
+         request->result_ = error;
+      request->Complete(request->result_);
+   }
+}
+
+// starts the thread that owns the port
+void CEVA_NDE_GrblHub::StartIo()
+{
+   if (ioThread_)
+      return;
+   GrblAtomicStore(&ioRunning_, 1);
+   ioThread_ = new IoThread(this);
+   ioThread_->activate();
+}
+
+// stops the I/O thread; requests still waiting fail with ERR_NO_PORT_SET
+void CEVA_NDE_GrblHub::StopIo()
+{
+   if (!ioThread_)
+      return;
+   GrblAtomicStore(&ioRunning_, 0);
+   // a request pushed from now on would never be answered
+   while (GrblAtomicLoad(&submitters_) > 0)
+      GrblYield();
+   ioThread_->Stop();
+   transport_->Wake();
+   ioThread_->wait();
+   delete ioThread_;
+   ioThread_ = 0;
+   MMThreadGuard guard(executeLock_);
+   CancelRequestsH(ERR_NO_PORT_SET);
+}
+
+/**
+ * Streams G-code lines using Grbl's character-counting flow control: lines are
+ * written as long as they fit into the controller's receive buffer, and the
+ * 'ok'/'error' replies are matched to the outstanding lines in FIFO order.
+ * This keeps the firmware planner filled so consecutive moves are blended
+ * instead of each one waiting for a full serial round trip. No line of
+ * another request is written in between.
+ * Returns after every line has been acknowledged.
+ */
+int CEVA_NDE_GrblHub::StreamCommands(GrblLineSource& source)
+{
+   if(!portAvailable_)
+      return ERR_NO_PORT_SET;
+   GrblCommandRequest request(source);
+   int ret = Submit(request);
+   if (ret != DEVICE_OK)
+      return ret;
+   request.Wait();
+   ret = request.GetResult();
+   // reloads the settings if a $N= line among those streamed changed them
+   if (ret == DEVICE_OK)
+      ret = GetParameters();
+   return ret;
+}
+
+int CEVA_NDE_GrblHub::StreamCommands(const std::vector<std::string>& lines)
+{
+   VectorLineSource source(lines);
+   return StreamCommands(source);
+}
+
+MM::DeviceDetectionStatus CEVA_NDE_GrblHub::DetectDevice(void)
+{
+  if (initialized_)
+      return MM::CanCommunicate;
+
+   // all conditions must be satisfied...
+   MM::DeviceDetectionStatus result = MM::Misconfigured;
+   char answerTO[MM::MaxStrLength];
+   
+   try
+   {
+      std::string portLowerCase = port_;
+      for( std::string::iterator its = portLowerCase.begin(); its != portLowerCase.end(); ++its)
+      {
+         *its = (char)tolower(*its);
+      }
+      if( 0< portLowerCase.length() &&  0 != portLowerCase.compare("undefined")  && 0 != portLowerCase.compare("unknown") )
+      {
+         result = MM::CanNotCommunicate;
+         // record the default answer time out
+         GetCoreCallback()->GetDeviceProperty(port_.c_str(), "AnswerTimeout", answerTO);
+
+         // device specific default communication parameters
+         // for Arduino Duemilanova
+         GetCoreCallback()->SetDeviceProperty(port_.c_str(), MM::g_Keyword_Handshaking, "Off");
+         GetCoreCallback()->SetDeviceProperty(port_.c_str(), MM::g_Keyword_StopBits, "1");
+         // Arduino timed out in GetControllerVersion even if AnswerTimeout  = 300 ms
          GetCoreCallback()->SetDeviceProperty(port_.c_str(), "AnswerTimeout", "500.0");
          GetCoreCallback()->SetDeviceProperty(port_.c_str(), "DelayBetweenCharsMs", "0");
          MM::Device* pS = GetCoreCallback()->GetDevice(this, port_.c_str());
-         pS->Initialize();
-         // The first second or so after opening the serial port, the Arduino is waiting for firmwareupgrades.  Simply sleep 1 second.
-         CDeviceUtils::SleepMs(2000);
-         MMThreadGuard myLock(lock_);
-         PurgeComPort(port_.c_str());
-         int ret = GetStatus();
-         // later, Initialize will explicitly check the version #
-         if( DEVICE_OK != ret )
+
+         // the rate that worked last time first, then the BaudRates list
+         GrblSettingsCache cache = GetSettingsCache();
+         std::vector<long> rates;
+         long stored;
+         if (cache.LoadBaudRate(stored))
+            rates.push_back(stored);
+         std::vector<std::string> tokens;
+         CDeviceUtils::Tokenize(baudRates_, tokens, ", ");
+         for (size_t i = 0; i < tokens.size(); ++i)
+         {
+            long rate = atol(tokens[i].c_str());
+            if (rate > 0 && std::find(rates.begin(), rates.end(), rate) == rates.end())
+               rates.push_back(rate);
+         }
+
+         MMThreadGuard myLock(GrblPortScanner::GetPortLock(port_));
+
+         // all ports at once where the native transport is available, later
+         // calls for the other ports are then answered from the cache. Only
+         // the ports the wizard knows about, which are loaded as serial devices.
+         std::vector<std::string> registeredPorts;
+         char portName[MM::MaxStrLength];
+         for (unsigned i = 0; ; ++i)
          {
-            LogMessageCode(ret,true);
+            portName[0] = '\0';
+            GetCoreCallback()->GetLoadedDeviceOfType(this, MM::SerialDevice, portName, i);
+            if (portName[0] == '\0')
+               break;
+            registeredPorts.push_back(portName);
          }
-         else
+         GrblPortScanner::Scan(port_, registeredPorts, rates, g_controllerStartTimeoutMs);
+         GrblProbeResult probe;
+         bool probed = GrblPortScanner::GetCachedResult(port_, probe);
+         if (probed && probe.found)
          {
-            // to succeed must reach here....
+            GetCoreCallback()->SetDeviceProperty(port_.c_str(), MM::g_Keyword_BaudRate,
+               CDeviceUtils::ConvertToString(probe.baud));
+            cache.SaveBaudRate(probe.baud);
             result = MM::CanCommunicate;
          }
-         pS->Shutdown();
+
+         // otherwise one rate after the other through the Micro-Manager port
+         for (size_t i = 0; !probed && i < rates.size() && result != MM::CanCommunicate; ++i)
+         {
+            GetCoreCallback()->SetDeviceProperty(port_.c_str(), MM::g_Keyword_BaudRate,
+               CDeviceUtils::ConvertToString(rates[i]));
+            pS->Initialize();
+            int ret;
+            {
+               MMThreadGuard guard(executeLock_);
+               PurgeComPortH();
+               ret = WaitForControllerH(g_controllerStartTimeoutMs);
+            }
+            // later, Initialize will explicitly check the version #
+            if( DEVICE_OK != ret )
+            {
+               LogMessageCode(ret,true);
+            }
+            else
+            {
+               // to succeed must reach here....
+               result = MM::CanCommunicate;
+               cache.SaveBaudRate(rates[i]);
+            }
+            pS->Shutdown();
+         }
          // always restore the AnswerTimeout to the default
          GetCoreCallback()->SetDeviceProperty(port_.c_str(), "AnswerTimeout", answerTO);
 
@@ -442,7 +1763,7 @@ int CEVA_NDE_GrblHub::Initialize()
    if (DEVICE_OK != ret)
       return ret;
 
-   MMThreadGuard myLock(lock_);
+   MMThreadGuard myLock(GrblPortScanner::GetPortLock(port_));
 
    CPropertyAction* pAct = new CPropertyAction(this, &CEVA_NDE_GrblHub::OnVersion);
    std::ostringstream sversion;
@@ -453,14 +1774,161 @@ int CEVA_NDE_GrblHub::Initialize()
    ret = CreateProperty("Command","", MM::String, false, pAct);
    if (DEVICE_OK != ret)
       return ret;
-   // turn off verbose serial debug messages
-   GetCoreCallback()->SetDeviceProperty(port_.c_str(), "Verbose", "0");
+
+   pAct = new CPropertyAction(this, &CEVA_NDE_GrblHub::OnRxBufferSize);
+   ret = CreateProperty("RxBufferSize", CDeviceUtils::ConvertToString(rxBufferSize_), MM::Integer, false, pAct);
+   if (DEVICE_OK != ret)
+      return ret;
+   SetPropertyLimits("RxBufferSize", 16, 1024);
+
+   pAct = new CPropertyAction(this, &CEVA_NDE_GrblHub::OnCommandOverhead);
+   ret = CreateProperty("CommandOverheadUs", "0", MM::Float, true, pAct);
+   if (DEVICE_OK != ret)
+      return ret;
+
+   pAct = new CPropertyAction(this, &CEVA_NDE_GrblHub::OnStatusPollInterval);
+   ret = CreateProperty("StatusPollIntervalMs", CDeviceUtils::ConvertToString(statusPollIntervalMs_), MM::Float, false, pAct);
+   if (DEVICE_OK != ret)
+      return ret;
+   SetPropertyLimits("StatusPollIntervalMs", 0.0, 1000.0);
+
+   pAct = new CPropertyAction(this, &CEVA_NDE_GrblHub::OnMaxStatusAge);
+   ret = CreateProperty("MaxStatusAgeMs", CDeviceUtils::ConvertToString(maxStatusAgeMs_), MM::Float, false, pAct);
+   if (DEVICE_OK != ret)
+      return ret;
+
+   // latency histograms and serial counters, all read only
+   for (long i = 0; i < GrblMetrics::LATENCY_CLASSES; ++i)
+   {
+      std::string name = std::string("Latency") + GrblMetrics::GetLatencyClassName((GrblMetrics::LatencyClass) i) + "Us";
+      CPropertyActionEx* pActEx = new CPropertyActionEx(this, &CEVA_NDE_GrblHub::OnLatency, i);
+      ret = CreateProperty(name.c_str(), "", MM::String, true, pActEx);
+      if (DEVICE_OK != ret)
+         return ret;
+   }
+   for (long i = 0; i < GrblMetrics::COUNTERS; ++i)
+   {
+      CPropertyActionEx* pActEx = new CPropertyActionEx(this, &CEVA_NDE_GrblHub::OnCounter, i);
+      ret = CreateProperty(GrblMetrics::GetCounterName((GrblMetrics::Counter) i), "0", MM::Integer, true, pActEx);
+      if (DEVICE_OK != ret)
+         return ret;
+   }
+
+   pAct = new CPropertyAction(this, &CEVA_NDE_GrblHub::OnMetricsFile);
+   ret = CreateProperty("MetricsFile", metricsFile_.c_str(), MM::String, false, pAct);
+   if (DEVICE_OK != ret)
+      return ret;
+
+   pAct = new CPropertyAction(this, &CEVA_NDE_GrblHub::OnMetricsSnapshot);
+   ret = CreateProperty(g_metricsSnapshotProp, g_metricsIdle, MM::String, false, pAct);
+   if (DEVICE_OK != ret)
+      return ret;
+   AddAllowedValue(g_metricsSnapshotProp, g_metricsIdle);
+   AddAllowedValue(g_metricsSnapshotProp, g_metricsWrite);
+   AddAllowedValue(g_metricsSnapshotProp, g_metricsReset);
+
+   // recent serial traffic, decoded offline with tools/GrblTraceDecode
+   pAct = new CPropertyAction(this, &CEVA_NDE_GrblHub::OnTrafficFile);
+   ret = CreateProperty("TrafficFile", trafficFile_.c_str(), MM::String, false, pAct);
+   if (DEVICE_OK != ret)
+      return ret;
+
+   pAct = new CPropertyAction(this, &CEVA_NDE_GrblHub::OnTrafficDump);
+   ret = CreateProperty(g_trafficDumpProp, g_trafficIdle, MM::String, false, pAct);
+   if (DEVICE_OK != ret)
+      return ret;
+   AddAllowedValue(g_trafficDumpProp, g_trafficIdle);
+   AddAllowedValue(g_trafficDumpProp, g_trafficWrite);
+
+   pAct = new CPropertyAction(this, &CEVA_NDE_GrblHub::OnTrafficDumpOnError);
+   ret = CreateProperty("TrafficDumpOnError", CDeviceUtils::ConvertToString(trafficDumpOnError_), MM::Integer, false, pAct);
+   if (DEVICE_OK != ret)
+      return ret;
+   AddAllowedValue("TrafficDumpOnError", "0");
+   AddAllowedValue("TrafficDumpOnError", "1");
+
+   // stage positions from the model of the queued moves between reports
+   pAct = new CPropertyAction(this, &CEVA_NDE_GrblHub::OnPredictPosition);
+   ret = CreateProperty("PredictPosition", CDeviceUtils::ConvertToString(predictPosition_), MM::Integer, false, pAct);
+   if (DEVICE_OK != ret)
+      return ret;
+   AddAllowedValue("PredictPosition", "0");
+   AddAllowedValue("PredictPosition", "1");
+
+   pAct = new CPropertyAction(this, &CEVA_NDE_GrblHub::OnPredictionError);
+   ret = CreateProperty("PredictionErrorNm", "", MM::String, true, pAct);
+   if (DEVICE_OK != ret)
+      return ret;
+
+   // reported positions by time, written as CSV on demand
+   pAct = new CPropertyAction(this, &CEVA_NDE_GrblHub::OnPositionHistoryFile);
+   ret = CreateProperty("PositionHistoryFile", positionHistoryFile_.c_str(), MM::String, false, pAct);
+   if (DEVICE_OK != ret)
+      return ret;
+
+   pAct = new CPropertyAction(this, &CEVA_NDE_GrblHub::OnPositionHistoryExport);
+   ret = CreateProperty(g_positionHistoryExportProp, g_positionHistoryIdle, MM::String, false, pAct);
+   if (DEVICE_OK != ret)
+      return ret;
+   AddAllowedValue(g_positionHistoryExportProp, g_positionHistoryIdle);
+   AddAllowedValue(g_positionHistoryExportProp, g_positionHistoryWrite);
+   if (!positionHistory_)
+      positionHistory_ = new GrblPositionHistory((unsigned long) positionHistorySize_);
+
+   if (transportName_ == g_transportSimulator)
+   {
+      ret = StartSimulator();
+      if (ret != DEVICE_OK)
+         return ret;
+   }
+   else
+   {
+      // turn off verbose serial debug messages
+      GetCoreCallback()->SetDeviceProperty(port_.c_str(), "Verbose", "0");
+   }
+   if (transportName_ == g_transportNative)
+   {
+      ret = OpenNativeTransport();
+      if (ret != DEVICE_OK)
+         LogMessage("Native serial transport not available, using the Micro-Manager port");
+   }
+   if (transportName_ != g_transportSimulator)
+   {
+      // opening the port has reset the board
+      {
+         MMThreadGuard guard(executeLock_);
+         ret = WaitForControllerH(g_controllerStartTimeoutMs);
+      }
+      if (ret != DEVICE_OK)
+         return ret;
+      char baud[MM::MaxStrLength];
+      if (GetCoreCallback()->GetDeviceProperty(port_.c_str(), MM::g_Keyword_BaudRate, baud) == DEVICE_OK && atol(baud) > 0)
+      {
+         GetSettingsCache().SaveBaudRate(atol(baud));
+         // start, 8 data and stop bit
+         byteTimeMs_ = 10000.0 / atol(baud);
+      }
+   }
+   // from here on lines are only written by the I/O thread
+   StartIo();
+
    // synchronize all properties
    // --------------------------
    ret = UpdateStatus();
    if (ret != DEVICE_OK)
       return ret;
 
+   // steps/mm and friends are needed by the stage before the first homing
+   ret = GetParameters();
+   if (ret != DEVICE_OK)
+      return ret;
+
+   // keep the status snapshot fresh for all readers
+   poller_ = new StatusPollerThread(this);
+   poller_->activate();
+
+   // keep device detection off this port
+   GrblPortScanner::SetPortInUse(port_, true);
    initialized_ = true;
    return DEVICE_OK;
 }
@@ -487,17 +1955,115 @@ int CEVA_NDE_GrblHub::DetectInstalledDevices()
    return DEVICE_OK;
 }
 
-int CEVA_NDE_GrblHub::SetAnswerTimeoutMs(double timeout)
+/**
+ * Releases the tty from the Micro-Manager port device and opens it directly.
+ * On failure the Micro-Manager port is brought back and stays in use.
+ */
+int CEVA_NDE_GrblHub::OpenNativeTransport()
 {
-      if(!portAvailable_)
-	   return ERR_NO_PORT_SET;
-     GetCoreCallback()->SetDeviceProperty(port_.c_str(), "AnswerTimeout",  CDeviceUtils::ConvertToString(timeout));
+   char baud[MM::MaxStrLength] = "9600";
+   GetCoreCallback()->GetDeviceProperty(port_.c_str(), MM::g_Keyword_BaudRate, baud);
+   MM::Device* pS = GetCoreCallback()->GetDevice(this, port_.c_str());
+   if (pS)
+      pS->Shutdown();
+   int ret = nativeTransport_->Open(port_, atol(baud));
+   if (ret != DEVICE_OK)
+   {
+      if (pS)
+         pS->Initialize();
+      return ret;
+   }
+   if (!nativeTransport_->IsLowLatency())
+      LogMessage("Serial driver does not support ASYNC_LOW_LATENCY", true);
+   MMThreadGuard guard(executeLock_);
+   rxBuffer_.clear();
+   transport_ = nativeTransport_;
+   return DEVICE_OK;
+}
+
+/**
+ * Starts the built-in controller simulator and talks to it through the native
+ * transport, no serial port or board is needed.
+ */
+int CEVA_NDE_GrblHub::StartSimulator()
+{
+   simulator_ = new GrblSimulator();
+   simulator_->SetBaudRate(simulatorBaudRate_);
+   byteTimeMs_ = 10000.0 / simulatorBaudRate_;
+   simulator_->SetLineLatencyMs(simulatorLineLatencyMs_);
+   int ret = simulator_->Start();
+   if (ret == DEVICE_OK)
+      ret = nativeTransport_->Open(simulator_->GetDevicePath(), simulatorBaudRate_);
+   if (ret != DEVICE_OK)
+   {
+      delete simulator_;
+      simulator_ = 0;
+      return ret;
+   }
+   MMThreadGuard guard(executeLock_);
+   rxBuffer_.clear();
+   transport_ = nativeTransport_;
+   portAvailable_ = true;
+
+   // opening the tty resets the simulated board, wait for its banner so
+   // that nothing written before the reset gets lost
+   long resets = GrblAtomicLoad(&resets_);
+   double deadline = GrblNowMs() + 1000.0;
+   std::string line;
+   while (GrblAtomicLoad(&resets_) == resets)
+   {
+      ret = ReadLineH(line, deadline);
+      if (ret != DEVICE_OK)
+         return ret;
+      DispatchReplyH(line);
+   }
    return DEVICE_OK;
 }
 
+// keeps the traffic that led up to a failed command for offline analysis
+void CEVA_NDE_GrblHub::DumpTrafficOnError(int error)
+{
+   if (!trafficDumpOnError_)
+      return;
+   if (recorder_.Dump(trafficFile_) != DEVICE_OK)
+      return;
+   std::ostringstream os;
+   os << "Error " << error << ", serial traffic written to " << trafficFile_;
+   LogMessage(os.str().c_str());
+}
+
+void CEVA_NDE_GrblHub::CloseNativeTransport()
+{
+   if (transport_ != nativeTransport_)
+      return;
+   MMThreadGuard guard(executeLock_);
+   transport_ = mmTransport_;
+   nativeTransport_->Close();
+   if (simulator_)
+   {
+      simulator_->Stop();
+      delete simulator_;
+      simulator_ = 0;
+      return;
+   }
+   MM::Device* pS = GetCoreCallback()->GetDevice(this, port_.c_str());
+   if (pS)
+      pS->Initialize();
+}
 
 int CEVA_NDE_GrblHub::Shutdown()
 {
+   if (poller_)
+   {
+      poller_->Stop();
+      poller_->wait();
+      delete poller_;
+      poller_ = 0;
+   }
+   StopIo();
+   CloseNativeTransport();
+   if (initialized_)
+      GrblPortScanner::SetPortInUse(port_, false);
    initialized_ = false;
 
    return DEVICE_OK;
@@ -520,11 +2086,12 @@ int CEVA_NDE_GrblHub::OnStatus(MM::PropertyBase* pProp, MM::ActionType pAct)
 {
    if (pAct == MM::BeforeGet)
    {
-	  int ret = GetStatus();
+	  GrblStatusSnapshot snapshot;
+	  int ret = GetStatusSnapshot(snapshot);
 	  if(ret != DEVICE_OK)
 		  pProp->Set("-");
 	  else
-		  pProp->Set(status.c_str());
+		  pProp->Set(snapshot.status);
    }
    return DEVICE_OK;
 }
@@ -549,7 +2116,30 @@ int CEVA_NDE_GrblHub::OnCommand(MM::PropertyBase* pProp, MM::ActionType pAct)
       pProp->Get(cmd);
 	  if(cmd.compare(commandResult_) ==0)  // command result still there
 		  return DEVICE_OK;
-	  int ret = SendCommand(cmd,commandResult_);
+	  int ret;
+	  // Grbl ends a line on \r as well as \n and answers an empty line with
+	  // ok, so a CR of CRLF or a blank line would shift the replies against
+	  // the lines in flight
+	  std::vector<std::string> parts;
+	  split(cmd, '\n', parts);
+	  std::vector<std::string> lines;
+	  for (size_t i = 0; i < parts.size(); ++i)
+	  {
+		  std::string line = parts[i];
+		  if (line.length() > 0 && line[line.length() - 1] == '\r')
+			  line.erase(line.length() - 1);
+		  if (line.length() > 0)
+			  lines.push_back(line);
+	  }
+	  if(lines.size() > 1)
+	  {
+		  // a multi-line program is streamed
+		  ret = StreamCommands(lines);
+		  if(DEVICE_OK == ret)
+			  commandResult_.assign("ok");
+	  }
+	  else
+		  ret = SendCommand(lines.empty() ? std::string() : lines[0],commandResult_);
 	  if(DEVICE_OK != ret){
 		  commandResult_.assign("Error!");
 		  return DEVICE_ERR;
@@ -557,3 +2147,280 @@ int CEVA_NDE_GrblHub::OnCommand(MM::PropertyBase* pProp, MM::ActionType pAct)
    }
    return DEVICE_OK;
 }
+
+int CEVA_NDE_GrblHub::OnRxBufferSize(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(rxBufferSize_);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      MMThreadGuard guard(executeLock_);
+      pProp->Get(rxBufferSize_);
+   }
+   return DEVICE_OK;
+}
+
+int CEVA_NDE_GrblHub::OnStatusPollInterval(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(statusPollIntervalMs_);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      pProp->Get(statusPollIntervalMs_);
+   }
+   return DEVICE_OK;
+}
+
+int CEVA_NDE_GrblHub::OnMaxStatusAge(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(maxStatusAgeMs_);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      pProp->Get(maxStatusAgeMs_);
+   }
+   return DEVICE_OK;
+}
+
+int CEVA_NDE_GrblHub::OnSettingsCacheDir(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(settingsCacheDir_.c_str());
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      pProp->Get(settingsCacheDir_);
+   }
+   return DEVICE_OK;
+}
+
+int CEVA_NDE_GrblHub::OnCommandOverhead(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      MMThreadGuard guard(executeLock_);
+      double mean = commandCount_ > 0 ? 1000.0 * commandOverheadMs_ / commandCount_ : 0.0;
+      pProp->Set(mean);
+   }
+   return DEVICE_OK;
+}
+
+int CEVA_NDE_GrblHub::OnTransport(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(transportName_.c_str());
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      pProp->Get(transportName_);
+   }
+   return DEVICE_OK;
+}
+
+int CEVA_NDE_GrblHub::OnLatency(MM::PropertyBase* pProp, MM::ActionType pAct, long latencyClass)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(metrics_.GetLatency((GrblMetrics::LatencyClass) latencyClass).Format().c_str());
+   }
+   return DEVICE_OK;
+}
+
+int CEVA_NDE_GrblHub::OnCounter(MM::PropertyBase* pProp, MM::ActionType pAct, long counter)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(metrics_.GetCounter((GrblMetrics::Counter) counter));
+   }
+   return DEVICE_OK;
+}
+
+int CEVA_NDE_GrblHub::OnMetricsFile(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(metricsFile_.c_str());
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      pProp->Get(metricsFile_);
+   }
+   return DEVICE_OK;
+}
+
+// Write appends the current metrics to MetricsFile, Reset clears them
+int CEVA_NDE_GrblHub::OnMetricsSnapshot(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(g_metricsIdle);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      std::string value;
+      pProp->Get(value);
+      pProp->Set(g_metricsIdle);
+      if (value == g_metricsWrite)
+         return metrics_.WriteSnapshot(metricsFile_);
+      if (value == g_metricsReset)
+         metrics_.Reset();
+   }
+   return DEVICE_OK;
+}
+
+int CEVA_NDE_GrblHub::OnTrafficFile(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(trafficFile_.c_str());
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      pProp->Get(trafficFile_);
+   }
+   return DEVICE_OK;
+}
+
+int CEVA_NDE_GrblHub::OnTrafficDump(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(g_trafficIdle);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      std::string value;
+      pProp->Get(value);
+      pProp->Set(g_trafficIdle);
+      if (value == g_trafficWrite)
+         return recorder_.Dump(trafficFile_);
+   }
+   return DEVICE_OK;
+}
+
+int CEVA_NDE_GrblHub::OnTrafficDumpOnError(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(trafficDumpOnError_);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      pProp->Get(trafficDumpOnError_);
+   }
+   return DEVICE_OK;
+}
+
+int CEVA_NDE_GrblHub::OnPredictPosition(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(predictPosition_);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      pProp->Get(predictPosition_);
+   }
+   return DEVICE_OK;
+}
+
+int CEVA_NDE_GrblHub::OnPredictionError(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(metrics_.GetPredictionError().Format().c_str());
+   }
+   return DEVICE_OK;
+}
+
+int CEVA_NDE_GrblHub::OnPositionHistorySize(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(positionHistorySize_);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      pProp->Get(positionHistorySize_);
+      if (positionHistorySize_ < 1)
+         positionHistorySize_ = 1;
+   }
+   return DEVICE_OK;
+}
+
+int CEVA_NDE_GrblHub::OnPositionHistoryFile(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(positionHistoryFile_.c_str());
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      pProp->Get(positionHistoryFile_);
+   }
+   return DEVICE_OK;
+}
+
+int CEVA_NDE_GrblHub::OnPositionHistoryExport(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(g_positionHistoryIdle);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      std::string value;
+      pProp->Get(value);
+      pProp->Set(g_positionHistoryIdle);
+      if (value == g_positionHistoryWrite && positionHistory_)
+         return positionHistory_->WriteCsv(positionHistoryFile_);
+   }
+   return DEVICE_OK;
+}
+
+int CEVA_NDE_GrblHub::OnBaudRates(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(baudRates_.c_str());
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      pProp->Get(baudRates_);
+   }
+   return DEVICE_OK;
+}
+
+int CEVA_NDE_GrblHub::OnSimulatorBaudRate(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(simulatorBaudRate_);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      pProp->Get(simulatorBaudRate_);
+   }
+   return DEVICE_OK;
+}
+
+int CEVA_NDE_GrblHub::OnSimulatorLineLatency(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(simulatorLineLatencyMs_);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      pProp->Get(simulatorLineLatencyMs_);
+   }
+   return DEVICE_OK;
+}
@@ -18,8 +18,19 @@
 
 #include "../../MMDevice/MMDevice.h"
 #include "../../MMDevice/DeviceBase.h"
+#include "GrblPrimitives.h"
+#include "GrblProtocol.h"
+#include "GrblTransport.h"
+#include "GrblSimulator.h"
+#include "GrblMetrics.h"
+#include "GrblRecorder.h"
+#include "GrblMotion.h"
+#include "GrblHistory.h"
+#include "GrblCommandQueue.h"
+#include "GrblSettingsCache.h"
 #include <string>
 #include <map>
+#include <deque>
 
 //////////////////////////////////////////////////////////////////////////////
 // Error codes
@@ -33,14 +44,32 @@
 #define ERR_COMMUNICATION 107
 #define ERR_NO_PORT_SET 108
 #define ERR_VERSION_MISMATCH 109
+#define ERR_COMMAND_REJECTED 110
+#define ERR_LINE_TOO_LONG 111
+#define ERR_CONTROLLER_RESET 112
+#define ERR_MOTION_STALLED 113
 
 #define PARAMETERS_COUNT 23
+// size of the serial receive buffer of Grbl on the Arduino UNO
+#define GRBL_RX_BUFFER_SIZE 127
+
+// single-byte real-time commands, executed by Grbl as soon as they arrive
+#define GRBL_RT_STATUS '?'
+#define GRBL_RT_FEED_HOLD '!'
+#define GRBL_RT_CYCLE_START '~'
+#define GRBL_RT_RESET 0x18
 
 extern std::vector<std::string> &split(const std::string &s, char delim, std::vector<std::string> &elems);
 std::vector<std::string> split(const std::string &s, char delim);
 
 class EVA_NDE_GrblInputMonitorThread;
 
+// Latest controller state as published by CEVA_NDE_GrblHub::GetStatus
+struct GrblStatusSnapshot : public GrblStatusReport
+{
+   double timestampMs;  // GrblNowMs() when the report was parsed
+};
+
 class CEVA_NDE_GrblHub : public HubBase<CEVA_NDE_GrblHub>  
 {
 public:
@@ -60,45 +89,252 @@ public:
    int OnVersion(MM::PropertyBase* pPropt, MM::ActionType eAct);
    int OnStatus(MM::PropertyBase* pProp, MM::ActionType pAct);
    int OnCommand(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnRxBufferSize(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnStatusPollInterval(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnMaxStatusAge(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnSettingsCacheDir(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnCommandOverhead(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnTransport(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnLatency(MM::PropertyBase* pProp, MM::ActionType pAct, long latencyClass);
+   int OnCounter(MM::PropertyBase* pProp, MM::ActionType pAct, long counter);
+   int OnMetricsFile(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnMetricsSnapshot(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnTrafficFile(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnTrafficDump(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnTrafficDumpOnError(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnPredictPosition(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnPredictionError(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnPositionHistorySize(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnPositionHistoryFile(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnPositionHistoryExport(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnBaudRates(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnSimulatorBaudRate(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnSimulatorLineLatency(MM::PropertyBase* pProp, MM::ActionType pAct);
    // custom interface for child devices
    bool IsPortAvailable() {return portAvailable_;}
    bool IsTimedOutputActive() {return timedOutputActive_;}
    void SetTimedOutput(bool active) {timedOutputActive_ = active;}
 
-   int PurgeComPortH() {return PurgeComPort(port_.c_str());}
-   int WriteToComPortH(const unsigned char* command, unsigned len) {return WriteToComPort(port_.c_str(), command, len);}
-   int ReadFromComPortH(unsigned char* answer, unsigned maxLen, unsigned long& bytesRead)
+   int PurgeComPortH()
    {
-      return ReadFromComPort(port_.c_str(), answer, maxLen, bytesRead);
+      metrics_.Increment(GrblMetrics::PURGES);
+      recorder_.Record(GrblTraceRecord::PURGE);
+      rxBuffer_.clear();
+      return transport_->Purge();
    }
-   int SetCommandComPortH(const char* command, const char* term)
+   int WriteToComPortH(const unsigned char* command, unsigned len)
    {
-	   return SendSerialCommand(port_.c_str(),command,term);
+      int ret = transport_->Write(command, len);
+      if (ret == DEVICE_OK)
+      {
+         metrics_.Add(GrblMetrics::BYTES_OUT, len);
+         recorder_.Record(GrblTraceRecord::TX, (const char*) command, len);
+      }
+      return ret;
+   }
+   int ReadFromComPortH(unsigned char* answer, unsigned maxLen, unsigned long& bytesRead, double timeoutMs = 0.0)
+   {
+      int ret = transport_->Read(answer, maxLen, bytesRead, timeoutMs);
+      if (ret == DEVICE_OK && bytesRead > 0)
+      {
+         metrics_.Add(GrblMetrics::BYTES_IN, (long) bytesRead);
+         recorder_.Record(GrblTraceRecord::RX, (const char*) answer, bytesRead);
+      }
+      return ret;
    }
-    int GetSerialAnswerComPortH (std::string& ans,  const char* term)
-	{
-		return GetSerialAnswer(port_.c_str(),term,ans);
-	}
    static MMThreadLock& GetLock() {return lock_;}
 
+   // hands request to the I/O thread and returns at once; the outcome is
+   // published in request, see GrblCommandRequest
+   int Submit(GrblCommandRequest& request);
+   // these submit a request and wait for it
    int SendCommand(std::string command, std::string &returnString);
-   int SetAnswerTimeoutMs(double timout);
+   int SendCommand(const GrblCommand& command, std::string &returnString);
+   int SendMotion(GrblModalState::Distance distance, GrblModalState::Motion motion,
+      const std::string& axisWords, double feedMmPerMin, std::string& returnString);
+   int StreamCommands(GrblLineSource& source);
+   int StreamCommands(const std::vector<std::string>& lines);
+   int SendRealtime(char command);
+   int FeedHold();
+   int CycleStart();
+   int SoftReset();
    int SetSync(int axis, double value );
 
+   // returns the cached settings, reading them with $$ only if the cache is invalid
    int GetParameters();
    int SetParameter(int index, double value);
+   void InvalidateParameters();
+   // changes whenever parameters is reloaded
+   long GetParametersVersion() {return GrblAtomicLoad(&parametersVersion_);}
    std::vector<double> parameters;
    //int Reset();
    double MPos[3];
    double WPos[3];
-   int GetStatus(); 
+   int GetStatus(double timeoutMs = 5000.0);
    std::string status;
+   // copies the cached controller state, polling the controller only if
+   // the cached report is older than maxAgeMs
+   int GetStatusSnapshot(GrblStatusSnapshot& snapshot, double maxAgeMs);
+   int GetStatusSnapshot(GrblStatusSnapshot& snapshot) {return GetStatusSnapshot(snapshot, maxStatusAgeMs_);}
+   double GetStatusPollIntervalMs() const {return statusPollIntervalMs_;}
+   GrblMetrics& GetMetrics() {return metrics_;}
+
+   // true from writing a motion line until the controller has finished it
+   bool IsMoving() {return GrblAtomicLoad(&motionDone_) != GrblAtomicLoad(&motionWritten_);}
+   // has the controller report when its planner is empty, without waiting
+   void RequestMotionFence();
+   // blocks until all motion written so far has finished or GrblNowMs()
+   // reaches deadlineMs; must not be called with executeLock_ held
+   int WaitForMotion(double deadlineMs);
+   // blocks until all motion written so far has finished, allowing slackMs
+   // beyond the estimated end of the queued moves, which is checked again
+   // while waiting; ERR_MOTION_STALLED once the machine has fallen behind.
+   // Must not be called with executeLock_ held.
+   int WaitForMotionEnd(double slackMs);
+   // GrblNowMs() at which the motion written so far will have finished;
+   // false if that cannot be modelled
+   bool GetMotionEndMs(double& endMs);
+   // the settings that shape moves, from the last $$
+   GrblMachineLimits GetMachineLimits() const;
+   // machine position in mm at timeMs from the model of the queued moves;
+   // false if the model has lost track or prediction is off
+   bool PredictPosition(double timeMs, double position[2]);
+   // machine position in mm at timeMs from the reported positions, for times
+   // between the oldest and the newest report kept
+   int GetPositionAt(double timeMs, double position[3]);
+   // the reported positions from sinceMs on, oldest first
+   void ExportPositionHistory(std::vector<GrblPositionSample>& samples, double sinceMs = 0.0);
 private:
+   class StatusPollerThread;
+   class IoThread;
+   class MotionFence;
+   class SettingsCheck;
+   class MMPortTransport;
+
+   // a line that has been written but not yet acknowledged by the controller
+   struct StreamedLine
+   {
+      StreamedLine(GrblCommandRequest* r, unsigned long n, unsigned len, const std::string& line) :
+         request(r), number(n), length(len), motion(IsGrblMotionLine(line)),
+         homing(line.compare(0, 2, "$H") == 0), setting(IsGrblSettingLine(line)), dwell(IsGrblDwellLine(line)),
+         dwellMs(ParseGrblDwellMs(line)), timeoutMs(0.0), deadlineMs(0.0) {}
+      GrblCommandRequest* request;
+      unsigned long number;         // within a stream, from 1
+      unsigned length;
+      bool motion;
+      bool homing;
+      bool setting;
+      bool dwell;
+      double dwellMs;
+      double timeoutMs;             // for its answer, once the lines ahead are answered
+      double deadlineMs;            // set when it becomes the oldest line in flight
+   };
+
+   enum ReplyType {REPLY_OK, REPLY_ERROR, REPLY_STATUS, REPLY_RESET, REPLY_MESSAGE};
+
+   static bool IsRealtimeCommand(char command);
+   int SendRealtimeCommand(char command, std::string& returnString);
+   int WaitForRealtimeReply(volatile long* counter, long seen, double timeoutMs);
+   void CountRealtimeReply(volatile long* counter);
+   ReplyType DispatchReplyH(const std::string& line);
+   int ParseStatusReportH(const std::string& report);
+   int ReadLineH(std::string& line, double deadlineMs, bool countTimeout = true);
+   int WaitForControllerH(double timeoutMs);
+   bool TakeLineH(std::string& line);
+   void RunIo(volatile bool& stop);
+   void PumpIo();
+   void TakeRequestsH();
+   void WriteRequestsH();
+   int WriteLineH(GrblCommandRequest* request, unsigned long number, const std::string& text);
+   void HandleReplyH(const std::string& line);
+   void LineAnsweredH(const std::string& ack);
+   void LinesLostH(int error);
+   void FinishStreamH(GrblCommandRequest* request);
+   void CancelRequestsH(int error);
+   void StartIo();
+   void StopIo();
+   int GetCommandResult(const GrblCommandRequest& request, std::string& returnString);
+   int ReadParameters(std::vector<double>& values);
+   static int ParseParameters(const std::string& dump, std::vector<double>& values);
+   GrblSettingsCache GetSettingsCache() const;
+   void SettingsCheckedH(const GrblCommandRequest& request);
+   void ParametersChangedH();
+   void InvalidateParametersH();
+   void PlanLineH(const std::string& line);
+   double ReplyAllowanceMsH(double dwellMs);
+   void MotionAcknowledgedH(bool motion, bool accepted, bool drained);
+   void MotionDoneH();
+   void MotionAbortedH(bool flushed);
+   int OpenNativeTransport();
+   void CloseNativeTransport();
+   int StartSimulator();
+   void DumpTrafficOnError(int error);
+
+   // Lines are written and replies read by the I/O thread only. It takes
+   // executeLock_ to handle them, but not while it waits for input.
    MMThreadLock executeLock_;
+   IoThread* ioThread_;
+   volatile long ioRunning_;     // requests are accepted
+   volatile long submitters_;    // threads inside Submit
+   GrblCommandQueue commandQueue_;
+   std::deque<GrblCommandRequest*> waitingRequests_;  // taken from the queue, not yet written
+   std::deque<StreamedLine> streamedLines_;
+   unsigned streamedBytes_;
+   GrblModalState modal_;        // of the controller's G-code parser, guarded by executeLock_
+   long rxBufferSize_;
+
+   GrblSeqLock<GrblStatusSnapshot> statusSnapshot_;
+   StatusPollerThread* poller_;
+   double statusPollIntervalMs_;
+   double maxStatusAgeMs_;
+
+   volatile long activeReaders_;  // threads currently reading replies from the port
+   // counted only while holding replyCondition_
+   volatile long statusReports_;  // status reports parsed so far
+   volatile long resets_;         // startup banners seen so far
+   GrblCondition replyCondition_; // signalled when statusReports_ or resets_ changes
+
+   // motion lines counted as written, answered and finished, changed under
+   // executeLock_; motionDone_ only while holding motionCondition_ as well
+   volatile long motionWritten_;
+   volatile long motionAcked_;
+   volatile long motionDone_;
+   GrblCondition motionCondition_;  // signalled when motionDone_ changes
+   MotionFence* fence_;
+   SettingsCheck* settingsCheck_;
+   GrblTrajectory trajectory_;   // moves in flight, in work coordinates
+   GrblSeqLock<GrblMachineLimits> machineLimits_;
+   long predictPosition_;
+   double byteTimeMs_;           // to send one byte at the current baud rate
+   GrblPositionHistory* positionHistory_;
+   long positionHistorySize_;    // samples
+   std::string positionHistoryFile_;
+   double lastQueryMs_;          // GrblNowMs() of the last '?' not yet answered, 0 if none
+   MMThreadLock queryLock_;      // guards lastQueryMs_
 
    std::string commandResult_;
+   std::string rxBuffer_;        // received bytes not yet split into lines
+   std::string transportName_;
+   GrblTransport* transport_;    // either of the two below
+   MMPortTransport* mmTransport_;
+   NativeSerialTransport* nativeTransport_;
+   GrblSimulator* simulator_;    // in place of the board when Transport is Simulator
+   long simulatorBaudRate_;
+   double simulatorLineLatencyMs_;
+   GrblMetrics metrics_;
+   std::string metricsFile_;
+   GrblTrafficRecorder recorder_;
+   std::string trafficFile_;
+   long trafficDumpOnError_;
+   double commandOverheadMs_;    // summed time from SendCommand to the port
+   long commandCount_;
    std::string port_;
    std::string version_;
+   std::string cachedBanner_;    // banner the cached settings belong to
+   std::string settingsCacheDir_;
+   std::string baudRates_;       // comma separated, for device detection
+   bool parametersValid_;
+   volatile long parametersVersion_;
    bool initialized_;
    bool portAvailable_;
    bool timedOutputActive_;
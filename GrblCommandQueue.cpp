@@ -0,0 +1,159 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblCommandQueue.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Commands submitted to the I/O thread of the EVA_NDE_Grbl hub
+//                and the lock-free queue that carries them there
+// LICENSE:       LGPL
+//
+
+#include "GrblCommandQueue.h"
+#include "../../MMDevice/MMDevice.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// GrblCommandRequest implementation
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+
+GrblCommandRequest::GrblCommandRequest(const GrblCommand& command, GrblCommandCallback* callback) :
+   kind_(LINE),
+   command_(command),
+   distance_(GrblModalState::DISTANCE_UNKNOWN),
+   motion_(GrblModalState::MOTION_UNKNOWN),
+   feedMmPerMin_(-1.0),
+   source_(0),
+   callback_(callback),
+   done_(0),
+   next_(0)
+{
+   Prepare(0.0);
+}
+
+GrblCommandRequest::GrblCommandRequest(GrblModalState::Distance distance, GrblModalState::Motion motion,
+   const std::string& axisWords, double feedMmPerMin, GrblCommandCallback* callback) :
+   kind_(MOTION),
+   command_(""),
+   distance_(distance),
+   motion_(motion),
+   axisWords_(axisWords),
+   feedMmPerMin_(feedMmPerMin),
+   source_(0),
+   callback_(callback),
+   done_(0),
+   next_(0)
+{
+   Prepare(0.0);
+}
+
+GrblCommandRequest::GrblCommandRequest(GrblLineSource& source, GrblCommandCallback* callback) :
+   kind_(STREAM),
+   command_(""),
+   distance_(GrblModalState::DISTANCE_UNKNOWN),
+   motion_(GrblModalState::MOTION_UNKNOWN),
+   feedMmPerMin_(-1.0),
+   source_(&source),
+   callback_(callback),
+   done_(0),
+   next_(0)
+{
+   Prepare(0.0);
+}
+
+bool GrblCommandRequest::Wait(double deadlineMs)
+{
+   condition_.Lock();
+   while (!done_ && condition_.WaitUntil(deadlineMs))
+      ;
+   bool done = done_ != 0;
+   condition_.Unlock();
+   return done;
+}
+
+void GrblCommandRequest::Wait()
+{
+   condition_.Lock();
+   while (!done_)
+      condition_.WaitUntil(GrblNowMs() + 1000.0);
+   condition_.Unlock();
+}
+
+// clears the outcome of an earlier submission
+void GrblCommandRequest::Prepare(double submittedMs)
+{
+   submittedMs_ = submittedMs;
+   linesWritten_ = 0;
+   linesAnswered_ = 0;
+   sourceDone_ = false;
+   nextLine_.clear();
+   hasNextLine_ = false;
+   response_.clear();
+   ack_.clear();
+   result_ = DEVICE_OK;
+   GrblAtomicStore(&done_, 0);
+   next_ = 0;
+}
+
+// publishes the outcome; the request may be gone once this returns
+void GrblCommandRequest::Complete(int result)
+{
+   GrblCommandCallback* callback = callback_;
+   result_ = result;
+   if (callback)
+   {
+      GrblAtomicStore(&done_, 1);
+      callback->CommandCompleted(*this);
+      return;
+   }
+   condition_.Lock();
+   GrblAtomicStore(&done_, 1);
+   condition_.NotifyAll();
+   condition_.Unlock();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GrblCommandQueue implementation
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+
+GrblCommandQueue::GrblCommandQueue() :
+   head_(&stub_),
+   tail_(&stub_),
+   stub_(GrblCommand(""))
+{
+}
+
+void GrblCommandQueue::Push(GrblCommandRequest* request)
+{
+   request->next_ = 0;
+   GrblCommandRequest* previous = GrblAtomicExchangePointer(&head_, request);
+   // until this store the consumer sees the list end at previous
+   GrblAtomicExchangePointer(&previous->next_, request);
+}
+
+GrblCommandRequest* GrblCommandQueue::Pop()
+{
+   GrblCommandRequest* tail = tail_;
+   GrblCommandRequest* next = GrblAtomicLoadPointer(&tail->next_);
+   if (tail == &stub_)
+   {
+      if (!next)
+         return 0;
+      tail_ = tail = next;
+      next = GrblAtomicLoadPointer(&tail->next_);
+   }
+   if (next)
+   {
+      tail_ = next;
+      return tail;
+   }
+   if (tail != GrblAtomicLoadPointer(&head_))
+      return 0; // a producer is between its two steps
+   // tail is the last request; put the stub behind it so it can be taken
+   Push(&stub_);
+   next = GrblAtomicLoadPointer(&tail->next_);
+   if (!next)
+      return 0;
+   tail_ = next;
+   return tail;
+}
@@ -0,0 +1,140 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblCommandQueue.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Commands submitted to the I/O thread of the EVA_NDE_Grbl hub
+//                and the lock-free queue that carries them there
+// LICENSE:       LGPL
+//
+
+#ifndef _GRBL_COMMAND_QUEUE_H_
+#define _GRBL_COMMAND_QUEUE_H_
+
+#include "GrblPrimitives.h"
+#include "GrblProtocol.h"
+#include <string>
+
+class GrblCommandRequest;
+
+// Supplies G-code lines to CEVA_NDE_GrblHub::StreamCommands one at a time,
+// so long programs can be generated lazily instead of built up front.
+class GrblLineSource
+{
+public:
+   virtual ~GrblLineSource() {}
+   // returns false when there are no more lines to send
+   virtual bool NextLine(std::string& line) = 0;
+   // called when the controller has answered line number lineNumber (counted
+   // from 1) with ok, from the I/O thread of the hub
+   virtual void LineAcknowledged(unsigned long /*lineNumber*/) {}
+};
+
+// Told when a request has been answered. Runs on the I/O thread of the hub,
+// so it must return quickly and must not wait for other requests.
+class GrblCommandCallback
+{
+public:
+   virtual ~GrblCommandCallback() {}
+   virtual void CommandCompleted(GrblCommandRequest& request) = 0;
+};
+
+// A command on its way to the controller and, once answered, its outcome:
+// the future of a CEVA_NDE_GrblHub::Submit. The submitter keeps the
+// request alive until Wait has returned true or, if it has a callback, until
+// the callback has run; the hub does not touch it afterwards, so the callback
+// may delete it. A request can be submitted again once it is done.
+class GrblCommandRequest
+{
+public:
+   // a single line
+   explicit GrblCommandRequest(const GrblCommand& command, GrblCommandCallback* callback = 0);
+   // a motion line in millimetres, completed with the modal words the
+   // controller lacks when it is written, see GrblModalState::Encode
+   GrblCommandRequest(GrblModalState::Distance distance, GrblModalState::Motion motion,
+      const std::string& axisWords, double feedMmPerMin, GrblCommandCallback* callback = 0);
+   // all lines of source, with no other line in between
+   explicit GrblCommandRequest(GrblLineSource& source, GrblCommandCallback* callback = 0);
+
+   bool IsDone() const {return GrblAtomicLoad(const_cast<volatile long*>(&done_)) != 0;}
+   // blocks until the request is done or GrblNowMs() reaches deadlineMs;
+   // returns IsDone(). Requests with a callback are not waited for.
+   bool Wait(double deadlineMs);
+   // blocks until the request is done; the hub answers every request, if need
+   // be with an error once the reply has timed out or the port has closed
+   void Wait();
+
+   // DEVICE_OK if the controller answered ok, DEVICE_ERR if it answered with
+   // an error, otherwise why there was no answer
+   int GetResult() const {return result_;}
+   // the line as written
+   const std::string& GetLine() const {return command_.line;}
+   // what the controller printed before its answer, lines ending in \r\n
+   const std::string& GetResponse() const {return response_;}
+   // "ok" or "error: ..."
+   const std::string& GetAck() const {return ack_;}
+
+private:
+   friend class CEVA_NDE_GrblHub;
+   friend class GrblCommandQueue;
+
+   enum Kind {LINE, MOTION, STREAM};
+
+   GrblCommandRequest(const GrblCommandRequest&);
+   GrblCommandRequest& operator=(const GrblCommandRequest&);
+
+   // for the hub
+   void Prepare(double submittedMs);
+   void Complete(int result);
+
+   Kind kind_;
+   GrblCommand command_;
+   GrblModalState::Distance distance_;
+   GrblModalState::Motion motion_;
+   std::string axisWords_;
+   double feedMmPerMin_;
+   GrblLineSource* source_;
+   GrblCommandCallback* callback_;
+
+   // the state below belongs to the I/O thread until the request is done
+   double submittedMs_;
+   unsigned long linesWritten_;  // of a stream
+   unsigned long linesAnswered_;
+   bool sourceDone_;             // no more lines will be written
+   std::string nextLine_;        // taken from source_ but not yet written
+   bool hasNextLine_;
+   std::string response_;
+   std::string ack_;
+   int result_;
+
+   volatile long done_;
+   GrblCondition condition_;     // signalled when done_ is set
+   GrblCommandRequest* volatile next_;  // in GrblCommandQueue
+};
+
+// Multi-producer, single-consumer FIFO of requests. Push never blocks and
+// takes no lock: a producer swaps itself in as the head and then links the
+// previous head to it. Pop is for the I/O thread only. The queue links the
+// requests themselves, so pushing allocates nothing.
+class GrblCommandQueue
+{
+public:
+   GrblCommandQueue();
+
+   // from any thread
+   void Push(GrblCommandRequest* request);
+   // from the consumer only; 0 if the queue is empty, or if the request
+   // pushed next has not been linked yet, in which case it is popped by a
+   // later call
+   GrblCommandRequest* Pop();
+
+private:
+   GrblCommandQueue(const GrblCommandQueue&);
+   GrblCommandQueue& operator=(const GrblCommandQueue&);
+
+   GrblCommandRequest* volatile head_;    // pushed last
+   GrblCommandRequest* tail_;             // popped next, consumer only
+   GrblCommandRequest stub_;              // keeps the list non-empty
+};
+
+#endif //_GRBL_COMMAND_QUEUE_H_
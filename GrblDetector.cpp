@@ -0,0 +1,303 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblDetector.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Concurrent search for EvaGrbl controllers on all serial
+//                ports, for CEVA_NDE_GrblHub::DetectDevice
+// LICENSE:       LGPL
+//
+
+#include "GrblDetector.h"
+#include "GrblPrimitives.h"
+#include "GrblTransport.h"
+#include <algorithm>
+
+#ifdef __linux__
+   #include <dirent.h>
+   #include <limits.h>
+   #include <stdlib.h>
+   #include <unistd.h>
+#endif
+
+namespace {
+
+// long enough for the wizard to ask about every port after one scan
+const double g_resultLifetimeMs = 60000.0;
+
+} // namespace
+
+MMThreadLock GrblPortScanner::lock_;
+std::map<std::string, GrblProbeResult> GrblPortScanner::results_;
+std::map<std::string, MMThreadLock*> GrblPortScanner::portLocks_;
+std::set<std::string> GrblPortScanner::portsInUse_;
+
+///////////////////////////////////////////////////////////////////////////////
+// ProbeThread class
+// (looks for a controller on one port, trying each baud rate in turn)
+///////////////////////////////////////////////////////////////////////////////
+
+class GrblPortScanner::ProbeThread : public MMDeviceThreadBase
+{
+   public:
+      ProbeThread(const std::string& port, const std::vector<long>& rates, double timeoutMs) :
+         port_(port), rates_(rates), timeoutMs_(timeoutMs), opened_(false) {}
+
+      int svc()
+      {
+         for (size_t i = 0; i < rates_.size() && !result_.found; ++i)
+         {
+            if (transport_.Open(port_, rates_[i]) != DEVICE_OK)
+               continue;
+            opened_ = true;
+            if (WaitForController())
+            {
+               result_.found = true;
+               result_.baud = rates_[i];
+            }
+            transport_.Close();
+         }
+         return 0;
+      }
+      const std::string& GetPort() const {return port_;}
+      const GrblProbeResult& GetResult() const {return result_;}
+      // false if the port could not be opened at any rate, nothing was learned
+      bool WasOpened() const {return opened_;}
+
+   private:
+      // the same handshake as CEVA_NDE_GrblHub::WaitForControllerH: a status
+      // query every 100 ms until the banner or a status report comes back
+      bool WaitForController()
+      {
+         std::string received;
+         double deadlineMs = GrblNowMs() + timeoutMs_;
+         double nextQueryMs = 0.0;
+         while (GrblNowMs() < deadlineMs)
+         {
+            if (GrblNowMs() >= nextQueryMs)
+            {
+               const unsigned char query = '?';
+               if (transport_.Write(&query, 1) != DEVICE_OK)
+                  return false;
+               nextQueryMs = GrblNowMs() + 100.0;
+            }
+            unsigned char buff[128];
+            unsigned long read = 0;
+            if (transport_.Read(buff, sizeof(buff), read, 10.0) != DEVICE_OK)
+               return false;
+            received.append((const char*) buff, read);
+            std::string::size_type eol;
+            while ((eol = received.find('\n')) != std::string::npos)
+            {
+               std::string line = received.substr(0, eol);
+               received.erase(0, eol + 1);
+               if (!line.empty() && line[line.length() - 1] == '\r')
+                  line.erase(line.length() - 1);
+               if (line.compare(0, 4, "Grbl") == 0)
+               {
+                  result_.banner = line;
+                  return true;
+               }
+               if (line.length() > 0 && line[0] == '<')
+                  return true;
+            }
+         }
+         return false;
+      }
+
+      std::string port_;
+      std::vector<long> rates_;
+      double timeoutMs_;
+      NativeSerialTransport transport_;
+      GrblProbeResult result_;
+      bool opened_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// GrblPortScanner implementation
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+
+void GrblPortScanner::Scan(const std::string& port, const std::vector<std::string>& registeredPorts,
+   const std::vector<long>& rates, double timeoutMs)
+{
+   std::vector<std::string> candidates = ListCandidatePorts();
+   std::vector<std::string> ports;
+   for (size_t i = 0; i < candidates.size(); ++i)
+   {
+      if (candidates[i] != port &&
+         std::find(registeredPorts.begin(), registeredPorts.end(), candidates[i]) != registeredPorts.end())
+         ports.push_back(candidates[i]);
+   }
+   ports.push_back(port);
+
+   std::vector<ProbeThread*> threads;
+   for (size_t i = 0; i < ports.size(); ++i)
+   {
+      GrblProbeResult cached;
+      if (GetCachedResult(ports[i], cached))
+         continue;
+      {
+         MMThreadGuard guard(lock_);
+         if (portsInUse_.count(ports[i]) > 0)
+            continue;
+      }
+      if (IsPortOpen(ports[i]))
+         continue;
+      threads.push_back(new ProbeThread(ports[i], rates, timeoutMs));
+      threads.back()->activate();
+   }
+   for (size_t i = 0; i < threads.size(); ++i)
+   {
+      threads[i]->wait();
+      if (threads[i]->WasOpened())
+      {
+         GrblProbeResult result = threads[i]->GetResult();
+         result.timeMs = GrblNowMs();
+         std::string id = GetDeviceId(threads[i]->GetPort());
+         MMThreadGuard guard(lock_);
+         results_[id] = result;
+      }
+      delete threads[i];
+   }
+}
+
+bool GrblPortScanner::GetCachedResult(const std::string& port, GrblProbeResult& result)
+{
+   std::string id = GetDeviceId(port);
+   MMThreadGuard guard(lock_);
+   std::map<std::string, GrblProbeResult>::const_iterator it = results_.find(id);
+   if (it == results_.end())
+      return false;
+   // a board may be plugged in, unplugged or powered off later
+   if (GrblNowMs() - it->second.timeMs > g_resultLifetimeMs)
+      return false;
+   result = it->second;
+   return true;
+}
+
+void GrblPortScanner::SetPortInUse(const std::string& port, bool inUse)
+{
+   MMThreadGuard guard(lock_);
+   if (inUse)
+      portsInUse_.insert(port);
+   else
+      portsInUse_.erase(port);
+}
+
+MMThreadLock& GrblPortScanner::GetPortLock(const std::string& port)
+{
+   MMThreadGuard guard(lock_);
+   MMThreadLock*& portLock = portLocks_[port];
+   if (!portLock)
+      portLock = new MMThreadLock(); // lives as long as the module
+   return *portLock;
+}
+
+#ifdef __linux__
+
+std::vector<std::string> GrblPortScanner::ListCandidatePorts()
+{
+   std::vector<std::string> ports;
+   DIR* dir = opendir("/dev");
+   if (!dir)
+      return ports;
+   while (struct dirent* entry = readdir(dir))
+   {
+      std::string name = entry->d_name;
+      if (name.compare(0, 6, "ttyUSB") == 0 || name.compare(0, 6, "ttyACM") == 0)
+         ports.push_back("/dev/" + name);
+   }
+   closedir(dir);
+   std::sort(ports.begin(), ports.end());
+   return ports;
+}
+
+bool GrblPortScanner::IsPortOpen(const std::string& port)
+{
+   char target[PATH_MAX];
+   if (!realpath(port.c_str(), target))
+      return false;
+   DIR* proc = opendir("/proc");
+   if (!proc)
+      return false;
+   bool open = false;
+   while (!open)
+   {
+      struct dirent* process = readdir(proc);
+      if (!process)
+         break;
+      if (process->d_name[0] < '0' || process->d_name[0] > '9')
+         continue;
+      // the descriptors of processes of other users cannot be listed
+      std::string fdDir = std::string("/proc/") + process->d_name + "/fd";
+      DIR* fds = opendir(fdDir.c_str());
+      if (!fds)
+         continue;
+      while (struct dirent* fd = readdir(fds))
+      {
+         if (fd->d_name[0] == '.')
+            continue;
+         char link[PATH_MAX];
+         std::string path = fdDir + "/" + fd->d_name;
+         ssize_t len = readlink(path.c_str(), link, sizeof(link) - 1);
+         if (len > 0)
+         {
+            link[len] = '\0';
+            if (std::string(link) == target)
+            {
+               open = true;
+               break;
+            }
+         }
+      }
+      closedir(fds);
+   }
+   closedir(proc);
+   return open;
+}
+
+std::string GrblPortScanner::GetDeviceId(const std::string& port)
+{
+   char target[PATH_MAX];
+   if (!realpath(port.c_str(), target))
+      return port;
+   const char* byId = "/dev/serial/by-id";
+   DIR* dir = opendir(byId);
+   if (!dir)
+      return port;
+   std::string id = port;
+   while (struct dirent* entry = readdir(dir))
+   {
+      if (entry->d_name[0] == '.')
+         continue;
+      char resolved[PATH_MAX];
+      std::string link = std::string(byId) + "/" + entry->d_name;
+      if (realpath(link.c_str(), resolved) && std::string(resolved) == target)
+      {
+         id = entry->d_name;
+         break;
+      }
+   }
+   closedir(dir);
+   return id;
+}
+
+#else
+
+std::vector<std::string> GrblPortScanner::ListCandidatePorts()
+{
+   return std::vector<std::string>();
+}
+
+bool GrblPortScanner::IsPortOpen(const std::string&)
+{
+   return false;
+}
+
+std::string GrblPortScanner::GetDeviceId(const std::string& port)
+{
+   return port;
+}
+
+#endif
@@ -0,0 +1,73 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblDetector.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Concurrent search for EvaGrbl controllers on all serial
+//                ports, for CEVA_NDE_GrblHub::DetectDevice
+// LICENSE:       LGPL
+//
+
+#ifndef _GRBL_DETECTOR_H_
+#define _GRBL_DETECTOR_H_
+
+#include "../../MMDevice/DeviceThreads.h"
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+// What probing a port found
+struct GrblProbeResult
+{
+   GrblProbeResult() : found(false), baud(0), timeMs(0.0) {}
+
+   bool found;
+   long baud;              // the rate the controller answered at
+   std::string banner;     // empty if it answered a status query instead
+   double timeMs;          // GrblNowMs() of the probe
+};
+
+// The hardware configuration wizard asks about one port at a time. The first
+// question probes every candidate port at once, each on a thread and a
+// transport of its own, and caches the answers by the USB serial number of
+// the adapter, so the following questions are answered from the cache and
+// the wizard takes about as long for many ports as for one. A board that
+// moves to another tty keeps its entry; answers are forgotten after a minute,
+// when a board may have been plugged in, unplugged or powered off. Only ports
+// that Micro-Manager has loaded a serial port device for are candidates, and
+// a port is never opened while a hub, another device or another process has
+// it open, nor if it cannot be taken exclusively. Probing needs the native
+// transport, so it only works on Linux; elsewhere Scan finds nothing and
+// callers fall back to the Micro-Manager port.
+class GrblPortScanner
+{
+public:
+   // probes port and the other candidate ports among registeredPorts that
+   // have no cached result
+   static void Scan(const std::string& port, const std::vector<std::string>& registeredPorts,
+      const std::vector<long>& rates, double timeoutMs);
+   static bool GetCachedResult(const std::string& port, GrblProbeResult& result);
+
+   static void SetPortInUse(const std::string& port, bool inUse);
+   // serialises detection on one port without holding up the others
+   static MMThreadLock& GetPortLock(const std::string& port);
+
+   // /dev/ttyUSB* and /dev/ttyACM*, the ports USB controllers show up as
+   static std::vector<std::string> ListCandidatePorts();
+   // true if any process we may look at, this one included, has the tty open
+   static bool IsPortOpen(const std::string& port);
+   // name of the port's entry in /dev/serial/by-id, which holds the USB
+   // serial number, or the port itself if it has none
+   static std::string GetDeviceId(const std::string& port);
+
+private:
+   class ProbeThread;
+
+   static MMThreadLock lock_;    // guards the static containers
+   static std::map<std::string, GrblProbeResult> results_;   // by device id
+   static std::map<std::string, MMThreadLock*> portLocks_;
+   static std::set<std::string> portsInUse_;
+};
+
+#endif //_GRBL_DETECTOR_H_
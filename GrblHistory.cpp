@@ -0,0 +1,103 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblHistory.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Timestamped history of the positions reported by the
+//                EVA_NDE_Grbl controller
+// LICENSE:       LGPL
+//
+
+#include "GrblHistory.h"
+#include "../../MMDevice/MMDevice.h"
+#include <cstdio>
+
+GrblPositionHistory::GrblPositionHistory(unsigned long capacity) :
+   samples_(capacity),
+   lastTimeMs_(0.0)
+{
+}
+
+GrblPositionHistory::~GrblPositionHistory()
+{
+}
+
+void GrblPositionHistory::Add(const GrblPositionSample& sample)
+{
+   GrblPositionSample s = sample;
+   // reports may come back faster than their queries went out
+   if (s.timeMs < lastTimeMs_)
+      s.timeMs = lastTimeMs_;
+   lastTimeMs_ = s.timeMs;
+   samples_.Push(s);
+}
+
+bool GrblPositionHistory::GetPositionAt(double timeMs, double position[3]) const
+{
+   long next = samples_.GetNext();
+   long first = samples_.GetFirst(next);
+   long last = next - 1;
+   GrblPositionSample before;
+   GrblPositionSample after;
+   if (last < first || !samples_.Read(last, after) || timeMs > after.timeMs)
+      return false;
+   // the oldest samples may be overwritten while the search runs
+   while (first < last && !samples_.Read(first, before))
+      ++first;
+   if (first == last)
+      before = after;
+   if (timeMs < before.timeMs)
+      return false;
+
+   // binary search for the last sample at or before timeMs
+   while (last - first > 1)
+   {
+      long middle = first + (last - first) / 2;
+      GrblPositionSample sample;
+      if (!samples_.Read(middle, sample))
+         return false;
+      if (sample.timeMs <= timeMs)
+      {
+         first = middle;
+         before = sample;
+      }
+      else
+      {
+         last = middle;
+         after = sample;
+      }
+   }
+   double span = after.timeMs - before.timeMs;
+   double fraction = span > 0.0 ? (timeMs - before.timeMs) / span : 0.0;
+   for (int i = 0; i < 3; ++i)
+      position[i] = before.MPos[i] + (after.MPos[i] - before.MPos[i]) * fraction;
+   return true;
+}
+
+void GrblPositionHistory::Export(std::vector<GrblPositionSample>& samples, double sinceMs) const
+{
+   samples_.Copy(samples);
+   // sample times never decrease
+   size_t skipped = 0;
+   while (skipped < samples.size() && samples[skipped].timeMs < sinceMs)
+      ++skipped;
+   samples.erase(samples.begin(), samples.begin() + skipped);
+}
+
+int GrblPositionHistory::WriteCsv(const std::string& path, double sinceMs) const
+{
+   // copy first, so that samples are added on while the file is written
+   std::vector<GrblPositionSample> samples;
+   Export(samples, sinceMs);
+   FILE* fp = fopen(path.c_str(), "w");
+   if (!fp)
+      return DEVICE_ERR;
+   bool ok = fprintf(fp, "time_ms,x_mm,y_mm,z_mm\n") > 0;
+   for (size_t i = 0; ok && i < samples.size(); ++i)
+   {
+      const GrblPositionSample& s = samples[i];
+      ok = fprintf(fp, "%.3f,%.4f,%.4f,%.4f\n", s.timeMs, s.MPos[0], s.MPos[1], s.MPos[2]) > 0;
+   }
+   ok = fclose(fp) == 0 && ok;
+   return ok ? DEVICE_OK : DEVICE_ERR;
+}
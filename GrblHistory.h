@@ -0,0 +1,57 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblHistory.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Timestamped history of the positions reported by the
+//                EVA_NDE_Grbl controller
+// LICENSE:       LGPL
+//
+
+#ifndef _GRBL_HISTORY_H_
+#define _GRBL_HISTORY_H_
+
+#include "GrblPrimitives.h"
+#include <string>
+#include <vector>
+
+// A machine position from a status report
+struct GrblPositionSample
+{
+   double timeMs;       // GrblNowMs() halfway between the query and the report
+   double MPos[3];      // mm
+};
+
+// Keeps the most recent status report positions in a ring allocated up front,
+// so memory stays bounded however long the hub runs; the oldest samples are
+// overwritten. Adding takes no lock, and readers never block the writer: a
+// sample overwritten while it is read is skipped. Sample times never
+// decrease, so positions can be looked up by time.
+class GrblPositionHistory
+{
+public:
+   // capacity in samples, rounded up to a power of two
+   explicit GrblPositionHistory(unsigned long capacity = 65536);
+   ~GrblPositionHistory();
+
+   // from one thread at a time
+   void Add(const GrblPositionSample& sample);
+   // position at timeMs, interpolated linearly between the samples around
+   // it; false if timeMs is not between the oldest and the newest sample
+   bool GetPositionAt(double timeMs, double position[3]) const;
+   // copies the samples taken at sinceMs or later, oldest first
+   void Export(std::vector<GrblPositionSample>& samples, double sinceMs = 0.0) const;
+   // writes them as CSV with a time_ms,x_mm,y_mm,z_mm header
+   int WriteCsv(const std::string& path, double sinceMs = 0.0) const;
+
+   unsigned long GetCapacity() const {return samples_.GetCapacity();}
+
+private:
+   GrblPositionHistory(const GrblPositionHistory&);
+   GrblPositionHistory& operator=(const GrblPositionHistory&);
+
+   GrblPublishedRing<GrblPositionSample> samples_;
+   double lastTimeMs_;              // of the newest sample, for the writer only
+};
+
+#endif //_GRBL_HISTORY_H_
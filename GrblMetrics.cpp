@@ -0,0 +1,193 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblMetrics.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Latency histograms and serial counters of the EVA_NDE_Grbl hub
+// LICENSE:       LGPL
+//
+
+#include "GrblMetrics.h"
+#include "../../MMDevice/MMDevice.h"
+#include <fstream>
+#include <sstream>
+
+///////////////////////////////////////////////////////////////////////////////
+// GrblLatencyHistogram implementation
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+
+GrblLatencyHistogram::GrblLatencyHistogram()
+{
+   Reset();
+}
+
+void GrblLatencyHistogram::Record(double us)
+{
+   unsigned long value = us > 0.0 ? (unsigned long) (us + 0.5) : 0;
+   if (value > 0x7fffffffUL)
+      value = 0x7fffffffUL;
+   GrblAtomicIncrement(&counts_[GetBucket(value)]);
+   GrblAtomicIncrement(&count_);
+   long max = GrblAtomicLoad(&maxUs_);
+   while ((long) value > max && !GrblAtomicCompareExchange(&maxUs_, max, (long) value))
+      max = GrblAtomicLoad(&maxUs_);
+}
+
+void GrblLatencyHistogram::Reset()
+{
+   for (int i = 0; i < BUCKETS; ++i)
+      GrblAtomicStore(&counts_[i], 0);
+   GrblAtomicStore(&count_, 0);
+   GrblAtomicStore(&maxUs_, 0);
+}
+
+// values below 8 us have a bucket each, above that the three bits after the
+// leading one select the sub-bucket of the power of two
+int GrblLatencyHistogram::GetBucket(unsigned long us)
+{
+   if (us < SUB_BUCKETS)
+      return (int) us;
+   int shift = 0;
+   while ((us >> shift) >= 2 * SUB_BUCKETS)
+      ++shift;
+   return (shift + 1) * SUB_BUCKETS + (int) ((us >> shift) - SUB_BUCKETS);
+}
+
+unsigned long GrblLatencyHistogram::GetBucketUpperUs(int bucket)
+{
+   if (bucket < SUB_BUCKETS)
+      return bucket;
+   int shift = bucket / SUB_BUCKETS - 1;
+   unsigned long sub = bucket % SUB_BUCKETS;
+   return ((SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+double GrblLatencyHistogram::GetPercentileUs(double p) const
+{
+   long count = GetCount();
+   if (count == 0)
+      return 0.0;
+   long rank = (long) (p * count + 0.5);
+   if (rank < 1)
+      rank = 1;
+   long seen = 0;
+   for (int i = 0; i < BUCKETS; ++i)
+   {
+      seen += GrblAtomicLoad(&counts_[i]);
+      if (seen >= rank)
+      {
+         // the bucket bound may lie above anything recorded
+         double upper = (double) GetBucketUpperUs(i);
+         double max = (double) GetMaxUs();
+         return upper < max ? upper : max;
+      }
+   }
+   return (double) GetMaxUs();
+}
+
+std::string GrblLatencyHistogram::Format() const
+{
+   std::ostringstream os;
+   os << "count=" << GetCount()
+      << " p50=" << (long) GetPercentileUs(0.50)
+      << " p90=" << (long) GetPercentileUs(0.90)
+      << " p99=" << (long) GetPercentileUs(0.99)
+      << " max=" << GetMaxUs();
+   return os.str();
+}
+
+std::string GrblLatencyHistogram::FormatJson() const
+{
+   std::ostringstream os;
+   os << "{\"count\":" << GetCount()
+      << ",\"p50_us\":" << (long) GetPercentileUs(0.50)
+      << ",\"p90_us\":" << (long) GetPercentileUs(0.90)
+      << ",\"p99_us\":" << (long) GetPercentileUs(0.99)
+      << ",\"max_us\":" << GetMaxUs()
+      << ",\"buckets\":[";
+   bool first = true;
+   for (int i = 0; i < BUCKETS; ++i)
+   {
+      long n = GrblAtomicLoad(&counts_[i]);
+      if (n == 0)
+         continue;
+      os << (first ? "" : ",") << "[" << GetBucketUpperUs(i) << "," << n << "]";
+      first = false;
+   }
+   os << "]}";
+   return os.str();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GrblMetrics implementation
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+
+GrblMetrics::GrblMetrics()
+{
+   for (int i = 0; i < COUNTERS; ++i)
+      counters_[i] = 0;
+}
+
+GrblMetrics::LatencyClass GrblMetrics::Classify(const GrblCommand& command)
+{
+   if (command.IsHoming())
+      return HOMING;
+   if (command.IsSystemCommand())
+      return SETTINGS;
+   return MOTION;
+}
+
+const char* GrblMetrics::GetLatencyClassName(LatencyClass latencyClass)
+{
+   switch (latencyClass)
+   {
+      case STATUS: return "Status";
+      case MOTION: return "Motion";
+      case SETTINGS: return "Settings";
+      case HOMING: return "Homing";
+      case REALTIME: return "Realtime";
+      case LOCK_WAIT: return "LockWait";
+      default: return "";
+   }
+}
+
+const char* GrblMetrics::GetCounterName(Counter counter)
+{
+   switch (counter)
+   {
+      case BYTES_IN: return "BytesIn";
+      case BYTES_OUT: return "BytesOut";
+      case TIMEOUTS: return "Timeouts";
+      case ERROR_REPLIES: return "ErrorReplies";
+      case PURGES: return "Purges";
+      case MOTION_STALLS: return "MotionStalls";
+      default: return "";
+   }
+}
+
+void GrblMetrics::Reset()
+{
+   for (int i = 0; i < LATENCY_CLASSES; ++i)
+      latency_[i].Reset();
+   predictionError_.Reset();
+   for (int i = 0; i < COUNTERS; ++i)
+      GrblAtomicStore(&counters_[i], 0);
+}
+
+int GrblMetrics::WriteSnapshot(const std::string& path) const
+{
+   std::ofstream out(path.c_str(), std::ios::app);
+   if (!out)
+      return DEVICE_ERR;
+   out << "{\"time_ms\":" << (long) GrblNowMs();
+   for (int i = 0; i < COUNTERS; ++i)
+      out << ",\"" << GetCounterName((Counter) i) << "\":" << GetCounter((Counter) i);
+   for (int i = 0; i < LATENCY_CLASSES; ++i)
+      out << ",\"Latency" << GetLatencyClassName((LatencyClass) i) << "\":" << latency_[i].FormatJson();
+   // same layout, in nanometres rather than microseconds
+   out << ",\"PredictionErrorNm\":" << predictionError_.FormatJson();
+   out << "}" << std::endl;
+   return out ? DEVICE_OK : DEVICE_ERR;
+}
@@ -0,0 +1,104 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblMetrics.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Latency histograms and serial counters of the EVA_NDE_Grbl hub
+// LICENSE:       LGPL
+//
+
+#ifndef _GRBL_METRICS_H_
+#define _GRBL_METRICS_H_
+
+#include "GrblPrimitives.h"
+#include "GrblProtocol.h"
+#include <string>
+
+//////////////////////////////////////////////////////////////////////////////
+// Latency histogram in whole microseconds with logarithmic buckets, each
+// power of two split into 8 linear sub-buckets, so every value is kept
+// within 12.5% up to about 35 minutes. Recording is a few shifts and an
+// atomic increment, and readers may run while others record.
+//
+class GrblLatencyHistogram
+{
+public:
+   GrblLatencyHistogram();
+
+   void Record(double us);
+   void Reset();
+
+   long GetCount() const {return GrblAtomicLoad(&count_);}
+   long GetMaxUs() const {return GrblAtomicLoad(&maxUs_);}
+   // upper bound of the bucket holding the p-th fraction of all values
+   double GetPercentileUs(double p) const;
+   // count=... p50=... p90=... p99=... max=... (microseconds)
+   std::string Format() const;
+   // {"count":...,"p50_us":...,...,"buckets":[[upper_us,count],...]}
+   std::string FormatJson() const;
+
+private:
+   enum {SUB_BUCKETS = 8, BUCKETS = 8 * 32};
+
+   static int GetBucket(unsigned long us);
+   static unsigned long GetBucketUpperUs(int bucket);
+
+   mutable volatile long counts_[BUCKETS];
+   mutable volatile long count_;
+   mutable volatile long maxUs_;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Everything the hub measures about its traffic with the controller
+//
+class GrblMetrics
+{
+public:
+   // LOCK_WAIT is the time commands spend waiting for the port
+   enum LatencyClass {STATUS, MOTION, SETTINGS, HOMING, REALTIME, LOCK_WAIT, LATENCY_CLASSES};
+   enum Counter {BYTES_IN, BYTES_OUT, TIMEOUTS, ERROR_REPLIES, PURGES, MOTION_STALLS, COUNTERS};
+
+   GrblMetrics();
+
+   static LatencyClass Classify(const GrblCommand& command);
+   static const char* GetLatencyClassName(LatencyClass latencyClass);
+   static const char* GetCounterName(Counter counter);
+
+   void RecordLatency(LatencyClass latencyClass, double us) {latency_[latencyClass].Record(us);}
+   void Add(Counter counter, long n) {GrblAtomicAdd(&counters_[counter], n);}
+   void Increment(Counter counter) {GrblAtomicIncrement(&counters_[counter]);}
+   // distance between a status report and the predicted position, kept in
+   // a histogram of whole nanometres
+   void RecordPredictionError(double um) {predictionError_.Record(1000.0 * um);}
+
+   const GrblLatencyHistogram& GetLatency(LatencyClass latencyClass) const {return latency_[latencyClass];}
+   long GetCounter(Counter counter) const {return GrblAtomicLoad(&counters_[counter]);}
+   const GrblLatencyHistogram& GetPredictionError() const {return predictionError_;}
+
+   void Reset();
+   // appends all counters and histograms as a single JSON line
+   int WriteSnapshot(const std::string& path) const;
+
+private:
+   GrblLatencyHistogram latency_[LATENCY_CLASSES];
+   GrblLatencyHistogram predictionError_;
+   mutable volatile long counters_[COUNTERS];
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Records the time from construction to destruction into a histogram
+//
+class GrblLatencyTimer
+{
+public:
+   GrblLatencyTimer(GrblMetrics& metrics, GrblMetrics::LatencyClass latencyClass) :
+      metrics_(metrics), latencyClass_(latencyClass), startMs_(GrblNowMs()) {}
+   ~GrblLatencyTimer() {metrics_.RecordLatency(latencyClass_, 1000.0 * (GrblNowMs() - startMs_));}
+
+private:
+   GrblMetrics& metrics_;
+   GrblMetrics::LatencyClass latencyClass_;
+   double startMs_;
+};
+
+#endif //_GRBL_METRICS_H_
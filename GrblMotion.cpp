@@ -0,0 +1,546 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblMotion.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Model of the moves queued in the EvaGrbl planner, predicting
+//                the stage position between status reports
+// LICENSE:       LGPL
+//
+
+#include "GrblMotion.h"
+#include <cmath>
+
+namespace {
+
+// a report further than this from the modelled path means the model is wrong
+const double g_offPathToleranceMm = 0.05;
+
+// distance from point to the segment [a, b], and how far along it the
+// nearest point lies
+double DistanceToSegment(const double point[2], const double a[2], const double b[2], double& along)
+{
+   double dx = b[0] - a[0];
+   double dy = b[1] - a[1];
+   double length = sqrt(dx * dx + dy * dy);
+   along = 0.0;
+   if (length > 0.0)
+   {
+      along = ((point[0] - a[0]) * dx + (point[1] - a[1]) * dy) / length;
+      if (along < 0.0)
+         along = 0.0;
+      else if (along > length)
+         along = length;
+   }
+   double x = a[0] + (length > 0.0 ? dx * along / length : 0.0) - point[0];
+   double y = a[1] + (length > 0.0 ? dy * along / length : 0.0) - point[1];
+   return sqrt(x * x + y * y);
+}
+
+// each move from first on starts when the controller has taken its line and
+// the move before it has ended
+void Schedule(std::deque<GrblMoveProfile>& moves, size_t first)
+{
+   for (size_t i = first; i < moves.size(); ++i)
+   {
+      double startMs = moves[i].queuedMs;
+      if (i > 0 && moves[i - 1].GetEndMs() > startMs)
+         startMs = moves[i - 1].GetEndMs();
+      moves[i].startMs = startMs;
+   }
+}
+
+// fastest speed in mm/s at which the planner takes the corner from a into b
+double MaxJunctionSpeed(const GrblMoveProfile& a, const GrblMoveProfile& b, const GrblMachineLimits& limits)
+{
+   double cosTheta = -((a.end[0] - a.start[0]) * (b.end[0] - b.start[0]) +
+      (a.end[1] - a.start[1]) * (b.end[1] - b.start[1])) / (a.lengthMm * b.lengthMm);
+   if (cosTheta >= 0.95)
+      return 0.0; // about to reverse
+   double speed = a.nominalSpeed < b.nominalSpeed ? a.nominalSpeed : b.nominalSpeed;
+   if (cosTheta > -0.95)
+   {
+      // the speed at which a circle deviating junctionDeviationMm from the
+      // corner can be followed at the given acceleration
+      double sinHalf = sqrt(0.5 * (1.0 - cosTheta));
+      double corner = sqrt(limits.accelerationMmPerS2 * limits.junctionDeviationMm * sinHalf / (1.0 - sinHalf));
+      if (corner < speed)
+         speed = corner;
+   }
+   return speed;
+}
+
+// speed reached from speed over distanceMm at the given acceleration
+double Reachable(double speed, double acceleration, double distanceMm)
+{
+   return sqrt(speed * speed + 2.0 * acceleration * distanceMm);
+}
+
+} // namespace
+
+///////////////////////////////////////////////////////////////////////////////
+// GrblMachineLimits implementation
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+
+bool GrblMachineLimits::FromParameters(const std::vector<double>& parameters)
+{
+   if (parameters.size() <= 9 || parameters[0] <= 0.0 || parameters[1] <= 0.0 || parameters[4] <= 0.0 ||
+      parameters[5] <= 0.0 || parameters[8] <= 0.0 || parameters[9] < 0.0)
+      return false;
+   stepsPerMm[0] = parameters[0];
+   stepsPerMm[1] = parameters[1];
+   feedMmPerMin = parameters[4];
+   seekMmPerMin = parameters[5];
+   accelerationMmPerS2 = parameters[8];
+   junctionDeviationMm = parameters[9];
+   return true;
+}
+
+double GrblMachineLimits::GetRateMmPerMin(bool rapid, double lineFeedMmPerMin) const
+{
+   if (rapid)
+      return seekMmPerMin;
+   return lineFeedMmPerMin > 0.0 ? lineFeedMmPerMin : feedMmPerMin;
+}
+
+void GrblMachineLimits::Quantize(const double position[2], double quantized[2]) const
+{
+   for (int i = 0; i < 2; ++i)
+      quantized[i] = floor(position[i] * stepsPerMm[i] + 0.5) / stepsPerMm[i];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GrblMoveProfile implementation
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+
+GrblMoveProfile::GrblMoveProfile() :
+   lengthMm(0.0), nominalSpeed(0.0), entrySpeed(0.0), cruiseSpeed(0.0), exitSpeed(0.0), acceleration(0.0),
+   accelS(0.0), cruiseS(0.0), decelS(0.0), queuedMs(0.0), startMs(0.0), valid(false)
+{
+   start[0] = start[1] = 0.0;
+   end[0] = end[1] = 0.0;
+}
+
+void GrblMoveProfile::Plan(const double from[2], const double to[2], double nominalSpeed, double accel,
+   double entry, double exit)
+{
+   for (int i = 0; i < 2; ++i)
+   {
+      start[i] = from[i];
+      end[i] = to[i];
+   }
+   double dx = to[0] - from[0];
+   double dy = to[1] - from[1];
+   lengthMm = sqrt(dx * dx + dy * dy);
+   this->nominalSpeed = nominalSpeed;
+   acceleration = accel;
+   entrySpeed = entry;
+   exitSpeed = exit;
+   cruiseSpeed = nominalSpeed;
+   accelS = cruiseS = decelS = 0.0;
+   valid = true;
+   if (lengthMm <= 0.0 || nominalSpeed <= 0.0)
+      return;
+   if (acceleration <= 0.0)
+   {
+      // no ramps at all
+      cruiseS = lengthMm / cruiseSpeed;
+      return;
+   }
+   double accelMm = (cruiseSpeed * cruiseSpeed - entrySpeed * entrySpeed) / (2.0 * acceleration);
+   double decelMm = (cruiseSpeed * cruiseSpeed - exitSpeed * exitSpeed) / (2.0 * acceleration);
+   if (accelMm + decelMm > lengthMm)
+   {
+      // triangular: the ramps meet before the nominal speed is reached
+      double peak2 = acceleration * lengthMm + 0.5 * (entrySpeed * entrySpeed + exitSpeed * exitSpeed);
+      cruiseSpeed = sqrt(peak2);
+      if (cruiseSpeed < entrySpeed)
+         cruiseSpeed = entrySpeed;
+      if (cruiseSpeed < exitSpeed)
+         cruiseSpeed = exitSpeed;
+      accelMm = (cruiseSpeed * cruiseSpeed - entrySpeed * entrySpeed) / (2.0 * acceleration);
+      decelMm = lengthMm - accelMm;
+      if (decelMm < 0.0)
+         decelMm = 0.0;
+   }
+   accelS = (cruiseSpeed - entrySpeed) / acceleration;
+   decelS = (cruiseSpeed - exitSpeed) / acceleration;
+   double cruiseMm = lengthMm - accelMm - decelMm;
+   cruiseS = cruiseMm > 0.0 ? cruiseMm / cruiseSpeed : 0.0;
+}
+
+double GrblMoveProfile::GetDistanceAt(double elapsedMs) const
+{
+   double t = elapsedMs / 1000.0;
+   if (t <= 0.0)
+      return 0.0;
+   if (t >= accelS + cruiseS + decelS)
+      return lengthMm;
+   double distance;
+   if (t < accelS)
+      distance = entrySpeed * t + 0.5 * acceleration * t * t;
+   else
+   {
+      double accelMm = entrySpeed * accelS + 0.5 * acceleration * accelS * accelS;
+      if (t < accelS + cruiseS)
+         distance = accelMm + cruiseSpeed * (t - accelS);
+      else
+      {
+         double u = t - accelS - cruiseS;
+         distance = accelMm + cruiseSpeed * cruiseS + cruiseSpeed * u - 0.5 * acceleration * u * u;
+      }
+   }
+   return distance < lengthMm ? distance : lengthMm;
+}
+
+double GrblMoveProfile::GetTimeAtDistance(double distanceMm) const
+{
+   if (distanceMm <= 0.0 || lengthMm <= 0.0)
+      return 0.0;
+   if (distanceMm >= lengthMm)
+      return GetDurationMs();
+   double accelMm = entrySpeed * accelS + 0.5 * acceleration * accelS * accelS;
+   double cruiseMm = cruiseSpeed * cruiseS;
+   double t;
+   if (distanceMm < accelMm && acceleration > 0.0)
+      t = (sqrt(entrySpeed * entrySpeed + 2.0 * acceleration * distanceMm) - entrySpeed) / acceleration;
+   else if (distanceMm < accelMm + cruiseMm || acceleration <= 0.0)
+      t = accelS + (distanceMm - accelMm) / cruiseSpeed;
+   else
+   {
+      double d = cruiseSpeed * cruiseSpeed - 2.0 * acceleration * (distanceMm - accelMm - cruiseMm);
+      t = accelS + cruiseS + (cruiseSpeed - sqrt(d > 0.0 ? d : 0.0)) / acceleration;
+   }
+   return 1000.0 * t;
+}
+
+void GrblMoveProfile::GetPositionAt(double elapsedMs, double position[2]) const
+{
+   double fraction = lengthMm > 0.0 ? GetDistanceAt(elapsedMs) / lengthMm : 1.0;
+   for (int i = 0; i < 2; ++i)
+      position[i] = start[i] + (end[i] - start[i]) * fraction;
+}
+
+void GrblPlanJunctions(std::deque<GrblMoveProfile>& moves, size_t first, const GrblMachineLimits& limits)
+{
+   if (first >= moves.size())
+      return;
+   double accel = limits.accelerationMmPerS2;
+   // entry[i] is the speed at the start of moves[i], entry[n] the final stop
+   size_t n = moves.size();
+   std::vector<double> entry(n + 1, 0.0);
+   entry[first] = moves[first].entrySpeed;
+   size_t previous = first;
+   for (size_t i = first + 1; i < n; ++i)
+   {
+      // moves of no length are passed through at the speed before them
+      if (moves[i].lengthMm <= 0.0)
+         continue;
+      entry[i] = moves[previous].lengthMm > 0.0 ? MaxJunctionSpeed(moves[previous], moves[i], limits) : 0.0;
+      previous = i;
+   }
+
+   // backwards: every move must be able to slow down to the next entry
+   double exit = 0.0;
+   for (size_t i = n; i-- > first + 1;)
+   {
+      if (moves[i].lengthMm <= 0.0)
+      {
+         entry[i] = exit;
+         continue;
+      }
+      double reachable = Reachable(exit, accel, moves[i].lengthMm);
+      if (entry[i] > reachable)
+         entry[i] = reachable;
+      exit = entry[i];
+   }
+   entry[n] = 0.0;
+   // forwards: and to speed up to it
+   for (size_t i = first; i < n; ++i)
+   {
+      GrblMoveProfile& move = moves[i];
+      double next = entry[i + 1];
+      double reachable = Reachable(entry[i], accel, move.lengthMm);
+      if (next > reachable)
+         entry[i + 1] = next = reachable;
+      if (move.valid)
+         move.Plan(move.start, move.end, move.nominalSpeed, move.acceleration, entry[i], i + 1 < n ? next : 0.0);
+   }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GrblMoveEstimator implementation
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+
+GrblMoveEstimator::GrblMoveEstimator(const GrblMachineLimits& limits) : limits_(limits)
+{
+   position_[0] = position_[1] = 0.0;
+}
+
+void GrblMoveEstimator::Reset(const double position[2])
+{
+   moves_.clear();
+   limits_.Quantize(position, position_);
+}
+
+void GrblMoveEstimator::AddMove(const double target[2], int axes, bool relative, bool rapid, double feedMmPerMin)
+{
+   double to[2];
+   for (int i = 0; i < 2; ++i)
+   {
+      to[i] = position_[i];
+      if (axes & (1 << i))
+         to[i] = relative ? position_[i] + target[i] : target[i];
+   }
+   limits_.Quantize(to, to);
+   GrblMoveProfile move;
+   move.Plan(position_, to, limits_.GetRateMmPerMin(rapid, feedMmPerMin) / 60.0, limits_.accelerationMmPerS2);
+   moves_.push_back(move);
+   position_[0] = to[0];
+   position_[1] = to[1];
+}
+
+double GrblMoveEstimator::Plan()
+{
+   if (moves_.empty())
+      return 0.0;
+   moves_.front().entrySpeed = 0.0;
+   GrblPlanJunctions(moves_, 0, limits_);
+   Schedule(moves_, 0);
+   return moves_.back().GetEndMs();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GrblTrajectory implementation
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+
+GrblTrajectory::GrblTrajectory() : known_(false)
+{
+   rest_[0] = rest_[1] = 0.0;
+   planned_[0] = planned_[1] = 0.0;
+}
+
+void GrblTrajectory::SetLimits(const GrblMachineLimits& limits)
+{
+   MMThreadGuard guard(lock_);
+   limits_ = limits;
+}
+
+void GrblTrajectory::AddMove(const double target[2], int axes, bool relative, bool rapid, double feedMmPerMin)
+{
+   MMThreadGuard guard(lock_);
+   GrblMoveProfile move;
+   if (known_)
+   {
+      double to[2];
+      for (int i = 0; i < 2; ++i)
+      {
+         to[i] = planned_[i];
+         if (axes & (1 << i))
+            to[i] = relative ? planned_[i] + target[i] : target[i];
+      }
+      limits_.Quantize(to, to);
+      move.Plan(planned_, to, limits_.GetRateMmPerMin(rapid, feedMmPerMin) / 60.0, limits_.accelerationMmPerS2);
+      planned_[0] = to[0];
+      planned_[1] = to[1];
+   }
+   pending_.push_back(move);
+}
+
+void GrblTrajectory::AddUnknownMove()
+{
+   MMThreadGuard guard(lock_);
+   pending_.push_back(GrblMoveProfile());
+   known_ = false;
+}
+
+void GrblTrajectory::Acknowledge(bool accepted, double timeMs)
+{
+   MMThreadGuard guard(lock_);
+   if (pending_.empty())
+      return;
+   GrblMoveProfile move = pending_.front();
+   pending_.pop_front();
+   if (!accepted)
+   {
+      // the lines after it were planned from where it would have ended
+      Forget();
+      return;
+   }
+   if (!known_ || !move.valid)
+      return;
+   Prune(timeMs);
+   move.queuedMs = timeMs;
+   moves_.push_back(move);
+   // a move taken while the one before it still runs is blended into it
+   GrblPlanJunctions(moves_, 0, limits_);
+   Schedule(moves_, moves_.size() > 1 ? 1 : 0);
+}
+
+void GrblTrajectory::Invalidate()
+{
+   MMThreadGuard guard(lock_);
+   Forget();
+}
+
+void GrblTrajectory::Abort()
+{
+   MMThreadGuard guard(lock_);
+   known_ = false;
+   moves_.clear();
+   pending_.clear();
+}
+
+double GrblTrajectory::Correct(const double position[2], bool idle, double timeMs)
+{
+   MMThreadGuard guard(lock_);
+   if (!known_)
+   {
+      // anchor only when no line in flight can still move the machine
+      if (idle && pending_.empty())
+      {
+         rest_[0] = planned_[0] = position[0];
+         rest_[1] = planned_[1] = position[1];
+         known_ = true;
+      }
+      return -1.0;
+   }
+   double predicted[2];
+   Locate(timeMs, predicted);
+   double dx = position[0] - predicted[0];
+   double dy = position[1] - predicted[1];
+   double error = sqrt(dx * dx + dy * dy);
+   if (idle)
+   {
+      // everything answered so far has finished
+      moves_.clear();
+      rest_[0] = position[0];
+      rest_[1] = position[1];
+      if (pending_.empty())
+      {
+         planned_[0] = position[0];
+         planned_[1] = position[1];
+      }
+      return error;
+   }
+   if (moves_.empty())
+      return -1.0; // moving on a line that has not been answered yet
+
+   // find where on the path the report lies, preferring the earliest move
+   size_t nearest = 0;
+   double nearestDistance = 0.0;
+   double nearestAlong = 0.0;
+   for (size_t i = 0; i < moves_.size(); ++i)
+   {
+      double along;
+      double distance = DistanceToSegment(position, moves_[i].start, moves_[i].end, along);
+      if (i == 0 || distance < nearestDistance)
+      {
+         nearest = i;
+         nearestDistance = distance;
+         nearestAlong = along;
+      }
+   }
+   if (nearestDistance > g_offPathToleranceMm)
+   {
+      // not where any queued move goes, the model has lost track
+      Forget();
+      return error;
+   }
+   // the machine is ahead of or behind the model, move the schedule in time
+   GrblMoveProfile& move = moves_[nearest];
+   move.startMs = timeMs - move.GetTimeAtDistance(nearestAlong);
+   if (move.queuedMs > move.startMs)
+      move.queuedMs = move.startMs;
+   for (size_t i = 0; i < nearest; ++i)
+   {
+      rest_[0] = moves_.front().end[0];
+      rest_[1] = moves_.front().end[1];
+      moves_.pop_front();
+   }
+   Schedule(moves_, 1);
+   return error;
+}
+
+bool GrblTrajectory::Predict(double timeMs, double position[2]) const
+{
+   MMThreadGuard guard(lock_);
+   if (!known_)
+      return false;
+   Locate(timeMs, position);
+   return true;
+}
+
+bool GrblTrajectory::EstimateEndMs(double nowMs, double& endMs) const
+{
+   MMThreadGuard guard(lock_);
+   if (!known_)
+      return false;
+   std::deque<GrblMoveProfile> moves(moves_);
+   size_t first = moves.size();
+   for (size_t i = 0; i < pending_.size(); ++i)
+   {
+      if (!pending_[i].valid)
+         return false;
+      moves.push_back(pending_[i]);
+      moves.back().queuedMs = nowMs;
+   }
+   if (moves.empty())
+   {
+      endMs = nowMs;
+      return true;
+   }
+   GrblPlanJunctions(moves, 0, limits_);
+   Schedule(moves, first > 0 ? 1 : 0);
+   endMs = moves.back().GetEndMs();
+   if (endMs < nowMs)
+      endMs = nowMs;
+   return true;
+}
+
+// position of the model at timeMs
+void GrblTrajectory::Locate(double timeMs, double position[2]) const
+{
+   for (size_t i = 0; i < moves_.size(); ++i)
+   {
+      const GrblMoveProfile& move = moves_[i];
+      if (timeMs < move.startMs)
+      {
+         position[0] = move.start[0];
+         position[1] = move.start[1];
+         return;
+      }
+      if (timeMs < move.GetEndMs())
+      {
+         move.GetPositionAt(timeMs - move.startMs, position);
+         return;
+      }
+   }
+   const double* last = moves_.empty() ? rest_ : moves_.back().end;
+   position[0] = last[0];
+   position[1] = last[1];
+}
+
+// loses the position; the lines in flight are kept to match their answers
+void GrblTrajectory::Forget()
+{
+   known_ = false;
+   moves_.clear();
+   for (size_t i = 0; i < pending_.size(); ++i)
+      pending_[i].valid = false;
+}
+
+// drops the moves that have ended by timeMs
+void GrblTrajectory::Prune(double timeMs)
+{
+   while (!moves_.empty() && moves_.front().GetEndMs() <= timeMs)
+   {
+      rest_[0] = moves_.front().end[0];
+      rest_[1] = moves_.front().end[1];
+      moves_.pop_front();
+   }
+}
@@ -0,0 +1,161 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblMotion.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Model of the moves queued in the EvaGrbl planner, predicting
+//                the stage position between status reports
+// LICENSE:       LGPL
+//
+
+#ifndef _GRBL_MOTION_H_
+#define _GRBL_MOTION_H_
+
+#include "../../MMDevice/DeviceThreads.h"
+#include <cstddef>
+#include <deque>
+#include <vector>
+
+// The controller settings that shape a move
+struct GrblMachineLimits
+{
+   GrblMachineLimits() : feedMmPerMin(250.0), seekMmPerMin(500.0), accelerationMmPerS2(10.0),
+      junctionDeviationMm(0.05) {stepsPerMm[0] = stepsPerMm[1] = 250.0;}
+
+   // $0, $1, $4, $5, $8 and $9 from the settings in the order $$ lists
+   // them; false if there are too few of them or they make no sense
+   bool FromParameters(const std::vector<double>& parameters);
+   // mm/min of a G0 line if rapid, else of a G1 line with feedMmPerMin,
+   // negative if the line set none
+   double GetRateMmPerMin(bool rapid, double feedMmPerMin) const;
+   // rounds to whole steps, as the planner does with every target
+   void Quantize(const double position[2], double quantized[2]) const;
+
+   double stepsPerMm[2];         // $0, $1
+   double feedMmPerMin;          // $4, G1 until a line sets F
+   double seekMmPerMin;          // $5, G0
+   double accelerationMmPerS2;   // $8
+   double junctionDeviationMm;   // $9
+};
+
+// A straight move with a trapezoidal velocity profile: constant acceleration
+// from the entry speed up to the cruise speed, cruising, and constant
+// deceleration down to the exit speed. Short moves never reach the nominal
+// speed and have a triangular profile instead.
+struct GrblMoveProfile
+{
+   GrblMoveProfile();
+
+   // from start to end in mm at up to nominal mm/s; speeds in mm/s
+   void Plan(const double from[2], const double to[2], double nominalSpeed, double acceleration,
+      double entrySpeed = 0.0, double exitSpeed = 0.0);
+
+   double GetDurationMs() const {return 1000.0 * (accelS + cruiseS + decelS);}
+   double GetEndMs() const {return startMs + GetDurationMs();}
+   // distance along the move after elapsedMs, 0 to lengthMm
+   double GetDistanceAt(double elapsedMs) const;
+   // inverse of GetDistanceAt
+   double GetTimeAtDistance(double distanceMm) const;
+   // position after elapsedMs
+   void GetPositionAt(double elapsedMs, double position[2]) const;
+
+   double start[2];              // mm
+   double end[2];
+   double lengthMm;
+   double nominalSpeed;          // mm/s, from the feed or seek rate
+   double entrySpeed;
+   double cruiseSpeed;
+   double exitSpeed;
+   double acceleration;          // mm/s^2
+   double accelS;                // duration of each phase
+   double cruiseS;
+   double decelS;
+   double queuedMs;              // GrblNowMs() when the controller took the line
+   double startMs;               // when the move begins, after the ones before it
+   bool valid;                   // false for lines that could not be modelled
+};
+
+// Sets the entry and exit speeds of moves[first] on the way the Grbl 0.8
+// planner does and plans their profiles again: each junction as fast as
+// the junction deviation and the nominal speeds on both sides allow, no
+// speed change faster than the acceleration allows, and the last move
+// ending at rest. The entry speed of moves[first] is kept.
+void GrblPlanJunctions(std::deque<GrblMoveProfile>& moves, size_t first, const GrblMachineLimits& limits);
+
+// Estimates how long a batch of moves takes, blending them at their
+// junctions as the controller would if they were queued together
+class GrblMoveEstimator
+{
+public:
+   explicit GrblMoveEstimator(const GrblMachineLimits& limits);
+
+   // the batch starts at rest at position, in mm
+   void Reset(const double position[2]);
+   // as GrblTrajectory::AddMove
+   void AddMove(const double target[2], int axes, bool relative, bool rapid, double feedMmPerMin);
+   // plans the batch and returns its duration in ms
+   double Plan();
+   // after Plan, with startMs counted from the start of the batch
+   size_t GetMoveCount() const {return moves_.size();}
+   const GrblMoveProfile& GetMove(size_t index) const {return moves_[index];}
+
+private:
+   GrblMachineLimits limits_;
+   std::deque<GrblMoveProfile> moves_;
+   double position_[2];
+};
+
+// Follows the XY moves the controller has queued in work coordinates, so
+// the position can be told at any time without asking the controller.
+// Lines are added as they are written and start when the controller
+// answers them, right after the previous move ends; each status report then
+// corrects the model, shifting the moves in time so the report lies on the
+// predicted path, or anchoring it at rest on Idle. Whatever cannot be
+// modelled - homing, arcs, inches, changed offsets, lost replies - makes the
+// model unknown until the controller next reports Idle with nothing in
+// flight. Moves answered before the one ahead of them has ended are blended
+// as by GrblPlanJunctions. All methods may be called from any thread.
+class GrblTrajectory
+{
+public:
+   GrblTrajectory();
+
+   void SetLimits(const GrblMachineLimits& limits);
+   // a motion line has been written; target in mm for the axes in axes
+   // (bit 0 X, bit 1 Y), relative to the end of the previous move if
+   // relative; at the seek rate if rapid, else at feedMmPerMin or the
+   // default feed if that is negative
+   void AddMove(const double target[2], int axes, bool relative, bool rapid, double feedMmPerMin);
+   // a motion line has been written that cannot be modelled
+   void AddUnknownMove();
+   // the controller has answered the oldest line added; accepted if with ok
+   void Acknowledge(bool accepted, double timeMs);
+   // forgets the position, keeping track of the lines in flight
+   void Invalidate();
+   // forgets the position and the lines in flight, whose answers are lost
+   void Abort();
+   // takes the work position of a status report made at timeMs; returns the
+   // distance in mm between it and the prediction, negative if there was none
+   double Correct(const double position[2], bool idle, double timeMs);
+   // work position at timeMs in mm; false if unknown
+   bool Predict(double timeMs, double position[2]) const;
+   // when the moves added so far will have ended, taking those not yet
+   // answered as answered at nowMs; false if unknown
+   bool EstimateEndMs(double nowMs, double& endMs) const;
+
+private:
+   // these expect lock_ to be held
+   void Forget();
+   void Locate(double timeMs, double position[2]) const;
+   void Prune(double timeMs);
+
+   mutable MMThreadLock lock_;
+   GrblMachineLimits limits_;
+   std::deque<GrblMoveProfile> moves_;    // started, in order
+   std::deque<GrblMoveProfile> pending_;  // written but not yet answered
+   double rest_[2];              // where the machine stands if moves_ is empty
+   double planned_[2];           // end of the last move added
+   bool known_;
+};
+
+#endif //_GRBL_MOTION_H_
@@ -0,0 +1,434 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblPrimitives.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Atomic operations, a monotonic clock, a sequence lock, a
+//                ring of published values and a condition variable shared
+//                by the EVA_NDE_Grbl hub and its peripherals
+// LICENSE:       LGPL
+//
+
+#ifndef _GRBL_PRIMITIVES_H_
+#define _GRBL_PRIMITIVES_H_
+
+#ifdef WIN32
+   #ifndef WIN32_LEAN_AND_MEAN
+      #define WIN32_LEAN_AND_MEAN
+   #endif
+   #include <windows.h>
+#else
+   #include <time.h>
+   #include <sched.h>
+   #include <pthread.h>
+   #ifdef __linux__
+      #include <unistd.h>
+      #include <sys/syscall.h>
+   #endif
+#endif
+#include <vector>
+
+//////////////////////////////////////////////////////////////////////////////
+// Atomic operations on a 32 bit counter, all with full memory barriers
+//
+inline long GrblAtomicLoad(volatile long* p)
+{
+#ifdef WIN32
+   return InterlockedCompareExchange(p, 0, 0);
+#else
+   return __sync_fetch_and_add(p, 0);
+#endif
+}
+
+inline void GrblAtomicStore(volatile long* p, long value)
+{
+#ifdef WIN32
+   InterlockedExchange(p, value);
+#else
+   // __sync_lock_test_and_set is only an acquire barrier, the first
+   // __sync_synchronize keeps earlier stores from moving past the exchange
+   __sync_synchronize();
+   __sync_lock_test_and_set(p, value);
+   __sync_synchronize();
+#endif
+}
+
+// returns the incremented value
+inline long GrblAtomicIncrement(volatile long* p)
+{
+#ifdef WIN32
+   return InterlockedIncrement(p);
+#else
+   return __sync_add_and_fetch(p, 1);
+#endif
+}
+
+// returns the decremented value
+inline long GrblAtomicDecrement(volatile long* p)
+{
+#ifdef WIN32
+   return InterlockedDecrement(p);
+#else
+   return __sync_sub_and_fetch(p, 1);
+#endif
+}
+
+// returns the sum
+inline long GrblAtomicAdd(volatile long* p, long value)
+{
+#ifdef WIN32
+   return InterlockedExchangeAdd(p, value) + value;
+#else
+   return __sync_add_and_fetch(p, value);
+#endif
+}
+
+// returns true if *p was equal to expected and has been replaced by desired
+inline bool GrblAtomicCompareExchange(volatile long* p, long expected, long desired)
+{
+#ifdef WIN32
+   return InterlockedCompareExchange(p, desired, expected) == expected;
+#else
+   return __sync_bool_compare_and_swap(p, expected, desired);
+#endif
+}
+
+// Atomic operations on pointers, for lock-free lists
+template <class T>
+inline T* GrblAtomicLoadPointer(T* volatile* p)
+{
+#ifdef WIN32
+   return (T*) InterlockedCompareExchangePointer((PVOID volatile*) p, 0, 0);
+#else
+   return __sync_val_compare_and_swap(p, (T*) 0, (T*) 0);
+#endif
+}
+
+// returns the previous value
+template <class T>
+inline T* GrblAtomicExchangePointer(T* volatile* p, T* value)
+{
+#ifdef WIN32
+   return (T*) InterlockedExchangePointer((PVOID volatile*) p, value);
+#else
+   // full barrier on both sides, see GrblAtomicStore
+   __sync_synchronize();
+   T* previous = __sync_lock_test_and_set(p, value);
+   __sync_synchronize();
+   return previous;
+#endif
+}
+
+inline void GrblMemoryBarrier()
+{
+#ifdef WIN32
+   MemoryBarrier();
+#else
+   __sync_synchronize();
+#endif
+}
+
+inline void GrblYield()
+{
+#ifdef WIN32
+   SwitchToThread();
+#else
+   sched_yield();
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Monotonic clock, unaffected by changes of the wall clock
+//
+inline double GrblNowMs()
+{
+#ifdef WIN32
+   LARGE_INTEGER frequency, counter;
+   QueryPerformanceFrequency(&frequency);
+   QueryPerformanceCounter(&counter);
+   return 1000.0 * (double) counter.QuadPart / (double) frequency.QuadPart;
+#else
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#endif
+}
+
+// same clock in nanoseconds, for timestamps that are stored
+inline unsigned long long GrblNowNs()
+{
+#ifdef WIN32
+   LARGE_INTEGER frequency, counter;
+   QueryPerformanceFrequency(&frequency);
+   QueryPerformanceCounter(&counter);
+   unsigned long long f = frequency.QuadPart;
+   unsigned long long c = counter.QuadPart;
+   return c / f * 1000000000ULL + c % f * 1000000000ULL / f;
+#else
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+// operating system id of the calling thread, as shown by debuggers
+inline unsigned int GrblThreadId()
+{
+#ifdef WIN32
+   return (unsigned int) GetCurrentThreadId();
+#elif defined(__linux__)
+   return (unsigned int) syscall(SYS_gettid);
+#else
+   return (unsigned int) (size_t) pthread_self();
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Sequence lock for small plain-old-data values.
+// Readers never block the writer: they copy the value and retry when the
+// sequence number shows that a write overlapped the copy. Concurrent writers
+// exclude each other by claiming the odd sequence number.
+//
+template <class T>
+class GrblSeqLock
+{
+public:
+   GrblSeqLock() : sequence_(0), value_() {}
+
+   void Write(const T& value)
+   {
+      long seq;
+      for (;;)
+      {
+         seq = GrblAtomicLoad(&sequence_);
+         if (!(seq & 1) && GrblAtomicCompareExchange(&sequence_, seq, seq + 1))
+            break;
+         GrblYield();
+      }
+      value_ = value;
+      GrblAtomicStore(&sequence_, seq + 2);
+   }
+
+   // returns the sequence number of the copied value, 0 if never written
+   long Read(T& value) const
+   {
+      for (;;)
+      {
+         long before = GrblAtomicLoad(&sequence_);
+         if (before & 1)
+         {
+            GrblYield();
+            continue;
+         }
+         value = value_;
+         GrblMemoryBarrier();
+         if (GrblAtomicLoad(&sequence_) == before)
+            return before;
+      }
+   }
+
+   long Sequence() const {return GrblAtomicLoad(&sequence_);}
+
+private:
+   mutable volatile long sequence_;
+   T value_;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Ring of the most recent plain-old-data values, allocated up front; the
+// oldest are overwritten. Values are numbered by a running index. Each slot
+// holds index + 1 of its value once published and 0 while it is written, so
+// readers never block writers: a value overwritten while it is copied is
+// skipped.
+//
+template <class T>
+class GrblPublishedRing
+{
+public:
+   // capacity is rounded up to a power of two
+   explicit GrblPublishedRing(unsigned long capacity) : next_(0)
+   {
+      unsigned long size = 1;
+      while (size < capacity)
+         size <<= 1;
+      mask_ = size - 1;
+      values_ = new T[size]();
+      published_ = new long[size];
+      for (unsigned long i = 0; i < size; ++i)
+         published_[i] = 0;
+   }
+
+   ~GrblPublishedRing()
+   {
+      delete[] values_;
+      delete[] published_;
+   }
+
+   unsigned long GetCapacity() const {return mask_ + 1;}
+
+   // from one writer thread: publishes value under the next index before
+   // readers can see that index
+   void Push(const T& value)
+   {
+      long index = GrblAtomicLoad(&next_);
+      Begin(index) = value;
+      Publish(index);
+      GrblAtomicStore(&next_, index + 1);
+   }
+
+   // from any thread: claims count consecutive indexes and returns the
+   // first; each is filled between Begin and Publish
+   long Claim(long count) {return GrblAtomicAdd(&next_, count) - count;}
+   T& Begin(long index)
+   {
+      unsigned long slot = (unsigned long) index & mask_;
+      GrblAtomicStore(&published_[slot], 0);
+      return values_[slot];
+   }
+   void Publish(long index) {GrblAtomicStore(&published_[(unsigned long) index & mask_], index + 1);}
+
+   // indexes that may still be read: from GetFirst(next) up to next
+   long GetNext() const {return GrblAtomicLoad(const_cast<volatile long*>(&next_));}
+   long GetFirst(long next) const
+   {
+      long capacity = (long) mask_ + 1;
+      return next > capacity ? next - capacity : 0;
+   }
+
+   // copies the value with the given index; false if it has been
+   // overwritten or is being written
+   bool Read(long index, T& value) const
+   {
+      unsigned long slot = (unsigned long) index & mask_;
+      if (GrblAtomicLoad(&published_[slot]) != index + 1)
+         return false;
+      value = values_[slot];
+      GrblMemoryBarrier();
+      return GrblAtomicLoad(&published_[slot]) == index + 1;
+   }
+
+   // copies all values that can be read, oldest first
+   void Copy(std::vector<T>& values) const
+   {
+      long next = GetNext();
+      long first = GetFirst(next);
+      values.clear();
+      values.reserve(next - first);
+      for (long i = first; i < next; ++i)
+      {
+         T value;
+         if (Read(i, value))
+            values.push_back(value);
+      }
+   }
+
+private:
+   GrblPublishedRing(const GrblPublishedRing&);
+   GrblPublishedRing& operator=(const GrblPublishedRing&);
+
+   T* values_;
+   volatile long* published_;
+   unsigned long mask_;
+   volatile long next_;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Mutex with a condition variable, for threads that wait for an event of the
+// hub instead of polling for it. Waits may end early, so callers check their
+// condition in a loop.
+//
+class GrblCondition
+{
+public:
+   GrblCondition()
+   {
+#ifdef WIN32
+      InitializeCriticalSection(&mutex_);
+      InitializeConditionVariable(&condition_);
+#else
+      pthread_mutex_init(&mutex_, 0);
+      pthread_condattr_t attr;
+      pthread_condattr_init(&attr);
+   #ifdef __linux__
+      // the same clock as GrblNowMs
+      pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+   #endif
+      pthread_cond_init(&condition_, &attr);
+      pthread_condattr_destroy(&attr);
+#endif
+   }
+
+   ~GrblCondition()
+   {
+#ifdef WIN32
+      DeleteCriticalSection(&mutex_);
+#else
+      pthread_cond_destroy(&condition_);
+      pthread_mutex_destroy(&mutex_);
+#endif
+   }
+
+   void Lock()
+   {
+#ifdef WIN32
+      EnterCriticalSection(&mutex_);
+#else
+      pthread_mutex_lock(&mutex_);
+#endif
+   }
+
+   void Unlock()
+   {
+#ifdef WIN32
+      LeaveCriticalSection(&mutex_);
+#else
+      pthread_mutex_unlock(&mutex_);
+#endif
+   }
+
+   // with the lock held; returns false once GrblNowMs() has reached deadlineMs
+   bool WaitUntil(double deadlineMs)
+   {
+      double remainingMs = deadlineMs - GrblNowMs();
+      if (remainingMs <= 0.0)
+         return false;
+#ifdef WIN32
+      SleepConditionVariableCS(&condition_, &mutex_, (DWORD) remainingMs + 1);
+#else
+      struct timespec ts;
+   #ifdef __linux__
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+   #else
+      clock_gettime(CLOCK_REALTIME, &ts);
+   #endif
+      long long ns = ts.tv_nsec + (long long) (remainingMs * 1000000.0);
+      ts.tv_sec += (time_t) (ns / 1000000000LL);
+      ts.tv_nsec = (long) (ns % 1000000000LL);
+      pthread_cond_timedwait(&condition_, &mutex_, &ts);
+#endif
+      return true;
+   }
+
+   void NotifyAll()
+   {
+#ifdef WIN32
+      WakeAllConditionVariable(&condition_);
+#else
+      pthread_cond_broadcast(&condition_);
+#endif
+   }
+
+private:
+   GrblCondition(const GrblCondition&);
+   GrblCondition& operator=(const GrblCondition&);
+
+#ifdef WIN32
+   CRITICAL_SECTION mutex_;
+   CONDITION_VARIABLE condition_;
+#else
+   pthread_mutex_t mutex_;
+   pthread_cond_t condition_;
+#endif
+};
+
+#endif //_GRBL_PRIMITIVES_H_
@@ -0,0 +1,379 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblProtocol.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Parsers and encoders for the EvaGrbl serial protocol
+// LICENSE:       LGPL
+//
+
+#include "GrblProtocol.h"
+#include <cstdio>
+#include <cmath>
+
+namespace {
+
+const double g_powersOf10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+const int g_maxFractionDigits = 9;
+
+// expects the literal text at p and advances past it
+bool Expect(const char*& p, const char* end, const char* text)
+{
+   for (; *text != 0; ++p, ++text)
+   {
+      if (p == end || *p != *text)
+         return false;
+   }
+   return true;
+}
+
+// parses [-]digits[.digits] as printed by the firmware and advances past it
+bool ParseDecimal(const char*& p, const char* end, double& value)
+{
+   bool negative = false;
+   if (p != end && (*p == '-' || *p == '+'))
+   {
+      negative = (*p == '-');
+      ++p;
+   }
+   double integer = 0.0;
+   int digits = 0;
+   for (; p != end && *p >= '0' && *p <= '9'; ++p, ++digits)
+      integer = integer * 10.0 + (*p - '0');
+   long fraction = 0;
+   int fractionDigits = 0;
+   if (p != end && *p == '.')
+   {
+      for (++p; p != end && *p >= '0' && *p <= '9'; ++p, ++digits)
+      {
+         // digits beyond the firmware's resolution are dropped
+         if (fractionDigits < g_maxFractionDigits)
+         {
+            fraction = fraction * 10 + (*p - '0');
+            ++fractionDigits;
+         }
+      }
+   }
+   if (digits == 0)
+      return false;
+   value = integer + fraction / g_powersOf10[fractionDigits];
+   if (negative)
+      value = -value;
+   return true;
+}
+
+// parses three comma separated coordinates
+bool ParseAxes(const char*& p, const char* end, double* axes)
+{
+   for (int i = 0; i < 3; ++i)
+   {
+      if (i > 0 && !Expect(p, end, ","))
+         return false;
+      if (!ParseDecimal(p, end, axes[i]))
+         return false;
+   }
+   return true;
+}
+
+enum LineWords {AXIS_WORD = 1, DWELL_WORD = 2, SETTING_WORD = 4};
+
+// which of the words that matter for motion tracking a G-code line holds
+int ClassifyWords(const std::string& line)
+{
+   int words = 0;
+   const char* p = line.c_str();
+   const char* end = p + line.length();
+   while (p != end)
+   {
+      char letter = *p++;
+      if (letter == '(')
+      {
+         while (p != end && *p != ')')
+            ++p;
+         if (p != end)
+            ++p;
+         continue;
+      }
+      if (letter == ';')
+         break;
+      if (letter >= 'a' && letter <= 'z')
+         letter = (char) (letter - 'a' + 'A');
+      double value;
+      if (letter < 'A' || letter > 'Z' || !ParseDecimal(p, end, value))
+         continue;
+      if (letter == 'X' || letter == 'Y' || letter == 'Z')
+         words |= AXIS_WORD;
+      else if (letter == 'G')
+      {
+         int code = (int) (value * 10.0 + 0.5);
+         if (code == 40)
+            words |= DWELL_WORD;
+         else if (code == 100 || code == 920)
+            words |= SETTING_WORD;
+      }
+   }
+   return words;
+}
+
+} // namespace
+
+bool ParseGrblStatusReport(const char* begin, const char* end, GrblStatusReport& report)
+{
+   const char* p = begin;
+   if (!Expect(p, end, "<"))
+      return false;
+
+   unsigned n = 0;
+   for (; p != end && *p != ',' && *p != '>'; ++p)
+   {
+      if (n + 1 >= sizeof(report.status))
+         return false;
+      report.status[n++] = *p;
+   }
+   report.status[n] = 0;
+   if (n == 0)
+      return false;
+
+   if (!Expect(p, end, ",MPos:") || !ParseAxes(p, end, report.MPos))
+      return false;
+   if (!Expect(p, end, ",WPos:") || !ParseAxes(p, end, report.WPos))
+      return false;
+   if (!Expect(p, end, ">"))
+      return false;
+
+   for (; p != end; ++p)
+   {
+      if (*p != '\r' && *p != '\n')
+         return false;
+   }
+   return true;
+}
+
+bool IsGrblMotionLine(const std::string& line)
+{
+   if (line.compare(0, 2, "$H") == 0)
+      return true;
+   if (line.length() > 0 && line[0] == '$')
+      return false;
+   int words = ClassifyWords(line);
+   return (words & AXIS_WORD) && !(words & (DWELL_WORD | SETTING_WORD));
+}
+
+bool IsGrblSettingLine(const std::string& line)
+{
+   if (line.length() < 3 || line[0] != '$')
+      return false;
+   std::string::size_type i = 1;
+   while (i < line.length() && line[i] >= '0' && line[i] <= '9')
+      ++i;
+   return i > 1 && i < line.length() && line[i] == '=';
+}
+
+bool IsGrblDwellLine(const std::string& line)
+{
+   return line.length() > 0 && line[0] != '$' && (ClassifyWords(line) & DWELL_WORD);
+}
+
+int ParseGrblAxisWords(const std::string& line, double values[3])
+{
+   int axes = 0;
+   const char* p = line.c_str();
+   const char* end = p + line.length();
+   while (p != end)
+   {
+      char letter = *p++;
+      if (letter == '(')
+      {
+         while (p != end && *p != ')')
+            ++p;
+         if (p != end)
+            ++p;
+         continue;
+      }
+      if (letter == ';')
+         break;
+      if (letter >= 'a' && letter <= 'z')
+         letter = (char) (letter - 'a' + 'A');
+      if (letter < 'X' || letter > 'Z')
+         continue;
+      double value;
+      if (!ParseDecimal(p, end, value))
+         continue;
+      values[letter - 'X'] = value;
+      axes |= 1 << (letter - 'X');
+   }
+   return axes;
+}
+
+double ParseGrblDwellMs(const std::string& line)
+{
+   if (!IsGrblDwellLine(line))
+      return 0.0;
+   const char* p = line.c_str();
+   const char* end = p + line.length();
+   while (p != end)
+   {
+      char letter = *p++;
+      if (letter == '(')
+      {
+         while (p != end && *p != ')')
+            ++p;
+         if (p != end)
+            ++p;
+         continue;
+      }
+      if (letter == ';')
+         break;
+      double value;
+      if ((letter == 'P' || letter == 'p') && ParseDecimal(p, end, value))
+         return value > 0.0 ? 1000.0 * value : 0.0;
+   }
+   return 0.0;
+}
+
+double GrblCommand::DefaultTimeoutMs(const std::string& text)
+{
+   if (text.compare(0, 2, "$H") == 0)
+      return 60000.0;
+   if (text.length() > 0 && (text[0] == '$' || text[0] == '?'))
+      return 5000.0;
+   return 300.0;
+}
+
+unsigned FormatGrblDecimal(long long scaled, int decimals, char* out)
+{
+   char* p = out;
+   unsigned long long magnitude = (unsigned long long) scaled;
+   if (scaled < 0)
+   {
+      *p++ = '-';
+      magnitude = 0ULL - magnitude;
+   }
+   unsigned long long unit = (unsigned long long) g_powersOf10[decimals];
+   unsigned long long integer = magnitude / unit;
+   unsigned long long fraction = magnitude % unit;
+   if (integer == 0 && fraction == 0)
+   {
+      out[0] = '0';
+      return 1;
+   }
+
+   // digits backwards into a scratch buffer, then copied in order
+   char digits[20];
+   int n = 0;
+   for (; integer > 0; integer /= 10)
+      digits[n++] = (char) ('0' + integer % 10);
+   for (; n > 0; --n)
+      *p++ = digits[n - 1];
+   if (fraction > 0)
+   {
+      int width = decimals;
+      for (; fraction % 10 == 0; fraction /= 10)
+         --width;
+      *p++ = '.';
+      for (int i = width - 1; i >= 0; --i, fraction /= 10)
+         p[i] = (char) ('0' + fraction % 10);
+      p += width;
+   }
+   return (unsigned) (p - out);
+}
+
+long GrblStepScale::ToSteps(int axis, double um) const
+{
+   return (long) floor(um * stepsPerMm[axis] / 1000.0 + 0.5);
+}
+
+unsigned GrblStepScale::EncodeAxes(long xSteps, long ySteps, char* out) const
+{
+   const long steps[2] = {xSteps, ySteps};
+   const char letters[2] = {'X', 'Y'};
+   double unit = g_powersOf10[decimals];
+   char* p = out;
+   for (int axis = 0; axis < 2; ++axis)
+   {
+      *p++ = letters[axis];
+      long long scaled = (long long) floor(steps[axis] * unit / stepsPerMm[axis] + 0.5);
+      p += FormatGrblDecimal(scaled, decimals, p);
+   }
+   return (unsigned) (p - out);
+}
+
+void GrblModalState::Invalidate()
+{
+   distance_ = DISTANCE_UNKNOWN;
+   motion_ = MOTION_UNKNOWN;
+   units_ = UNITS_UNKNOWN;
+   feed_ = -1.0;
+}
+
+void GrblModalState::Observe(const std::string& line)
+{
+   const char* p = line.c_str();
+   const char* end = p + line.length();
+   while (p != end)
+   {
+      char letter = *p++;
+      if (letter == '(')
+      {
+         while (p != end && *p != ')')
+            ++p;
+         if (p != end)
+            ++p;
+         continue;
+      }
+      if (letter == ';')
+         break;
+      if (letter >= 'a' && letter <= 'z')
+         letter = (char) (letter - 'a' + 'A');
+      if (letter < 'A' || letter > 'Z')
+         continue;
+      double value;
+      if (!ParseDecimal(p, end, value))
+         continue;
+      if (letter == 'F')
+      {
+         // a feed given in inches is not known in millimetres until the line is done
+         feed_ = value;
+         continue;
+      }
+      if (letter != 'G')
+         continue;
+      int code = (int) (value * 10.0 + 0.5);
+      switch (code)
+      {
+         case 0: motion_ = RAPID; break;
+         case 10: motion_ = LINEAR; break;
+         case 20: case 30: case 800: motion_ = MOTION_UNKNOWN; break;
+         case 200: units_ = INCHES; break;
+         case 210: units_ = MILLIMETERS; break;
+         case 900: distance_ = ABSOLUTE_DISTANCE; break;
+         case 910: distance_ = RELATIVE_DISTANCE; break;
+         default: break;
+      }
+   }
+   if (units_ != MILLIMETERS)
+      feed_ = -1.0;
+}
+
+std::string GrblModalState::Encode(Distance distance, Motion motion, const std::string& axisWords, double feedMmPerMin) const
+{
+   std::string line;
+   if (units_ != MILLIMETERS)
+      line += "G21";
+   if (distance != DISTANCE_UNKNOWN && distance != distance_)
+      line += distance == ABSOLUTE_DISTANCE ? "G90" : "G91";
+   if (motion != MOTION_UNKNOWN && motion != motion_)
+      line += motion == RAPID ? "G0" : "G1";
+   line += axisWords;
+   if (feedMmPerMin >= 0.0)
+   {
+      char buff[32];
+      sprintf(buff, "F%.3f", feedMmPerMin);
+      // compare as sent, the controller only ever sees the printed value
+      double sent = 0.0;
+      sscanf(buff + 1, "%lf", &sent);
+      if (units_ != MILLIMETERS || sent != feed_)
+         line += buff;
+   }
+   return line;
+}
@@ -0,0 +1,119 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblProtocol.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Parsers and encoders for the EvaGrbl serial protocol
+// LICENSE:       LGPL
+//
+
+#ifndef _GRBL_PROTOCOL_H_
+#define _GRBL_PROTOCOL_H_
+
+#include <string>
+
+// Contents of a status report such as
+// <Idle,MPos:0.000,0.000,0.000,WPos:0.000,0.000,0.000>
+struct GrblStatusReport
+{
+   char status[16];
+   double MPos[3];
+   double WPos[3];
+};
+
+// Parses a status report held in [begin, end) in a single pass, without
+// allocating. A trailing line terminator is accepted. Returns false, leaving
+// report in an unspecified state, if the frame is malformed or truncated.
+bool ParseGrblStatusReport(const char* begin, const char* end, GrblStatusReport& report);
+
+// True for lines that make the machine move: $H, and G-code lines with an
+// axis word unless it belongs to G4, G10 or G92, which take none.
+bool IsGrblMotionLine(const std::string& line);
+// True for a $<n>=<value> line, which changes a stored setting.
+bool IsGrblSettingLine(const std::string& line);
+// True for a G4 dwell. Grbl 0.8 drains the planner before it dwells, so the
+// 'ok' of G4 P0 means that all moves before it have finished.
+bool IsGrblDwellLine(const std::string& line);
+// Reads the X, Y and Z words of a G-code line into values[0..2]. Returns a
+// mask with bit i set for each axis word present.
+int ParseGrblAxisWords(const std::string& line, double values[3]);
+// How long a G4 line dwells in ms; Grbl 0.8 reads its P word in seconds.
+// 0 for other lines.
+double ParseGrblDwellMs(const std::string& line);
+
+// A line for the controller together with how long its reply may take.
+// The hub enforces the timeout in its own read loop.
+struct GrblCommand
+{
+   // the timeout follows from the kind of command
+   explicit GrblCommand(const std::string& text) : line(text), timeoutMs(DefaultTimeoutMs(text)) {}
+   GrblCommand(const std::string& text, double timeout) : line(text), timeoutMs(timeout) {}
+
+   bool IsHoming() const {return line.compare(0, 2, "$H") == 0;}
+   bool IsSystemCommand() const {return line.length() > 0 && line[0] == '$';}
+   bool IsMotion() const {return IsGrblMotionLine(line);}
+
+   // 60 s for homing, 5 s for $ commands and status queries, 300 ms otherwise
+   static double DefaultTimeoutMs(const std::string& text);
+
+   std::string line;
+   double timeoutMs;
+};
+
+// Writes scaled / 10^decimals with only its significant digits and no
+// terminator, e.g. 12500 with 3 decimals as "12.5", -500 as "-.5" and 0 as
+// "0". decimals is 0 to 9. Returns the number of characters written, at most
+// 21.
+unsigned FormatGrblDecimal(long long scaled, int decimals, char* out);
+
+// Converts between the integer steps of the X and Y axes and the millimetres
+// of G-code lines, from the $0/$1 steps/mm and $12 n-decimals settings.
+// A move is quantized to steps once; the line then carries the decimal
+// millimetres of that step count in as few characters as the firmware needs.
+struct GrblStepScale
+{
+   GrblStepScale() : decimals(3), version(0) {stepsPerMm[0] = stepsPerMm[1] = 1000.0;}
+
+   long ToSteps(int axis, double um) const;
+   double ToUm(int axis, long steps) const {return 1000.0 * steps / stepsPerMm[axis];}
+   // writes e.g. X12.5Y-.004 to out, at most 44 characters; returns the length
+   unsigned EncodeAxes(long xSteps, long ySteps, char* out) const;
+
+   double stepsPerMm[2];
+   int decimals;
+   long version;              // of the hub parameters this was taken from
+};
+
+// The modal words of the controller's G-code parser that the adapter relies
+// on. Lines are observed as the controller accepts them; what the state cannot
+// be sure of afterwards is unknown, so the next motion line states it again.
+class GrblModalState
+{
+public:
+   enum Distance {DISTANCE_UNKNOWN, ABSOLUTE_DISTANCE, RELATIVE_DISTANCE};   // G90, G91
+   enum Motion {MOTION_UNKNOWN, RAPID, LINEAR};                              // G0, G1
+   enum Units {UNITS_UNKNOWN, MILLIMETERS, INCHES};                          // G21, G20
+
+   GrblModalState() {Invalidate();}
+
+   // after a reset or alarm, or a line whose fate is unknown
+   void Invalidate();
+   // updates the state from the G and F words of an accepted line
+   void Observe(const std::string& line);
+   // a motion line in millimetres carrying only the modal words that differ
+   // from the current state; no feed word if feedMmPerMin is negative
+   std::string Encode(Distance distance, Motion motion, const std::string& axisWords, double feedMmPerMin = -1.0) const;
+
+   Distance GetDistance() const {return distance_;}
+   Motion GetMotion() const {return motion_;}
+   Units GetUnits() const {return units_;}
+   double GetFeed() const {return feed_;}
+
+private:
+   Distance distance_;
+   Motion motion_;
+   Units units_;
+   double feed_;                 // mm/min, negative if unknown
+};
+
+#endif //_GRBL_PROTOCOL_H_
@@ -0,0 +1,68 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblRecorder.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Binary recorder of the serial traffic of the EVA_NDE_Grbl hub
+// LICENSE:       LGPL
+//
+
+#include "GrblRecorder.h"
+#include "../../MMDevice/MMDevice.h"
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+GrblTrafficRecorder::GrblTrafficRecorder(unsigned capacity) :
+   records_(capacity)
+{
+}
+
+GrblTrafficRecorder::~GrblTrafficRecorder()
+{
+}
+
+void GrblTrafficRecorder::Record(GrblTraceRecord::Type type, const char* data, unsigned length)
+{
+   unsigned long long now = GrblNowNs();
+   unsigned int thread = GrblThreadId();
+   // claim consecutive records for all parts of the frame
+   long count = length > 0 ? (length + GRBL_TRACE_PAYLOAD - 1) / GRBL_TRACE_PAYLOAD : 1;
+   long index = records_.Claim(count);
+   for (; count > 0; --count, ++index)
+   {
+      unsigned chunk = length < GRBL_TRACE_PAYLOAD ? length : GRBL_TRACE_PAYLOAD;
+      GrblTraceRecord& r = records_.Begin(index);
+      r.timestampNs = now;
+      r.index = (unsigned int) index;
+      r.thread = thread;
+      r.type = (unsigned char) type;
+      r.flags = chunk < length ? GrblTraceRecord::CONTINUED : 0;
+      r.length = (unsigned short) chunk;
+      if (chunk > 0)
+         memcpy(r.data, data, chunk);
+      records_.Publish(index);
+      data += chunk;
+      length -= chunk;
+   }
+}
+
+int GrblTrafficRecorder::Dump(const std::string& path) const
+{
+   // copy first, so that recording goes on while the file is written
+   std::vector<GrblTraceRecord> copy;
+   records_.Copy(copy);
+
+   FILE* fp = fopen(path.c_str(), "wb");
+   if (!fp)
+      return DEVICE_ERR;
+   GrblTraceHeader header;
+   memcpy(header.magic, GRBL_TRACE_MAGIC, sizeof(header.magic));
+   header.recordSize = sizeof(GrblTraceRecord);
+   header.recordCount = (unsigned int) copy.size();
+   bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+   if (ok && !copy.empty())
+      ok = fwrite(&copy[0], sizeof(GrblTraceRecord), copy.size(), fp) == copy.size();
+   ok = fclose(fp) == 0 && ok;
+   return ok ? DEVICE_OK : DEVICE_ERR;
+}
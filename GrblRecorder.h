@@ -0,0 +1,68 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblRecorder.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Binary recorder of the serial traffic of the EVA_NDE_Grbl hub
+// LICENSE:       LGPL
+//
+
+#ifndef _GRBL_RECORDER_H_
+#define _GRBL_RECORDER_H_
+
+#include "GrblPrimitives.h"
+#include <string>
+
+#define GRBL_TRACE_MAGIC "GRBLTRC1"
+#define GRBL_TRACE_PAYLOAD 44
+
+// One record of a trace file, 64 bytes in host byte order.
+// Frames longer than the payload are split over consecutive records of the
+// same thread, all but the last one flagged CONTINUED. A dump may start in
+// the middle of a frame.
+struct GrblTraceRecord
+{
+   enum Type {TX, RX, PURGE, TIMEOUT};
+   enum Flags {CONTINUED = 1};
+
+   unsigned long long timestampNs;  // GrblNowNs() when the frame was recorded
+   unsigned int index;              // running record number, gaps mean lost records
+   unsigned int thread;             // GrblThreadId() of the caller
+   unsigned char type;
+   unsigned char flags;
+   unsigned short length;           // used bytes of data
+   char data[GRBL_TRACE_PAYLOAD];
+};
+
+// A trace file starts with this header, followed by recordCount records
+// from oldest to newest.
+struct GrblTraceHeader
+{
+   char magic[8];                   // GRBL_TRACE_MAGIC without terminator
+   unsigned int recordSize;         // sizeof(GrblTraceRecord)
+   unsigned int recordCount;
+};
+
+// Keeps the most recent frames written to and read from the controller in a
+// ring allocated up front. Any thread may record without taking a lock; a
+// record being overwritten while the ring is dumped is left out of the dump.
+class GrblTrafficRecorder
+{
+public:
+   // capacity is rounded up to a power of two
+   explicit GrblTrafficRecorder(unsigned capacity = 4096);
+   ~GrblTrafficRecorder();
+
+   void Record(GrblTraceRecord::Type type, const char* data, unsigned length);
+   void Record(GrblTraceRecord::Type type) {Record(type, 0, 0);}
+   // writes the ring to a new trace file
+   int Dump(const std::string& path) const;
+
+private:
+   GrblTrafficRecorder(const GrblTrafficRecorder&);
+   GrblTrafficRecorder& operator=(const GrblTrafficRecorder&);
+
+   GrblPublishedRing<GrblTraceRecord> records_;
+};
+
+#endif //_GRBL_RECORDER_H_
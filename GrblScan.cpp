@@ -0,0 +1,246 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblScan.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   G-code generators for position lists, tile and fly scans, fed to
+//                CEVA_NDE_GrblHub::StreamCommands one line at a time
+// LICENSE:       LGPL
+//
+
+#include "GrblScan.h"
+#include <cstdio>
+#include <cmath>
+
+#ifdef WIN32
+   #define snprintf _snprintf 
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// GrblStopScanSource implementation
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+// lines 1 and 2 are G90 and M108P<SyncStep>Q0, then each stop takes
+// linesPerStop_ lines:
+//    G00X..Y..   G4P0   [G4P<dwell>]
+
+GrblStopScanSource::GrblStopScanSource(double syncStep, double dwellMs) :
+   syncStep_(syncStep),
+   dwellMs_(dwellMs),
+   linesPerStop_(dwellMs > 0.0 ? 3 : 2),
+   nextStop_(0),
+   nextLine_(-2)
+{
+}
+
+bool GrblStopScanSource::NextLine(std::string& line)
+{
+   if (IsCancelled())
+      return false;
+   char buff[64];
+   if (nextLine_ == -2)
+   {
+      line = "G90";
+      nextLine_ = -1;
+      return true;
+   }
+   if (nextLine_ == -1)
+   {
+      // the sync output pulses by distance travelled, so it is set up once
+      // for the whole scan rather than at every stop
+      snprintf(buff, sizeof(buff), "M108P%.3fQ%d", syncStep_, 0);
+      line = buff;
+      nextLine_ = 0;
+      return true;
+   }
+   if (nextStop_ >= GetStepCount())
+      return false;
+
+   switch (nextLine_)
+   {
+      case 0:
+      {
+         double x, y;
+         GetStop(nextStop_, x, y);
+         snprintf(buff, sizeof(buff), "G00X%.4fY%.4f", x / 1000.0, y / 1000.0);
+         break;
+      }
+      case 1:
+         snprintf(buff, sizeof(buff), "G4P0");
+         break;
+      default:
+         snprintf(buff, sizeof(buff), "G4P%.3f", dwellMs_ / 1000.0);
+         break;
+   }
+   line = buff;
+   if (++nextLine_ == linesPerStop_)
+   {
+      nextLine_ = 0;
+      ++nextStop_;
+   }
+   return true;
+}
+
+void GrblStopScanSource::LineAcknowledged(unsigned long lineNumber)
+{
+   if (lineNumber < 3)
+      return;
+   unsigned long offset = lineNumber - 3;
+   if (offset % linesPerStop_ == 1)
+      SetCurrentStep((long) (offset / linesPerStop_));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GrblPositionListSource implementation
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+
+void GrblPositionListSource::GetStop(long index, double& xUm, double& yUm) const
+{
+   xUm = positionsUm_[index].first;
+   yUm = positionsUm_[index].second;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GrblTileScanSource implementation
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+
+GrblTileScanSource::GrblTileScanSource(double originXUm, double originYUm, double tileWidthUm, double tileHeightUm,
+   double overlap, long rows, long columns, double syncStep, double dwellMs) :
+   GrblStopScanSource(syncStep, dwellMs),
+   originXUm_(originXUm),
+   originYUm_(originYUm),
+   stepXUm_(tileWidthUm * (1.0 - overlap)),
+   stepYUm_(tileHeightUm * (1.0 - overlap)),
+   rows_(rows),
+   columns_(columns)
+{
+}
+
+void GrblTileScanSource::GetStop(long index, double& xUm, double& yUm) const
+{
+   long row = index / columns_;
+   long column = index % columns_;
+   if (row % 2 == 1)
+      column = columns_ - 1 - column;
+   xUm = originXUm_ + column * stepXUm_;
+   yUm = originYUm_ + row * stepYUm_;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GrblFlyScanSource implementation
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+// line 1 is G90, then each row takes LINES_PER_ROW lines:
+//    G00X<ramp start>Y..   G4P0   M108P<pitch>Q0   G01X<ramp end>F..   G4P0
+// and a final M108P<SyncStep>Q0 restores the sync setting.
+
+GrblFlyScanSource::GrblFlyScanSource(double originXUm, double originYUm, double rowLengthUm, long rows, double rowPitchUm,
+   double framePitchUm, double framePeriodMs, double accelerationMmPerS2, double syncStep) :
+   originXUm_(originXUm),
+   originYUm_(originYUm),
+   rowLengthUm_(rowLengthUm),
+   rows_(rows),
+   rowPitchUm_(rowPitchUm),
+   framePitchUm_(framePitchUm),
+   syncStep_(syncStep),
+   nextRow_(0),
+   nextLine_(-1)
+{
+   double speedMmPerS = framePitchUm / framePeriodMs; // um/ms
+   feedMmPerMin_ = 60.0 * speedMmPerS;
+   // distance to reach the speed, with some margin, in whole frame pitches
+   double rampUm = 1.25 * 1000.0 * speedMmPerS * speedMmPerS / (2.0 * accelerationMmPerS2);
+   rampUm_ = ceil(rampUm / framePitchUm) * framePitchUm;
+}
+
+void GrblFlyScanSource::GetRowEnds(long row, double& startXUm, double& endXUm, double& yUm) const
+{
+   double left = originXUm_ - rampUm_;
+   double right = originXUm_ + rowLengthUm_ + rampUm_;
+   bool forward = row % 2 == 0;
+   startXUm = forward ? left : right;
+   endXUm = forward ? right : left;
+   yUm = originYUm_ + row * rowPitchUm_;
+}
+
+bool GrblFlyScanSource::NextLine(std::string& line)
+{
+   if (IsCancelled())
+      return false;
+   if (nextLine_ < 0)
+   {
+      line = "G90";
+      nextLine_ = 0;
+      return true;
+   }
+   char buff[64];
+   if (nextRow_ >= rows_)
+   {
+      if (nextRow_ > rows_)
+         return false;
+      snprintf(buff, sizeof(buff), "M108P%.3fQ%d", syncStep_, 0);
+      line = buff;
+      ++nextRow_;
+      return true;
+   }
+
+   double startXUm, endXUm, yUm;
+   GetRowEnds(nextRow_, startXUm, endXUm, yUm);
+   switch (nextLine_)
+   {
+      case 0:
+         snprintf(buff, sizeof(buff), "G00X%.4fY%.4f", startXUm / 1000.0, yUm / 1000.0);
+         break;
+      case 1:
+      case 4:
+         snprintf(buff, sizeof(buff), "G4P0");
+         break;
+      case 2:
+         snprintf(buff, sizeof(buff), "M108P%.4fQ%d", framePitchUm_ / 1000.0, 0);
+         break;
+      default:
+         snprintf(buff, sizeof(buff), "G01X%.4fF%.3f", endXUm / 1000.0, feedMmPerMin_);
+         break;
+   }
+   line = buff;
+   if (++nextLine_ == LINES_PER_ROW)
+   {
+      nextLine_ = 0;
+      ++nextRow_;
+   }
+   return true;
+}
+
+// a row is done when the G4 P0 after its move has been answered
+void GrblFlyScanSource::LineAcknowledged(unsigned long lineNumber)
+{
+   if (lineNumber < 2)
+      return;
+   unsigned long offset = lineNumber - 2;
+   if (offset / LINES_PER_ROW < (unsigned long) rows_ && offset % LINES_PER_ROW == LINES_PER_ROW - 1)
+      SetCurrentStep((long) (offset / LINES_PER_ROW));
+}
+
+void GrblFlyScanSource::GetTriggers(std::vector<GrblFlyScanTrigger>& triggers) const
+{
+   triggers.clear();
+   long pulses = (long) floor((rowLengthUm_ + 2.0 * rampUm_) / framePitchUm_ + 1e-9);
+   for (long row = 0; row < rows_; ++row)
+   {
+      double startXUm, endXUm, yUm;
+      GetRowEnds(row, startXUm, endXUm, yUm);
+      double direction = endXUm > startXUm ? 1.0 : -1.0;
+      for (long k = 1; k <= pulses; ++k)
+      {
+         GrblFlyScanTrigger t;
+         t.row = row;
+         t.xUm = startXUm + direction * k * framePitchUm_;
+         t.yUm = yUm;
+         double fromOrigin = t.xUm - originXUm_;
+         t.inRegion = fromOrigin > -1e-6 && fromOrigin < rowLengthUm_ + 1e-6;
+         triggers.push_back(t);
+      }
+   }
+}
@@ -0,0 +1,153 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblScan.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   G-code generators for position lists, tile and fly scans, fed to
+//                CEVA_NDE_GrblHub::StreamCommands one line at a time
+// LICENSE:       LGPL
+//
+
+#ifndef _GRBL_SCAN_H_
+#define _GRBL_SCAN_H_
+
+#include "EVA_NDE_Grbl.h"
+#include <string>
+#include <vector>
+
+// A scan made of a known number of steps, stops or rows, that can be
+// abandoned and reports how far the controller has got
+class GrblScanSource : public GrblLineSource
+{
+public:
+   GrblScanSource() : cancel_(false), currentStep_(-1) {}
+
+   // hands out no further lines, the ones already sent still run
+   void Cancel() {cancel_ = true;}
+   virtual long GetStepCount() const = 0;
+   // index of the last step completed, -1 before the first
+   long GetCurrentStep() const {return GrblAtomicLoad(&currentStep_);}
+
+protected:
+   bool IsCancelled() const {return cancel_;}
+   void SetCurrentStep(long step) {GrblAtomicStore(&currentStep_, step);}
+
+private:
+   volatile bool cancel_;
+   mutable volatile long currentStep_;
+};
+
+// Visits a number of stops in absolute coordinates. The M108 sync output is
+// set up once at the start; at each stop the planner is drained with G4 P0
+// and the stage dwells before moving on. Lines are generated on demand, so
+// memory does not grow with the number of stops. The acknowledgement of each
+// G4 P0 marks the arrival at its stop.
+class GrblStopScanSource : public GrblScanSource
+{
+public:
+   GrblStopScanSource(double syncStep, double dwellMs);
+
+   bool NextLine(std::string& line);
+   void LineAcknowledged(unsigned long lineNumber);
+
+protected:
+   virtual void GetStop(long index, double& xUm, double& yUm) const = 0;
+
+private:
+   double syncStep_;
+   double dwellMs_;
+   int linesPerStop_;
+   long nextStop_;
+   int nextLine_;                // of the stop, -2 and -1 for the preamble
+};
+
+// Stops at each position of a list, in order
+class GrblPositionListSource : public GrblStopScanSource
+{
+public:
+   GrblPositionListSource(const std::vector<std::pair<double, double> >& positionsUm, double syncStep, double dwellMs) :
+      GrblStopScanSource(syncStep, dwellMs), positionsUm_(positionsUm) {}
+
+   long GetStepCount() const {return (long) positionsUm_.size();}
+
+protected:
+   void GetStop(long index, double& xUm, double& yUm) const;
+
+private:
+   std::vector<std::pair<double, double> > positionsUm_;
+};
+
+// Stops at the tiles of a rows x columns grid in serpentine order: even rows
+// left to right, odd rows right to left. Neighbouring tiles overlap by the
+// given fraction of the tile size.
+class GrblTileScanSource : public GrblStopScanSource
+{
+public:
+   GrblTileScanSource(double originXUm, double originYUm, double tileWidthUm, double tileHeightUm,
+      double overlap, long rows, long columns, double syncStep, double dwellMs);
+
+   long GetStepCount() const {return rows_ * columns_;}
+
+protected:
+   void GetStop(long index, double& xUm, double& yUm) const;
+
+private:
+   double originXUm_;
+   double originYUm_;
+   double stepXUm_;
+   double stepYUm_;
+   long rows_;
+   long columns_;
+};
+
+// Where a sync pulse of a fly scan is expected, in um
+struct GrblFlyScanTrigger
+{
+   long row;
+   double xUm;
+   double yUm;
+   bool inRegion;     // false for pulses on the ramps
+};
+
+// Moves along each row of a region at the constant speed that covers one
+// frame pitch per frame period, serpentine like the tile scan. Each row is
+// a single G1 that starts and ends on a ramp outside the region, long enough
+// for the $8 acceleration and a whole number of frame pitches, so the speed
+// is constant over the region. The sync output is armed with M108 at the
+// start of each row, after G4 P0 has brought the stage to rest there, and
+// pulses every frame pitch from then on; afterwards the SyncStep setting is
+// restored. GetTriggers lists where the pulses fall.
+class GrblFlyScanSource : public GrblScanSource
+{
+public:
+   GrblFlyScanSource(double originXUm, double originYUm, double rowLengthUm, long rows, double rowPitchUm,
+      double framePitchUm, double framePeriodMs, double accelerationMmPerS2, double syncStep);
+
+   bool NextLine(std::string& line);
+   void LineAcknowledged(unsigned long lineNumber);
+   long GetStepCount() const {return rows_;}
+
+   double GetFeedMmPerMin() const {return feedMmPerMin_;}
+   double GetRampUm() const {return rampUm_;}
+   void GetTriggers(std::vector<GrblFlyScanTrigger>& triggers) const;
+
+private:
+   enum {LINES_PER_ROW = 5};
+
+   // start and end of the row's move, including the ramps
+   void GetRowEnds(long row, double& startXUm, double& endXUm, double& yUm) const;
+
+   double originXUm_;
+   double originYUm_;
+   double rowLengthUm_;
+   long rows_;
+   double rowPitchUm_;
+   double framePitchUm_;
+   double feedMmPerMin_;
+   double rampUm_;
+   double syncStep_;
+   long nextRow_;
+   int nextLine_;                // of the row, -1 for the G90 preamble
+};
+
+#endif //_GRBL_SCAN_H_
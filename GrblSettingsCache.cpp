@@ -0,0 +1,160 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblSettingsCache.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   On-disk cache of the $$ settings of an EvaGrbl controller
+// LICENSE:       LGPL
+//
+// The file is plain text:
+//    port=COM3
+//    banner=Grbl 0.8c ['$' for help]
+//    $0=250.000000
+//    ...
+//    checksum=<FNV-1a of all lines above>
+//
+// The baud rate goes into a file next to it with the extension .baud:
+//    port=COM3
+//    baud=115200
+//
+
+#include "GrblSettingsCache.h"
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+
+#ifdef WIN32
+   #define snprintf _snprintf 
+#endif
+
+GrblSettingsCache::GrblSettingsCache(const std::string& directory, const std::string& port) :
+   port_(port)
+{
+   std::string name("EVA_NDE_Grbl-");
+   for (std::string::const_iterator it = port.begin(); it != port.end(); ++it)
+   {
+      char c = *it;
+      bool keep = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+      name += keep ? c : '_';
+   }
+   if (directory.empty())
+      path_ = name;
+   else if (directory[directory.length() - 1] == '/' || directory[directory.length() - 1] == '\\')
+      path_ = directory + name;
+   else
+      path_ = directory + "/" + name;
+   baudPath_ = path_ + ".baud";
+   path_ += ".settings";
+}
+
+bool GrblSettingsCache::Load(std::string& banner, std::vector<double>& parameters) const
+{
+   std::ifstream in(path_.c_str());
+   if (!in)
+      return false;
+
+   std::string text;
+   std::string line;
+   std::string fileBanner;
+   std::vector<double> values;
+   unsigned long checksum = 0;
+   bool haveChecksum = false;
+   while (std::getline(in, line))
+   {
+      if (line.compare(0, 9, "checksum=") == 0)
+      {
+         checksum = strtoul(line.c_str() + 9, 0, 10);
+         haveChecksum = true;
+         break;
+      }
+      text += line + "\n";
+      if (line.compare(0, 7, "banner=") == 0)
+         fileBanner = line.substr(7);
+      else if (line.length() > 1 && line[0] == '$')
+      {
+         std::string::size_type eq = line.find('=');
+         if (eq == std::string::npos || atoi(line.c_str() + 1) != (int) values.size())
+            return false;
+         values.push_back(strtod(line.c_str() + eq + 1, 0));
+      }
+   }
+   if (!haveChecksum || checksum != Checksum(text))
+      return false;
+   // the values must also be the ones this adapter would have written
+   if (text != Format(port_, fileBanner, values))
+      return false;
+
+   banner = fileBanner;
+   parameters = values;
+   return true;
+}
+
+bool GrblSettingsCache::Save(const std::string& banner, const std::vector<double>& parameters) const
+{
+   std::ofstream out(path_.c_str(), std::ios::out | std::ios::trunc);
+   if (!out)
+      return false;
+   std::string text = Format(port_, banner, parameters);
+   out << text << "checksum=" << Checksum(text) << "\n";
+   return out.good();
+}
+
+void GrblSettingsCache::Remove() const
+{
+   remove(path_.c_str());
+}
+
+bool GrblSettingsCache::LoadBaudRate(long& baud) const
+{
+   std::ifstream in(baudPath_.c_str());
+   if (!in)
+      return false;
+   std::string line;
+   bool portMatches = false;
+   while (std::getline(in, line))
+   {
+      if (line.compare(0, 5, "port=") == 0)
+         portMatches = line.substr(5) == port_;
+      else if (line.compare(0, 5, "baud=") == 0 && portMatches)
+      {
+         baud = atol(line.c_str() + 5);
+         return baud > 0;
+      }
+   }
+   return false;
+}
+
+bool GrblSettingsCache::SaveBaudRate(long baud) const
+{
+   std::ofstream out(baudPath_.c_str(), std::ios::out | std::ios::trunc);
+   if (!out)
+      return false;
+   out << "port=" << port_ << "\n" << "baud=" << baud << "\n";
+   return out.good();
+}
+
+unsigned long GrblSettingsCache::Checksum(const std::string& text)
+{
+   unsigned long hash = 2166136261UL;
+   for (std::string::const_iterator it = text.begin(); it != text.end(); ++it)
+   {
+      hash ^= (unsigned char) *it;
+      hash = (hash * 16777619UL) & 0xFFFFFFFFUL;
+   }
+   return hash;
+}
+
+std::string GrblSettingsCache::Format(const std::string& port, const std::string& banner, const std::vector<double>& parameters)
+{
+   std::ostringstream os;
+   os << "port=" << port << "\n";
+   os << "banner=" << banner << "\n";
+   for (size_t i = 0; i < parameters.size(); ++i)
+   {
+      char buff[64];
+      snprintf(buff, sizeof(buff), "$%d=%.6f\n", (int) i, parameters[i]);
+      os << buff;
+   }
+   return os.str();
+}
@@ -0,0 +1,48 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblSettingsCache.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   On-disk cache of the $$ settings of an EvaGrbl controller,
+//                so they need not be dumped over the serial line every time
+// LICENSE:       LGPL
+//
+
+#ifndef _GRBL_SETTINGS_CACHE_H_
+#define _GRBL_SETTINGS_CACHE_H_
+
+#include <string>
+#include <vector>
+
+class GrblSettingsCache
+{
+public:
+   // the cache file for a controller lives in directory, or the working
+   // directory if empty; port is GrblPortScanner::GetDeviceId of its port,
+   // so that the file stays with a USB controller that moves to another port
+   GrblSettingsCache(const std::string& directory, const std::string& port);
+
+   // returns false if there is no cache file or its checksum does not match
+   bool Load(std::string& banner, std::vector<double>& parameters) const;
+   bool Save(const std::string& banner, const std::vector<double>& parameters) const;
+   void Remove() const;
+
+   // the baud rate the controller last answered at, kept in a file of its
+   // own so that it survives invalidating the settings
+   bool LoadBaudRate(long& baud) const;
+   bool SaveBaudRate(long baud) const;
+
+   const std::string& GetPath() const {return path_;}
+
+   // FNV-1a hash of the cached text, used to detect stale or damaged files
+   static unsigned long Checksum(const std::string& text);
+
+private:
+   static std::string Format(const std::string& port, const std::string& banner, const std::vector<double>& parameters);
+
+   std::string port_;
+   std::string path_;
+   std::string baudPath_;
+};
+
+#endif //_GRBL_SETTINGS_CACHE_H_
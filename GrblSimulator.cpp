@@ -0,0 +1,604 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblSimulator.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Simulated EvaGrbl controller behind a pseudo-terminal
+// LICENSE:       LGPL
+//
+
+#include "GrblSimulator.h"
+#include "GrblPrimitives.h"
+#include "../../MMDevice/MMDevice.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+
+#ifndef WIN32
+   #include <errno.h>
+   #include <fcntl.h>
+   #include <poll.h>
+   #include <termios.h>
+   #include <unistd.h>
+#endif
+
+namespace {
+
+const unsigned g_rxBufferSize = 127;   // RX_BUFFER_SIZE of the firmware
+const unsigned g_plannerSize = 18;     // BLOCK_BUFFER_SIZE of the firmware
+const unsigned g_txBufferSize = 64;    // TX_BUFFER_SIZE of the firmware
+const char* g_banner = "\r\nGrbl 0.8c ['$' for help]\r\n";
+const char* g_unsupported = "error: Unsupported statement\r\n";
+
+struct Setting
+{
+   double value;
+   bool integer;
+   const char* description;
+};
+
+const Setting g_defaultSettings[GRBL_SIM_PARAMETERS] = {
+   {250.0, false, "x, step/mm"},
+   {250.0, false, "y, step/mm"},
+   {250.0, false, "z, step/mm"},
+   {10.0, true, "step pulse, usec"},
+   {250.0, false, "default feed, mm/min"},
+   {500.0, false, "default seek, mm/min"},
+   {192.0, true, "step port invert mask, int:11000000"},
+   {25.0, true, "step idle delay, msec"},
+   {10.0, false, "acceleration, mm/sec^2"},
+   {0.05, false, "junction deviation, mm"},
+   {0.1, false, "arc, mm/segment"},
+   {25.0, true, "n-arc correction, int"},
+   {3.0, true, "n-decimals, int"},
+   {0.0, true, "report inches, bool"},
+   {1.0, true, "auto start, bool"},
+   {0.0, true, "invert step enable, bool"},
+   {0.0, true, "hard limits, bool"},
+   {0.0, true, "homing cycle, bool"},
+   {0.0, true, "homing dir invert mask, int:00000000"},
+   {25.0, false, "homing feed, mm/min"},
+   {250.0, false, "homing seek, mm/min"},
+   {100.0, true, "homing debounce, msec"},
+   {1.0, false, "homing pull-off, mm"}
+};
+
+// G-code numbers are plain decimals, unlike what strtod accepts
+bool ReadNumber(const char*& c, double& value)
+{
+   const char* p = c;
+   double sign = 1.0;
+   if (*p == '-' || *p == '+')
+      sign = *p++ == '-' ? -1.0 : 1.0;
+   bool digits = false;
+   value = 0.0;
+   for (; isdigit(*p); ++p, digits = true)
+      value = value * 10.0 + (*p - '0');
+   if (*p == '.')
+   {
+      double scale = 0.1;
+      for (++p; isdigit(*p); ++p, scale *= 0.1, digits = true)
+         value += (*p - '0') * scale;
+   }
+   if (!digits)
+      return false;
+   value *= sign;
+   c = p;
+   return true;
+}
+
+} // namespace
+
+GrblSimulator::GrblSimulator() :
+   master_(-1),
+   stop_(false),
+   hungUp_(true),
+   baud_(9600),
+   lineLatencyMs_(1.0),
+   startupDelayMs_(0.0),
+   wireFreeAt_(0.0),
+   overflows_(0),
+   txFreeAt_(0.0),
+   bannerAt_(-1.0),
+   lineActive_(false),
+   lineReadyAt_(0.0),
+   phase_(0),
+   dwellUntil_(0.0),
+   velocity_(0.0),
+   hold_(false),
+   reportRequested_(false),
+   homing_(false),
+   absolute_(true),
+   inches_(false),
+   motionMode_(0),
+   feedMmPerMin_(0.0)
+{
+   for (int i = 0; i < 3; ++i)
+   {
+      position_[i] = 0.0;
+      planned_[i] = 0.0;
+   }
+   for (int i = 0; i < GRBL_SIM_PARAMETERS; ++i)
+      parameters_[i] = g_defaultSettings[i].value;
+}
+
+GrblSimulator::~GrblSimulator()
+{
+   Stop();
+}
+
+#ifdef WIN32
+
+int GrblSimulator::Start()
+{
+   return DEVICE_NOT_SUPPORTED;
+}
+
+void GrblSimulator::Stop()
+{
+}
+
+int GrblSimulator::svc()
+{
+   return 0;
+}
+
+#else
+
+int GrblSimulator::Start()
+{
+   master_ = posix_openpt(O_RDWR | O_NOCTTY);
+   if (master_ < 0)
+      return DEVICE_ERR;
+   if (grantpt(master_) != 0 || unlockpt(master_) != 0)
+   {
+      close(master_);
+      master_ = -1;
+      return DEVICE_ERR;
+   }
+   fcntl(master_, F_SETFL, fcntl(master_, F_GETFL) | O_NONBLOCK);
+   // pass bytes unchanged, like a serial line
+   struct termios tio;
+   tcgetattr(master_, &tio);
+   cfmakeraw(&tio);
+   tcsetattr(master_, TCSANOW, &tio);
+   devicePath_ = ptsname(master_);
+   // the master only reports hang-ups once the slave side has been closed,
+   // open and close it once so that the first real open is seen as one
+   int slave = open(devicePath_.c_str(), O_RDWR | O_NOCTTY);
+   if (slave >= 0)
+      close(slave);
+
+   Reset(GrblNowMs());
+   hungUp_ = true;
+   stop_ = false;
+   return activate();
+}
+
+void GrblSimulator::Stop()
+{
+   if (master_ < 0)
+      return;
+   stop_ = true;
+   wait();
+   close(master_);
+   master_ = -1;
+}
+
+int GrblSimulator::svc()
+{
+   double last = GrblNowMs();
+   while (!stop_)
+   {
+      struct pollfd pfd;
+      pfd.fd = master_;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      poll(&pfd, 1, 1);
+      double now = GrblNowMs();
+      bool hungUp = (pfd.revents & POLLHUP) != 0;
+      if (hungUp)
+         usleep(1000); // nobody has the tty open
+      else if (hungUp_)
+      {
+         // opening the port toggles DTR, which resets the Arduino
+         Reset(now);
+         bannerAt_ = now + startupDelayMs_;
+      }
+      hungUp_ = hungUp;
+
+      Receive(now);
+      Deliver(now);
+      ProcessLines(now);
+      Move((now - last) / 1000.0);
+      last = now;
+      if (bannerAt_ >= 0.0 && now >= bannerAt_)
+      {
+         Send(g_banner);
+         bannerAt_ = -1.0;
+      }
+      // the pty would keep output written while nobody has the tty open
+      // and hand it to the next process that opens it
+      if (hungUp_)
+         txPending_.clear();
+      Report();
+      Transmit(now);
+   }
+   return 0;
+}
+
+// bytes written by the host enter the wire and arrive one character time apart
+void GrblSimulator::Receive(double now)
+{
+   double byteMs = 10000.0 / baud_;
+   char buff[256];
+   for (;;)
+   {
+      ssize_t n = read(master_, buff, sizeof(buff));
+      if (n <= 0)
+         return;
+      for (ssize_t i = 0; i < n; ++i)
+      {
+         wireFreeAt_ = (wireFreeAt_ > now ? wireFreeAt_ : now) + byteMs;
+         wire_.push_back(std::make_pair(wireFreeAt_, buff[i]));
+      }
+   }
+}
+
+void GrblSimulator::Transmit(double now)
+{
+   if (txPending_.empty())
+   {
+      // the line is idle, the next character starts no earlier than now
+      if (txFreeAt_ < now)
+         txFreeAt_ = now;
+      return;
+   }
+   double byteMs = 10000.0 / baud_;
+   if (txFreeAt_ > now)
+      return; // the previous character is still on the wire
+   // characters whose start bit falls before now
+   size_t due = (size_t) ((now - txFreeAt_) / byteMs) + 1;
+   if (due > txPending_.size())
+      due = txPending_.size();
+   ssize_t n = write(master_, txPending_.data(), due);
+   if (n > 0)
+   {
+      txPending_.erase(0, n);
+      txFreeAt_ += n * byteMs;
+   }
+   else if (n < 0 && errno == EIO)
+      txPending_.clear(); // nobody listening
+}
+
+#endif
+
+// real-time characters act on arrival, everything else goes into the receive buffer
+void GrblSimulator::Deliver(double now)
+{
+   while (!wire_.empty() && wire_.front().first <= now)
+   {
+      char c = wire_.front().second;
+      wire_.pop_front();
+      if (c == '?' || c == '!' || c == '~' || c == 0x18)
+      {
+         if (c == 0x18)
+            Reset(now);
+         else
+            Realtime(c);
+      }
+      else if (rxBuffer_.length() < g_rxBufferSize)
+         rxBuffer_ += c;
+      else
+         ++overflows_; // the host sent more than fits
+   }
+}
+
+void GrblSimulator::Realtime(char c)
+{
+   if (c == '?')
+      reportRequested_ = true;
+   else if (c == '!')
+   {
+      if (!planner_.empty())
+         hold_ = true;
+   }
+   else if (c == '~')
+      hold_ = false;
+}
+
+// '?' only sets a flag, like in the firmware: requests that arrive while the
+// output buffer is too full for a report are answered by a single one
+void GrblSimulator::Report()
+{
+   if (!reportRequested_ || txPending_.length() >= g_txBufferSize)
+      return;
+   const char* names[] = {"Idle", "Queue", "Run", "Hold", "Home"};
+   char report[160];
+   snprintf(report, sizeof(report), "<%s,MPos:%.3f,%.3f,%.3f,WPos:%.3f,%.3f,%.3f>\r\n",
+      names[GetState()], position_[0], position_[1], position_[2],
+      position_[0], position_[1], position_[2]);
+   Send(report);
+   reportRequested_ = false;
+}
+
+// soft reset: motion stops where it is and all queued input and output is dropped
+void GrblSimulator::Reset(double now)
+{
+   rxBuffer_.clear();
+   txPending_.clear();
+   planner_.clear();
+   for (int i = 0; i < 3; ++i)
+      planned_[i] = position_[i];
+   velocity_ = 0.0;
+   hold_ = false;
+   reportRequested_ = false;
+   homing_ = false;
+   lineActive_ = false;
+   phase_ = 0;
+   absolute_ = true;
+   inches_ = false;
+   motionMode_ = 0;
+   feedMmPerMin_ = parameters_[4];
+   bannerAt_ = now;
+}
+
+GrblSimulator::State GrblSimulator::GetState() const
+{
+   if (homing_)
+      return HOME;
+   if (hold_)
+      return velocity_ > 0.0 ? HOLD : QUEUE;
+   if (!planner_.empty())
+      return RUN;
+   return IDLE;
+}
+
+void GrblSimulator::ProcessLines(double now)
+{
+   for (;;)
+   {
+      if (!lineActive_)
+      {
+         // like the firmware, either of \r and \n ends a line
+         std::string::size_type eol = rxBuffer_.find_first_of("\r\n");
+         if (eol == std::string::npos)
+            return;
+         line_.clear();
+         for (std::string::size_type i = 0; i < eol; ++i)
+         {
+            char c = rxBuffer_[i];
+            if (c != ' ' && c != '\t')
+               line_ += (char) toupper(c);
+         }
+         rxBuffer_.erase(0, eol + 1);
+         lineActive_ = true;
+         phase_ = 0;
+         lineReadyAt_ = now + lineLatencyMs_;
+      }
+      if (now < lineReadyAt_ || Execute(line_, now) == WAIT)
+         return;
+      lineActive_ = false;
+   }
+}
+
+GrblSimulator::Result GrblSimulator::Execute(const std::string& line, double now)
+{
+   if (line.empty())
+   {
+      Send("ok\r\n");
+      return DONE;
+   }
+   if (line[0] == '$')
+      return ExecuteSystem(line, now);
+   return ExecuteGCode(line, now);
+}
+
+GrblSimulator::Result GrblSimulator::ExecuteSystem(const std::string& line, double /*now*/)
+{
+   if (line == "$")
+   {
+      Send("$$ (view Grbl settings)\r\n$x=value (save Grbl setting)\r\n$H (run homing cycle)\r\nok\r\n");
+      return DONE;
+   }
+   if (line == "$$")
+   {
+      for (int i = 0; i < GRBL_SIM_PARAMETERS; ++i)
+      {
+         char buff[96];
+         if (g_defaultSettings[i].integer)
+            snprintf(buff, sizeof(buff), "$%d=%d (%s)\r\n", i, (int) parameters_[i], g_defaultSettings[i].description);
+         else
+            snprintf(buff, sizeof(buff), "$%d=%.3f (%s)\r\n", i, parameters_[i], g_defaultSettings[i].description);
+         Send(buff);
+      }
+      Send("ok\r\n");
+      return DONE;
+   }
+   if (line == "$H")
+   {
+      // wait for queued motion, then travel to the origin at the homing seek rate
+      if (phase_ == 0)
+      {
+         if (!planner_.empty())
+            return WAIT;
+         Block b;
+         for (int i = 0; i < 3; ++i)
+         {
+            b.target[i] = 0.0;
+            planned_[i] = 0.0;
+         }
+         b.rateMmPerMin = parameters_[20];
+         planner_.push_back(b);
+         homing_ = true;
+         phase_ = 1;
+         return WAIT;
+      }
+      if (!planner_.empty())
+         return WAIT;
+      homing_ = false;
+      Send("ok\r\n");
+      return DONE;
+   }
+   char* end;
+   long index = strtol(line.c_str() + 1, &end, 10);
+   if (end != line.c_str() + 1 && *end == '=' && index >= 0 && index < GRBL_SIM_PARAMETERS)
+   {
+      parameters_[index] = strtod(end + 1, 0);
+      Send("ok\r\n");
+      return DONE;
+   }
+   Send(g_unsupported);
+   return DONE;
+}
+
+GrblSimulator::Result GrblSimulator::ExecuteGCode(const std::string& line, double now)
+{
+   // parse into locals first, a line that has to wait is parsed again later
+   bool absolute = absolute_;
+   bool inches = inches_;
+   int motionMode = motionMode_;
+   double feed = feedMmPerMin_;
+   bool dwell = false;
+   bool sync = false;
+   bool axis[3] = {false, false, false};
+   double value[3] = {0.0, 0.0, 0.0};
+   double p = 0.0;
+
+   const char* c = line.c_str();
+   while (*c != 0)
+   {
+      char letter = *c++;
+      double number;
+      if (!ReadNumber(c, number))
+      {
+         Send("error: Bad number format\r\n");
+         return DONE;
+      }
+      switch (letter)
+      {
+         case 'G':
+            switch ((int) number)
+            {
+               case 0: motionMode = 0; break;
+               case 1: motionMode = 1; break;
+               case 4: dwell = true; break;
+               case 20: inches = true; break;
+               case 21: inches = false; break;
+               case 90: absolute = true; break;
+               case 91: absolute = false; break;
+               default: Send(g_unsupported); return DONE;
+            }
+            break;
+         case 'M':
+            if ((int) number != 108)
+            {
+               Send(g_unsupported);
+               return DONE;
+            }
+            sync = true;
+            break;
+         case 'X': axis[0] = true; value[0] = number; break;
+         case 'Y': axis[1] = true; value[1] = number; break;
+         case 'Z': axis[2] = true; value[2] = number; break;
+         case 'F': feed = number * (inches ? 25.4 : 1.0); break;
+         case 'P': p = number; break;
+         case 'Q': break;
+         case 'N': break;
+         default:
+            Send("error: Expected command letter\r\n");
+            return DONE;
+      }
+   }
+
+   if (dwell)
+   {
+      // G4 waits for the planner to drain, then pauses for P seconds
+      if (phase_ == 0)
+      {
+         if (!planner_.empty())
+            return WAIT;
+         dwellUntil_ = now + p * 1000.0;
+         phase_ = 1;
+      }
+      if (now < dwellUntil_)
+         return WAIT;
+   }
+
+   bool moves = axis[0] || axis[1] || axis[2];
+   if (moves)
+   {
+      if (planner_.size() >= g_plannerSize)
+         return WAIT; // the firmware stops reading until a block has finished
+      if (motionMode == 1 && feed <= 0.0)
+      {
+         Send("error: Invalid feed rate\r\n");
+         return DONE;
+      }
+      Block b;
+      for (int i = 0; i < 3; ++i)
+      {
+         double v = value[i] * (inches ? 25.4 : 1.0);
+         b.target[i] = axis[i] ? (absolute ? v : planned_[i] + v) : planned_[i];
+         planned_[i] = b.target[i];
+      }
+      b.rateMmPerMin = motionMode == 0 ? parameters_[5] : feed;
+      planner_.push_back(b);
+   }
+   (void) sync; // sync pulses have no observable effect here
+
+   absolute_ = absolute;
+   inches_ = inches;
+   motionMode_ = motionMode;
+   feedMmPerMin_ = feed;
+   Send("ok\r\n");
+   return DONE;
+}
+
+// advances the block at the head of the planner by dt seconds
+void GrblSimulator::Move(double dt)
+{
+   if (planner_.empty())
+   {
+      velocity_ = 0.0;
+      return;
+   }
+   Block& b = planner_.front();
+   double delta[3];
+   double distance = 0.0;
+   for (int i = 0; i < 3; ++i)
+   {
+      delta[i] = b.target[i] - position_[i];
+      distance += delta[i] * delta[i];
+   }
+   distance = sqrt(distance);
+
+   double accel = parameters_[8];
+   if (hold_)
+      velocity_ = velocity_ > accel * dt ? velocity_ - accel * dt : 0.0;
+   else
+   {
+      double cruise = b.rateMmPerMin / 60.0;
+      double stop = sqrt(2.0 * accel * distance); // fastest speed that still stops at the target
+      velocity_ += accel * dt;
+      if (velocity_ > cruise)
+         velocity_ = cruise;
+      if (velocity_ > stop)
+         velocity_ = stop;
+   }
+
+   double step = velocity_ * dt;
+   if (step >= distance || distance < 1e-9)
+   {
+      for (int i = 0; i < 3; ++i)
+         position_[i] = b.target[i];
+      planner_.pop_front();
+      velocity_ = 0.0;
+      if (planner_.empty())
+         hold_ = false;
+      return;
+   }
+   for (int i = 0; i < 3; ++i)
+      position_[i] += delta[i] * step / distance;
+}
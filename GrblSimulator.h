@@ -0,0 +1,111 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblSimulator.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Simulated EvaGrbl controller behind a pseudo-terminal, so the
+//                hub and the stage can run without an Arduino attached
+// LICENSE:       LGPL
+//
+
+#ifndef _GRBL_SIMULATOR_H_
+#define _GRBL_SIMULATOR_H_
+
+#include "../../MMDevice/DeviceThreads.h"
+#include <string>
+#include <deque>
+
+#define GRBL_SIM_PARAMETERS 23
+
+// Speaks the part of the EvaGrbl dialect the adapter depends on:
+// the real-time '?', '!', '~' and Ctrl-X, $$, $N=, $H, G0/G1, G4, G20/G21,
+// G90/G91, F and M108P..Q.. . Lines go through a receive buffer of the same
+// size as the firmware's and are acknowledged with ok/error once executed.
+// Bytes travel at the configured baud rate in both directions, each line
+// takes a configurable processing time and moves follow a trapezoidal
+// velocity profile using the simulated $8 acceleration. Each block starts
+// and ends at rest; junction blending is not modeled.
+// Only available where pseudo-terminals exist; Start fails on Windows.
+class GrblSimulator : public MMDeviceThreadBase
+{
+public:
+   GrblSimulator();
+   ~GrblSimulator();
+
+   void SetBaudRate(long baud) {baud_ = baud;}
+   void SetLineLatencyMs(double latencyMs) {lineLatencyMs_ = latencyMs;}
+   // time from opening the tty to the banner, the boot loader of a real board
+   void SetStartupDelayMs(double delayMs) {startupDelayMs_ = delayMs;}
+
+   // opens the pseudo-terminal and starts the controller thread
+   int Start();
+   void Stop();
+   // the tty to open in place of the serial port
+   const std::string& GetDevicePath() const {return devicePath_;}
+
+   int svc();
+
+private:
+   enum State {IDLE, QUEUE, RUN, HOLD, HOME};
+   enum Result {DONE, WAIT};
+
+   struct Block
+   {
+      double target[3];
+      double rateMmPerMin;
+   };
+
+   void Receive(double now);
+   void Deliver(double now);
+   void Realtime(char c);
+   void Report();
+   void ProcessLines(double now);
+   Result Execute(const std::string& line, double now);
+   Result ExecuteSystem(const std::string& line, double now);
+   Result ExecuteGCode(const std::string& line, double now);
+   void Move(double dt);
+   void Transmit(double now);
+   void Send(const std::string& text) {txPending_ += text;}
+   void Reset(double now);
+   State GetState() const;
+
+   int master_;
+   std::string devicePath_;
+   volatile bool stop_;
+   bool hungUp_;                 // no process has the tty open
+
+   long baud_;
+   double lineLatencyMs_;
+   double startupDelayMs_;
+
+   // bytes on their way to the controller and the time each one arrives
+   std::deque<std::pair<double, char> > wire_;
+   double wireFreeAt_;
+   std::string rxBuffer_;        // the controller's serial receive buffer
+   unsigned long overflows_;
+   std::string txPending_;       // output not yet on the wire
+   double txFreeAt_;
+   double bannerAt_;
+
+   // line being executed and the state of multi-step commands
+   bool lineActive_;
+   std::string line_;
+   double lineReadyAt_;
+   int phase_;
+   double dwellUntil_;
+
+   std::deque<Block> planner_;
+   double position_[3];
+   double planned_[3];           // end point of the last queued block
+   double velocity_;
+   bool hold_;
+   bool reportRequested_;        // a '?' has not been answered yet
+   bool homing_;
+   bool absolute_;
+   bool inches_;
+   int motionMode_;              // 0 or 1
+   double feedMmPerMin_;
+   double parameters_[GRBL_SIM_PARAMETERS];
+};
+
+#endif //_GRBL_SIMULATOR_H_
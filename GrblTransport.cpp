@@ -0,0 +1,242 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblTransport.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Byte transports between the EVA_NDE_Grbl hub and the board
+// LICENSE:       LGPL
+//
+
+#include "GrblTransport.h"
+
+#ifdef __linux__
+   #include <errno.h>
+   #include <fcntl.h>
+   #include <poll.h>
+   #include <termios.h>
+   #include <unistd.h>
+   #include <sys/epoll.h>
+   #include <sys/eventfd.h>
+   #include <sys/ioctl.h>
+   #include <linux/serial.h>
+#endif
+
+NativeSerialTransport::NativeSerialTransport() :
+   fd_(-1),
+   epollFd_(-1),
+   wakeFd_(-1),
+   lowLatency_(false)
+{
+}
+
+NativeSerialTransport::~NativeSerialTransport()
+{
+   Close();
+}
+
+#ifdef __linux__
+
+namespace {
+
+bool BaudToSpeed(long baud, speed_t& speed)
+{
+   switch (baud)
+   {
+      case 9600:   speed = B9600;   return true;
+      case 19200:  speed = B19200;  return true;
+      case 38400:  speed = B38400;  return true;
+      case 57600:  speed = B57600;  return true;
+      case 115200: speed = B115200; return true;
+      case 230400: speed = B230400; return true;
+      default: return false;
+   }
+}
+
+} // namespace
+
+int NativeSerialTransport::Open(const std::string& device, long baud)
+{
+   Close();
+   speed_t speed;
+   if (!BaudToSpeed(baud, speed))
+      return DEVICE_INVALID_PROPERTY_VALUE;
+
+   fd_ = open(device.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+   if (fd_ < 0)
+      return DEVICE_ERR;
+   // no other open of the tty succeeds while we hold it, and one that holds
+   // it exclusively already has made the open above fail with EBUSY
+   if (ioctl(fd_, TIOCEXCL) != 0)
+   {
+      Close();
+      return DEVICE_ERR;
+   }
+
+   struct termios tio;
+   if (tcgetattr(fd_, &tio) != 0)
+   {
+      Close();
+      return DEVICE_ERR;
+   }
+   cfmakeraw(&tio);
+   tio.c_cflag |= CLOCAL | CREAD;
+   tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+   // reads never block in the driver, epoll does the waiting
+   tio.c_cc[VMIN] = 0;
+   tio.c_cc[VTIME] = 0;
+   cfsetispeed(&tio, speed);
+   cfsetospeed(&tio, speed);
+   if (tcsetattr(fd_, TCSANOW, &tio) != 0)
+   {
+      Close();
+      return DEVICE_ERR;
+   }
+
+   // hand received bytes to us right away instead of after the driver's batching delay
+   struct serial_struct serial;
+   lowLatency_ = false;
+   if (ioctl(fd_, TIOCGSERIAL, &serial) == 0)
+   {
+      serial.flags |= ASYNC_LOW_LATENCY;
+      lowLatency_ = (ioctl(fd_, TIOCSSERIAL, &serial) == 0);
+   }
+
+   epollFd_ = epoll_create(1);
+   wakeFd_ = eventfd(0, EFD_NONBLOCK);
+   struct epoll_event ev;
+   ev.events = EPOLLIN;
+   ev.data.fd = fd_;
+   struct epoll_event wake;
+   wake.events = EPOLLIN;
+   wake.data.fd = wakeFd_;
+   if (epollFd_ < 0 || wakeFd_ < 0 || epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd_, &ev) != 0 ||
+      epoll_ctl(epollFd_, EPOLL_CTL_ADD, wakeFd_, &wake) != 0)
+   {
+      Close();
+      return DEVICE_ERR;
+   }
+   tcflush(fd_, TCIOFLUSH);
+   return DEVICE_OK;
+}
+
+void NativeSerialTransport::Close()
+{
+   if (epollFd_ >= 0)
+      close(epollFd_);
+   if (wakeFd_ >= 0)
+      close(wakeFd_);
+   if (fd_ >= 0)
+      close(fd_);
+   epollFd_ = -1;
+   wakeFd_ = -1;
+   fd_ = -1;
+}
+
+int NativeSerialTransport::Write(const unsigned char* data, unsigned len)
+{
+   if (fd_ < 0)
+      return DEVICE_NOT_CONNECTED;
+   unsigned written = 0;
+   while (written < len)
+   {
+      ssize_t n = write(fd_, data + written, len - written);
+      if (n > 0)
+      {
+         written += (unsigned) n;
+         continue;
+      }
+      if (n < 0 && errno != EAGAIN && errno != EINTR)
+         return DEVICE_ERR;
+      // output queue of the driver is full, wait until it drains
+      struct pollfd pfd;
+      pfd.fd = fd_;
+      pfd.events = POLLOUT;
+      if (poll(&pfd, 1, 1000) <= 0)
+         return DEVICE_SERIAL_TIMEOUT;
+   }
+   return DEVICE_OK;
+}
+
+int NativeSerialTransport::Read(unsigned char* data, unsigned maxLen, unsigned long& bytesRead, double timeoutMs)
+{
+   bytesRead = 0;
+   if (fd_ < 0)
+      return DEVICE_NOT_CONNECTED;
+   for (;;)
+   {
+      ssize_t n = read(fd_, data, maxLen);
+      if (n > 0)
+      {
+         bytesRead = (unsigned long) n;
+         return DEVICE_OK;
+      }
+      if (n < 0 && errno != EAGAIN && errno != EINTR)
+         return DEVICE_ERR;
+      if (timeoutMs <= 0.0)
+         return DEVICE_OK;
+      struct epoll_event ev;
+      int ready = epoll_wait(epollFd_, &ev, 1, (int) (timeoutMs + 0.999));
+      if (ready < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         return DEVICE_ERR;
+      }
+      if (ready == 0)
+         return DEVICE_OK;
+      if (ev.data.fd == wakeFd_)
+      {
+         eventfd_t count;
+         eventfd_read(wakeFd_, &count);
+         return DEVICE_OK;
+      }
+      timeoutMs = 0.0; // data is there, read it without waiting again
+   }
+}
+
+int NativeSerialTransport::Purge()
+{
+   if (fd_ < 0)
+      return DEVICE_NOT_CONNECTED;
+   tcflush(fd_, TCIOFLUSH);
+   return DEVICE_OK;
+}
+
+void NativeSerialTransport::Wake()
+{
+   if (wakeFd_ >= 0)
+      eventfd_write(wakeFd_, 1);
+}
+
+#else // not linux
+
+int NativeSerialTransport::Open(const std::string&, long)
+{
+   return DEVICE_NOT_SUPPORTED;
+}
+
+void NativeSerialTransport::Close()
+{
+}
+
+int NativeSerialTransport::Write(const unsigned char*, unsigned)
+{
+   return DEVICE_NOT_CONNECTED;
+}
+
+int NativeSerialTransport::Read(unsigned char*, unsigned, unsigned long& bytesRead, double)
+{
+   bytesRead = 0;
+   return DEVICE_NOT_CONNECTED;
+}
+
+int NativeSerialTransport::Purge()
+{
+   return DEVICE_NOT_CONNECTED;
+}
+
+void NativeSerialTransport::Wake()
+{
+}
+
+#endif
@@ -0,0 +1,62 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblTransport.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Byte transports between the EVA_NDE_Grbl hub and the board
+// LICENSE:       LGPL
+//
+
+#ifndef _GRBL_TRANSPORT_H_
+#define _GRBL_TRANSPORT_H_
+
+#include "../../MMDevice/MMDevice.h"
+#include <string>
+
+// Moves raw bytes to and from the controller. Calls return MM error codes.
+class GrblTransport
+{
+public:
+   virtual ~GrblTransport() {}
+
+   virtual int Write(const unsigned char* data, unsigned len) = 0;
+   // returns whatever is available, waiting at most timeoutMs for the first byte;
+   // bytesRead is 0 if nothing arrived in time
+   virtual int Read(unsigned char* data, unsigned maxLen, unsigned long& bytesRead, double timeoutMs) = 0;
+   // drops unread input and unsent output
+   virtual int Purge() = 0;
+   // from any thread: makes a Read that is waiting return now with no bytes,
+   // or the next Read if none is waiting
+   virtual void Wake() = 0;
+};
+
+// Opens the tty directly with termios in raw mode and exclusively (TIOCEXCL),
+// requests the low latency flag of the serial driver and waits for input with
+// epoll. Works with real serial ports and with pseudo-terminals; Wake signals
+// an eventfd that epoll waits on as well. Only available on Linux; on other
+// platforms Open always fails.
+class NativeSerialTransport : public GrblTransport
+{
+public:
+   NativeSerialTransport();
+   ~NativeSerialTransport();
+
+   int Open(const std::string& device, long baud);
+   void Close();
+   bool IsOpen() const {return fd_ >= 0;}
+   // false if the driver refused ASYNC_LOW_LATENCY, as pseudo-terminals do
+   bool IsLowLatency() const {return lowLatency_;}
+
+   int Write(const unsigned char* data, unsigned len);
+   int Read(unsigned char* data, unsigned maxLen, unsigned long& bytesRead, double timeoutMs);
+   int Purge();
+   void Wake();
+
+private:
+   int fd_;
+   int epollFd_;
+   int wakeFd_;
+   bool lowLatency_;
+};
+
+#endif //_GRBL_TRANSPORT_H_
@@ -24,6 +24,9 @@
 #include "XYStage.h"
 #include <sstream>
 #include "EVA_NDE_Grbl.h"
+#include "GrblScan.h"
+#include <fstream>
+#include <cfloat>
 
 ///////////
 // properties
@@ -42,6 +45,12 @@ const char* g_AccelProp = "Acceleration";
 const char* g_MoveTimeoutProp = "MoveTimeoutMs";
 
 const char* g_SyncStepProp = "SyncStep";
+const char* g_SequenceDwellProp = "SequenceDwellMs";
+const char* g_TileScanProp = "TileScan";
+const char* g_TileScanIdle = "Idle";
+const char* g_TileScanRunning = "Running";
+const char* g_FlyScanProp = "FlyScan";
+const char* g_FlyScanTriggerFileProp = "FlyScanTriggerFile";
 using namespace std;
 
 ///////////
@@ -52,61 +61,60 @@ const long yAxisMaxSteps = 1500000L;   // maximum number of steps in Y
 const double stepSizeUm = 0.05;        // step size in microns
 const double accelScale = 13.7438;     // scaling factor for acceleration
 const double velocityScale = 134218.0; // scaling factor for velocity
+const long maxSequenceLength = 100000; // positions in a hardware sequence
 
 ///////////////////////////////////////////////////////////////////////////////
-// CommandThread class
-// (for executing move commands)
+// ScanThread class
+// (streams a position sequence or tile scan into the firmware planner)
 ///////////////////////////////////////////////////////////////////////////////
 
-class XYStage::CommandThread : public MMDeviceThreadBase
+class XYStage::ScanThread : public MMDeviceThreadBase
 {
    public:
-      CommandThread(XYStage* stage) :
-         stop_(false), moving_(false), stage_(stage), errCode_(DEVICE_OK) {}
+      ScanThread(XYStage* stage) :
+         stage_(stage), source_(0), running_(false), started_(false), errCode_(DEVICE_OK) {}
 
-      virtual ~CommandThread() {}
-	  
+      ~ScanThread() {delete source_;}
+
+      // takes ownership of source
+      int Start(GrblScanSource* source)
+      {
+         delete source_;
+         source_ = source;
+         running_ = true;
+         errCode_ = DEVICE_OK;
+         started_ = true;
+         return activate();
+      }
+      // waits for the stream to end, if one was started
+      void Join()
+      {
+         if (started_)
+            wait();
+         started_ = false;
+      }
       int svc()
       {
-		CEVA_NDE_GrblHub* hub = static_cast<CEVA_NDE_GrblHub*>(stage_->GetParentHub());
-		if (!hub || !hub->IsPortAvailable()) {
-			return ERR_NO_PORT_SET;
-		}
-		while(1)
-		{
-			int ret = hub->GetStatus();
-			if(ret != DEVICE_OK){
-				moving_ = false;
-				break;
-			}
-			char buf[30]="";
-			ret = hub->GetProperty("Status",buf);
-			if((strcmp(buf,"Idle") == 0 )){
-				moving_ = false;
-				break;
-			}
-			else
-				moving_ = true;
-			CDeviceUtils::SleepMs(10);
-		}
-
+         CEVA_NDE_GrblHub* hub = static_cast<CEVA_NDE_GrblHub*>(stage_->GetParentHub());
+         errCode_ = hub->StreamCommands(*source_);
+         running_ = false;
          return 0;
       }
-      void Stop() {stop_ = true;}
-      bool GetStop() {return stop_;}
+      void Cancel() {if (source_) source_->Cancel();}
+      bool IsRunning() {return running_;}
       int GetErrorCode() {return errCode_;}
-      bool IsMoving()  {  return moving_;}
+      // stop reached last and the number of stops of the current or last scan
+      void GetProgress(long& current, long& total)
+      {
+         current = source_ ? source_->GetCurrentStep() : -1;
+         total = source_ ? source_->GetStepCount() : 0;
+      }
 
    private:
-      void Reset() {stop_ = false; errCode_ = DEVICE_OK; moving_ = false;}
-      enum Command {MOVE, MOVEREL, HOME};
-      bool stop_;
-      bool moving_;
       XYStage* stage_;
-      long x_;
-      long y_;
-      Command cmd_;
-      Command lastCmd_;
+      GrblScanSource* source_;
+      volatile bool running_;
+      bool started_;
       int errCode_;
 };
 
@@ -116,13 +124,32 @@ class XYStage::CommandThread : public MMDeviceThreadBase
 
 XYStage::XYStage() :
    CXYStageBase<XYStage>(),
+   syncStep_(1.0),
    initialized_(false),
    home_(false),
    answerTimeoutMs_(1000.0),
-   moveTimeoutMs_(10000.0),
+   moveTimeoutMs_(1000.0),
 
-   cmdThread_(0)
+   scanThread_(0),
+   sequenceDwellMs_(0.0),
+   flyScanTriggerFile_("EVA_NDE_Grbl-triggers.csv")
 {
+   tileScan_[TILE_ORIGIN_X] = 0.0;
+   tileScan_[TILE_ORIGIN_Y] = 0.0;
+   tileScan_[TILE_WIDTH] = 100.0;
+   tileScan_[TILE_HEIGHT] = 100.0;
+   tileScan_[TILE_OVERLAP] = 0.1;
+   tileScan_[TILE_ROWS] = 1;
+   tileScan_[TILE_COLUMNS] = 1;
+   tileScan_[TILE_DWELL] = 0.0;
+   flyScan_[FLY_ORIGIN_X] = 0.0;
+   flyScan_[FLY_ORIGIN_Y] = 0.0;
+   flyScan_[FLY_ROW_LENGTH] = 1000.0;
+   flyScan_[FLY_ROWS] = 1;
+   flyScan_[FLY_ROW_PITCH] = 100.0;
+   flyScan_[FLY_FRAME_PITCH] = 100.0;
+   flyScan_[FLY_FRAME_PERIOD] = 50.0;
+
    // set default error messages
    InitializeDefaultErrorMessages();
 
@@ -137,12 +164,13 @@ XYStage::XYStage() :
    CreateProperty(MM::g_Keyword_Description, "XY stage adapter for EvaGrbl -- by Wei Ouyang", MM::String, true);
 
 
-   cmdThread_ = new CommandThread(this);
+   scanThread_ = new ScanThread(this);
 }
 
 XYStage::~XYStage()
 {
    Shutdown();
+   delete scanThread_;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -195,7 +223,7 @@ int XYStage::Initialize()
 
    // Move timeout
    pAct = new CPropertyAction (this, &XYStage::OnMoveTimeout);
-   CreateProperty(g_MoveTimeoutProp, "10000.0", MM::Float, false, pAct);
+   CreateProperty(g_MoveTimeoutProp, "1000.0", MM::Float, false, pAct);
    //SetPropertyLimits("Acceleration", 0.0, 150);
 
    // Sync Step
@@ -203,6 +231,52 @@ int XYStage::Initialize()
    CreateProperty(g_SyncStepProp, "1.0", MM::Float, false, pAct);
    //SetPropertyLimits("Acceleration", 0.0, 150);
 
+   // time spent at each position of a hardware sequence
+   pAct = new CPropertyAction (this, &XYStage::OnSequenceDwell);
+   CreateProperty(g_SequenceDwellProp, CDeviceUtils::ConvertToString(sequenceDwellMs_), MM::Float, false, pAct);
+   SetPropertyLimits(g_SequenceDwellProp, 0.0, 10000.0);
+
+   // Tile scan
+   const char* tileScanProps[TILE_PARAMETERS] = {"TileOriginXUm", "TileOriginYUm", "TileWidthUm",
+      "TileHeightUm", "TileOverlap", "TileRows", "TileColumns", "TileDwellMs"};
+   for (long i = 0; i < TILE_PARAMETERS; ++i)
+   {
+      CPropertyActionEx* pActEx = new CPropertyActionEx (this, &XYStage::OnTileScanParameter, i);
+      bool integer = i == TILE_ROWS || i == TILE_COLUMNS;
+      CreateProperty(tileScanProps[i], CDeviceUtils::ConvertToString(tileScan_[i]), integer ? MM::Integer : MM::Float, false, pActEx);
+   }
+   SetPropertyLimits("TileOverlap", 0.0, 0.9);
+   SetPropertyLimits("TileRows", 1, 10000);
+   SetPropertyLimits("TileColumns", 1, 10000);
+   SetPropertyLimits("TileDwellMs", 0.0, 10000.0);
+   pAct = new CPropertyAction (this, &XYStage::OnTileScan);
+   CreateProperty(g_TileScanProp, g_TileScanIdle, MM::String, false, pAct);
+   AddAllowedValue(g_TileScanProp, g_TileScanIdle);
+   AddAllowedValue(g_TileScanProp, g_TileScanRunning);
+   pAct = new CPropertyAction (this, &XYStage::OnTileScanProgress);
+   CreateProperty("TileScanProgress", "", MM::String, true, pAct);
+   pAct = new CPropertyAction (this, &XYStage::OnTileScanCurrentTile);
+   CreateProperty("TileScanCurrentTile", "-1", MM::Integer, true, pAct);
+
+   // Fly scan, progress is reported by the TileScan* properties in rows
+   const char* flyScanProps[FLY_PARAMETERS] = {"FlyOriginXUm", "FlyOriginYUm", "FlyRowLengthUm",
+      "FlyRows", "FlyRowPitchUm", "FlyFramePitchUm", "FlyFramePeriodMs"};
+   for (long i = 0; i < FLY_PARAMETERS; ++i)
+   {
+      CPropertyActionEx* pActEx = new CPropertyActionEx (this, &XYStage::OnFlyScanParameter, i);
+      bool integer = i == FLY_ROWS;
+      CreateProperty(flyScanProps[i], CDeviceUtils::ConvertToString(flyScan_[i]), integer ? MM::Integer : MM::Float, false, pActEx);
+   }
+   SetPropertyLimits("FlyRows", 1, 10000);
+   SetPropertyLimits("FlyFramePitchUm", 0.1, 100000.0);
+   SetPropertyLimits("FlyFramePeriodMs", 0.1, 10000.0);
+   pAct = new CPropertyAction (this, &XYStage::OnFlyScan);
+   CreateProperty(g_FlyScanProp, g_TileScanIdle, MM::String, false, pAct);
+   AddAllowedValue(g_FlyScanProp, g_TileScanIdle);
+   AddAllowedValue(g_FlyScanProp, g_TileScanRunning);
+   pAct = new CPropertyAction (this, &XYStage::OnFlyScanTriggerFile);
+   CreateProperty(g_FlyScanTriggerFileProp, flyScanTriggerFile_.c_str(), MM::String, false, pAct);
+
 
    ret = UpdateStatus();
    if (ret != DEVICE_OK)
@@ -214,15 +288,11 @@ int XYStage::Initialize()
 
 int XYStage::Shutdown()
 {
-
-   if (cmdThread_ && cmdThread_->IsMoving())
-   {
-      cmdThread_->Stop();
-      cmdThread_->wait();
-   }
-
-   delete cmdThread_;
-   cmdThread_ = 0;
+   // the thread is kept until the destructor, for a later Initialize and
+   // for calls after Shutdown
+   if (scanThread_->IsRunning())
+      StopScan();
+   scanThread_->Join();
 
    if (initialized_)
       initialized_ = false;
@@ -230,9 +300,60 @@ int XYStage::Shutdown()
    return DEVICE_OK;
 }
 
+/**
+ * Busy from sending a move until the controller has finished it, as tracked
+ * by the hub from the replies it reads; asks the hub for a planner fence so
+ * the end of the move is noticed without waiting for the status poller.
+ */
 bool XYStage::Busy()
 {
-	return false;
+   CEVA_NDE_GrblHub* hub = static_cast<CEVA_NDE_GrblHub*>(GetParentHub());
+   if (!hub || !hub->IsPortAvailable())
+      return false;
+   return hub->Busy() || IsScanRunning();
+}
+
+/**
+ * Blocks until the stage has stopped or GrblNowMs() reaches deadlineMs, waking
+ * as soon as the hub sees the planner drain.
+ */
+int XYStage::WaitForMotion(double deadlineMs)
+{
+   CEVA_NDE_GrblHub* hub = static_cast<CEVA_NDE_GrblHub*>(GetParentHub());
+   if (!hub || !hub->IsPortAvailable())
+      return ERR_NO_PORT_SET;
+   return hub->WaitForMotion(deadlineMs);
+}
+
+/**
+ * When the moves already queued will have finished, from the trajectory model.
+ */
+int XYStage::GetMotionEndMs(double& endMs)
+{
+   CEVA_NDE_GrblHub* hub = static_cast<CEVA_NDE_GrblHub*>(GetParentHub());
+   if (!hub || !hub->IsPortAvailable())
+      return ERR_NO_PORT_SET;
+   return hub->GetMotionEndMs(endMs) ? DEVICE_OK : ERR_UNKNOWN_POSITION;
+}
+
+/**
+ * When a move to (xUm, yUm) sent now would finish: it starts where the queued
+ * moves end and runs at the seek rate with the controller's acceleration.
+ */
+int XYStage::EstimateMoveEndMs(double xUm, double yUm, double& endMs)
+{
+   CEVA_NDE_GrblHub* hub = static_cast<CEVA_NDE_GrblHub*>(GetParentHub());
+   if (!hub || !hub->IsPortAvailable())
+      return ERR_NO_PORT_SET;
+   double from[2];
+   if (!hub->GetMotionEndMs(endMs) || !hub->PredictPosition(endMs, from))
+      return ERR_UNKNOWN_POSITION;
+   GrblMoveEstimator estimator(hub->GetMachineLimits());
+   estimator.Reset(from);
+   double target[2] = {xUm/1000.0, yUm/1000.0};
+   estimator.AddMove(target, 3, false, true, -1.0);
+   endMs += estimator.Plan();
+   return DEVICE_OK;
 }
  
 double XYStage::GetStepSizeXUm()
@@ -241,7 +362,9 @@ double XYStage::GetStepSizeXUm()
 	if (!hub || !hub->IsPortAvailable()) {
 		return ERR_NO_PORT_SET;
 	}
-   return 1000.0/(*parameters_)[0];
+   GrblStepScale scale;
+   GetStepScale(scale);
+   return 1000.0/scale.stepsPerMm[X];
 }
 
 double XYStage::GetStepSizeYUm()
@@ -250,22 +373,54 @@ double XYStage::GetStepSizeYUm()
 	if (!hub || !hub->IsPortAvailable()) {
 		return ERR_NO_PORT_SET;
 	}
-   return 1000.0/(*parameters_)[1];
+   GrblStepScale scale;
+   GetStepScale(scale);
+   return 1000.0/scale.stepsPerMm[Y];
 }
 
-int XYStage::SetPositionSteps(long x, long y)
+/**
+ * Copies the steps/mm and n-decimals settings, taking them from the hub
+ * again only when it has reloaded its parameters.
+ */
+void XYStage::GetStepScale(GrblStepScale& scale)
 {
+   CEVA_NDE_GrblHub* hub = static_cast<CEVA_NDE_GrblHub*>(GetParentHub());
+   stepScale_.Read(scale);
+   long version = hub->GetParametersVersion();
+   if (scale.version == version || parameters_->size() <= 12)
+      return;
+   scale.stepsPerMm[X] = (*parameters_)[0];
+   scale.stepsPerMm[Y] = (*parameters_)[1];
+   long decimals = (long) (*parameters_)[12];
+   scale.decimals = decimals < 0 ? 0 : (decimals > 9 ? 9 : (int) decimals);
+   scale.version = version;
+   stepScale_.Write(scale);
+}
 
-   SetPositionUm(x*GetStepSizeXUm(), y*GetStepSizeYUm());
-   CDeviceUtils::SleepMs(10); // to make sure that there is enough time for thread to get started
-
-   return DEVICE_OK;   
+int XYStage::SetPositionSteps(long x, long y)
+{
+   return MoveSteps(x, y, false);
 }
  
 int XYStage::SetRelativePositionSteps(long x, long y)
 {
-   SetRelativePositionUm(x*GetStepSizeXUm(), y*GetStepSizeYUm());
-   return DEVICE_OK;
+   return MoveSteps(x, y, true);
+}
+
+// sends a move of whole steps, in as few bytes as the settings allow
+int XYStage::MoveSteps(long x, long y, bool relative)
+{
+	CEVA_NDE_GrblHub* hub = static_cast<CEVA_NDE_GrblHub*>(GetParentHub());
+	if (!hub || !hub->IsPortAvailable()) {
+		return ERR_NO_PORT_SET;
+	}
+   GrblStepScale scale;
+   GetStepScale(scale);
+   char buff[64];
+   buff[scale.EncodeAxes(x, y, buff)] = 0;
+   std::string answer;
+   return hub->SendMotion(relative ? GrblModalState::RELATIVE_DISTANCE : GrblModalState::ABSOLUTE_DISTANCE,
+      GrblModalState::RAPID, buff, -1.0, answer);
 }
 int XYStage::GetPositionUm(double& x, double& y){
    int ret;
@@ -273,30 +428,49 @@ int XYStage::GetPositionUm(double& x, double& y){
 	if (!hub || !hub->IsPortAvailable()) {
 		return ERR_NO_PORT_SET;
 	}
-    ret = hub->GetStatus();
+   // between status reports, from the model of the queued moves
+   double predicted[2];
+   if (hub->PredictPosition(GrblNowMs(), predicted))
+   {
+      x = predicted[0]*1000.0;
+      y = predicted[1]*1000.0;
+      return DEVICE_OK;
+   }
+    GrblStatusSnapshot snapshot;
+    ret = hub->GetStatusSnapshot(snapshot);
 	if (ret != DEVICE_OK)
     return ret;
-	x =  hub->MPos[0]*1000.0 ;
-	y =   hub->MPos[1]*1000.0;
-   ostringstream os;
-   os << "GetPositionSteps(), X=" << x << ", Y=" << y;
-   LogMessage(os.str().c_str(), true);
+	x =  snapshot.MPos[0]*1000.0 ;
+	y =   snapshot.MPos[1]*1000.0;
+   return DEVICE_OK;
+}
+/**
+ * Looks up the position at an earlier time, e.g. the middle of a camera
+ * exposure, by interpolating between the status reports around it.
+ */
+int XYStage::GetPositionAtUm(double timeMs, double& x, double& y)
+{
+   CEVA_NDE_GrblHub* hub = static_cast<CEVA_NDE_GrblHub*>(GetParentHub());
+   if (!hub || !hub->IsPortAvailable())
+      return ERR_NO_PORT_SET;
+   double position[3];
+   int ret = hub->GetPositionAt(timeMs, position);
+   if (ret != DEVICE_OK)
+      return ret;
+   x = position[0]*1000.0;
+   y = position[1]*1000.0;
+   return DEVICE_OK;
 }
 int XYStage::GetPositionSteps(long& x, long& y)
 {
-   int ret;
-   	CEVA_NDE_GrblHub* hub = static_cast<CEVA_NDE_GrblHub*>(GetParentHub());
-	if (!hub || !hub->IsPortAvailable()) {
-		return ERR_NO_PORT_SET;
-	}
-    ret = hub->GetStatus();
+   double xUm, yUm;
+   int ret = GetPositionUm(xUm, yUm);
 	if (ret != DEVICE_OK)
     return ret;
-	x =  hub->MPos[0]*1000 /GetStepSizeXUm();
-	y =   hub->MPos[1]*1000 /GetStepSizeXUm();
-   ostringstream os;
-   os << "GetPositionSteps(), X=" << x << ", Y=" << y;
-   LogMessage(os.str().c_str(), true);
+	GrblStepScale scale;
+	GetStepScale(scale);
+	x = scale.ToSteps(X, xUm);
+	y = scale.ToSteps(Y, yUm);
    return DEVICE_OK;
 }
 int XYStage::SetPositionUm(double x, double y){
@@ -304,42 +478,18 @@ int XYStage::SetPositionUm(double x, double y){
 	if (!hub || !hub->IsPortAvailable()) {
 		return ERR_NO_PORT_SET;
 	}
-	int errCode_ = DEVICE_ERR;
-	if(lastMode_ != MOVE){
-		std::string tmp("G90");
-		errCode_ = hub->SendCommand(tmp,tmp);
-		lastMode_ = MOVE;
-	}
-	char buff[100];
-	sprintf(buff, "G00X%fY%f", x/1000.0,y/1000.0);
-	std::string buffAsStdStr = buff;
-	errCode_ = hub->SendCommand(buffAsStdStr,buffAsStdStr); //stage_->MoveBlocking(x_, y_);
-
-	ostringstream os;
-	os << "Move finished with error code: " << errCode_;
-	LogMessage(os.str().c_str(), true);
-	return errCode_;
+	GrblStepScale scale;
+	GetStepScale(scale);
+	return MoveSteps(scale.ToSteps(X, x), scale.ToSteps(Y, y), false);
 }
 int XYStage::SetRelativePositionUm(double dx, double dy){
 	 CEVA_NDE_GrblHub* hub = static_cast<CEVA_NDE_GrblHub*>(GetParentHub());
 	if (!hub || !hub->IsPortAvailable()) {
 		return ERR_NO_PORT_SET;
 	}
-	int errCode_ = DEVICE_ERR;
-	if(lastMode_ != MOVEREL){
-		std::string tmp("G91");
-		errCode_ = hub->SendCommand(tmp,tmp);
-		lastMode_ = MOVEREL;
-	}
-	char buff[100];
-	sprintf(buff, "G00X%fY%f", dx/1000.0,dy/1000.0);
-	std::string buffAsStdStr = buff;
-    errCode_ = hub->SendCommand(buffAsStdStr,buffAsStdStr);  // relative move
-
-    ostringstream os;
-    os << "Move finished with error code: " << errCode_;
-    LogMessage(os.str().c_str(), true);
-	return errCode_;
+	GrblStepScale scale;
+	GetStepScale(scale);
+	return MoveSteps(scale.ToSteps(X, dx), scale.ToSteps(Y, dy), true);
 }
 
 
@@ -371,10 +521,194 @@ int XYStage::Home()
  */
 int XYStage::Stop()
 {
-   int ret;
+   CEVA_NDE_GrblHub* hub = static_cast<CEVA_NDE_GrblHub*>(GetParentHub());
+   if (!hub || !hub->IsPortAvailable()) {
+      return ERR_NO_PORT_SET;
+   }
+   // feed hold decelerates without losing steps, even with moves in flight
+   int ret = hub->FeedHold();
+   if (ret != DEVICE_OK)
+      return ret;
+   for (int i = 0; i < 500; ++i)
+   {
+      GrblStatusSnapshot snapshot;
+      ret = hub->GetStatusSnapshot(snapshot, 0.0);
+      if (ret != DEVICE_OK)
+         return ret;
+      if (strcmp(snapshot.status, "Run") != 0 && strcmp(snapshot.status, "Hold") != 0)
+         break;
+      CDeviceUtils::SleepMs(10);
+   }
+   // drop whatever is still queued in the planner
+   return hub->SoftReset();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Sequence API
+// The positions are streamed into the planner when the sequence is started,
+// so the stage runs through the list without a host round trip per position.
+// The M108 sync output is set up with SyncStep when the sequence starts, and
+// the stage dwells SequenceDwellMs at each position (see GrblStopScanSource).
+///////////////////////////////////////////////////////////////////////////////
+
+int XYStage::GetXYStageSequenceMaxLength(long& nrEvents) const
+{
+   nrEvents = maxSequenceLength;
+   return DEVICE_OK;
+}
+
+int XYStage::StartXYStageSequence()
+{
+   if (sentSequence_.empty())
+      return DEVICE_OK;
+   return StartScan(new GrblPositionListSource(sentSequence_, syncStep_, sequenceDwellMs_));
+}
+
+int XYStage::StopXYStageSequence()
+{
+   return StopScan();
+}
+
+int XYStage::ClearXYStageSequence()
+{
+   sequence_.clear();
+   return DEVICE_OK;
+}
+
+int XYStage::AddToXYStageSequence(double positionX, double positionY)
+{
+   if ((long) sequence_.size() >= maxSequenceLength)
+      return DEVICE_SEQUENCE_TOO_LARGE;
+   sequence_.push_back(std::make_pair(positionX, positionY));
    return DEVICE_OK;
 }
 
+/**
+ * Takes the positions added so far as the sequence for StartXYStageSequence.
+ */
+int XYStage::SendXYStageSequence()
+{
+   sentSequence_ = sequence_;
+   return DEVICE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Tile scan
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Scans a rows x columns grid of tiles in serpentine order, starting with the
+ * tile at the origin. The path is generated while it is streamed, so a grid
+ * of any size takes the same memory and no host round trip per tile.
+ * Returns once the scan has been started.
+ */
+int XYStage::StartTileScan(double originXUm, double originYUm, double tileWidthUm, double tileHeightUm,
+   double overlap, long rows, long columns, double dwellMs)
+{
+   if (rows < 1 || columns < 1 || overlap < 0.0 || overlap >= 1.0)
+      return DEVICE_INVALID_PROPERTY_VALUE;
+   return StartScan(new GrblTileScanSource(originXUm, originYUm, tileWidthUm, tileHeightUm,
+      overlap, rows, columns, syncStep_, dwellMs));
+}
+
+int XYStage::StopTileScan()
+{
+   return StopScan();
+}
+
+/**
+ * Index of the tile the stage has reached last, -1 before the first one,
+ * and the number of tiles. Also reports on position sequences, and on fly
+ * scans in rows.
+ */
+int XYStage::GetTileScanProgress(long& tile, long& total)
+{
+   scanThread_->GetProgress(tile, total);
+   return DEVICE_OK;
+}
+
+bool XYStage::IsScanRunning()
+{
+   return scanThread_->IsRunning();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Fly scan
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Scans rows of rowLengthUm along X, rowPitchUm apart in Y, without stopping
+ * inside the region: the stage moves at one frame pitch per frame period and
+ * the sync output pulses every frame pitch. The ramps needed by the $8
+ * acceleration lie outside the region, so frames triggered there can be
+ * dropped. triggers receives the expected position of every pulse.
+ * Returns once the scan has been started.
+ */
+int XYStage::StartFlyScan(double originXUm, double originYUm, double rowLengthUm, long rows, double rowPitchUm,
+   double framePitchUm, double framePeriodMs, std::vector<GrblFlyScanTrigger>& triggers)
+{
+   if (rows < 1 || rowLengthUm <= 0.0 || framePitchUm <= 0.0 || framePeriodMs <= 0.0)
+      return DEVICE_INVALID_PROPERTY_VALUE;
+   if (parameters_->size() <= 8 || (*parameters_)[8] <= 0.0)
+      return DEVICE_ERR;
+   GrblFlyScanSource* source = new GrblFlyScanSource(originXUm, originYUm, rowLengthUm, rows, rowPitchUm,
+      framePitchUm, framePeriodMs, (*parameters_)[8], syncStep_);
+   source->GetTriggers(triggers);
+   return StartScan(source);
+}
+
+int XYStage::StopFlyScan()
+{
+   return StopScan();
+}
+
+// false for a sync step M108 cannot take: not positive, or not finite
+static bool IsValidSyncStep(double step)
+{
+   return step > 0.0 && step <= DBL_MAX;
+}
+
+// takes ownership of source
+int XYStage::StartScan(GrblScanSource* source)
+{
+   // every scan sets up the sync output with SyncStep
+   if (!IsValidSyncStep(syncStep_))
+   {
+      delete source;
+      return DEVICE_INVALID_PROPERTY_VALUE;
+   }
+   CEVA_NDE_GrblHub* hub = static_cast<CEVA_NDE_GrblHub*>(GetParentHub());
+   if (!hub || !hub->IsPortAvailable()) {
+      delete source;
+      return ERR_NO_PORT_SET;
+   }
+   if (scanThread_->IsRunning())
+   {
+      delete source;
+      return DEVICE_ERR;
+   }
+   scanThread_->Join(); // reap the previous run
+   return scanThread_->Start(source);
+}
+
+/**
+ * Stops a running scan at once: the stage decelerates and the
+ * controller drops the positions still queued.
+ */
+int XYStage::StopScan()
+{
+   if (!scanThread_->IsRunning())
+      return DEVICE_OK;
+   scanThread_->Cancel();
+   int ret = Stop();
+   scanThread_->Join();
+   if (ret != DEVICE_OK)
+      return ret;
+   int err = scanThread_->GetErrorCode();
+   // the reset is how the stream was ended
+   return err == ERR_CONTROLLER_RESET ? DEVICE_OK : err;
+}
+
 /**
  * This is supposed to set the origin (0,0) at whatever is the current position.
  * Our stage does not support setting the origin (it is fixed). The base class
@@ -435,21 +769,33 @@ int XYStage::OnMaxVelocity(MM::PropertyBase* pProp, MM::ActionType eAct)
  */
 int XYStage::OnAcceleration(MM::PropertyBase* pProp, MM::ActionType eAct) 
 {
+   // the controller's own acceleration, $8 in mm/sec^2
    if (eAct == MM::BeforeGet) 
    {
-	    pProp->Set(moveTimeoutMs_);
+      if (parameters_->size() > 8)
+         pProp->Set((*parameters_)[8]);
    } 
    else if (eAct == MM::AfterSet) 
    {
-	   pProp->Get(moveTimeoutMs_);
+	   CEVA_NDE_GrblHub* hub = static_cast<CEVA_NDE_GrblHub*>(GetParentHub());
+	   if (!hub || !hub->IsPortAvailable()) {
+		  return ERR_NO_PORT_SET;
+	   }
 
+      double acceleration;
+      pProp->Get(acceleration);
+      if (!(acceleration > 0.0))
+         return DEVICE_INVALID_PROPERTY_VALUE;
+      if (parameters_->size() > 8 && (*parameters_)[8] == acceleration)
+         return DEVICE_OK;
+      return hub->SetParameter(8, acceleration);
    }
 
    return DEVICE_OK;
 }
 
 /**
- * Gets and sets the Acceleration of the stage travels
+ * Gets and sets how long a move may take beyond its estimated duration
  */
 int XYStage::OnMoveTimeout(MM::PropertyBase* pProp, MM::ActionType eAct) 
 {
@@ -482,11 +828,164 @@ int XYStage::OnSyncStep(MM::PropertyBase* pProp, MM::ActionType eAct)
 		  return ERR_NO_PORT_SET;
 	   }
 
-      pProp->Get(syncStep_);
+      double syncStep;
+      pProp->Get(syncStep);
+      if (!IsValidSyncStep(syncStep))
+         return DEVICE_INVALID_PROPERTY_VALUE;
 
-	   int ret = hub->SetSync(0,syncStep_);
+	   int ret = hub->SetSync(0,syncStep);
 	   if(ret != DEVICE_OK)
 		   return ret;
+      syncStep_ = syncStep;
+   }
+
+   return DEVICE_OK;
+}
+
+int XYStage::OnSequenceDwell(MM::PropertyBase* pProp, MM::ActionType eAct) 
+{
+   if (eAct == MM::BeforeGet) 
+   {
+      pProp->Set(sequenceDwellMs_);
+   } 
+   else if (eAct == MM::AfterSet) 
+   {
+      pProp->Get(sequenceDwellMs_);
+   }
+
+   return DEVICE_OK;
+}
+
+/**
+ * Origin, tile size, overlap, grid size and dwell of the tile scan
+ */
+int XYStage::OnTileScanParameter(MM::PropertyBase* pProp, MM::ActionType eAct, long index) 
+{
+   if (eAct == MM::BeforeGet) 
+   {
+      pProp->Set(tileScan_[index]);
+   } 
+   else if (eAct == MM::AfterSet) 
+   {
+      pProp->Get(tileScan_[index]);
+   }
+
+   return DEVICE_OK;
+}
+
+/**
+ * Running starts a tile scan with the Tile* properties, Idle stops it
+ */
+int XYStage::OnTileScan(MM::PropertyBase* pProp, MM::ActionType eAct) 
+{
+   if (eAct == MM::BeforeGet) 
+   {
+      pProp->Set(IsScanRunning() ? g_TileScanRunning : g_TileScanIdle);
+   } 
+   else if (eAct == MM::AfterSet) 
+   {
+      std::string value;
+      pProp->Get(value);
+      if (value == g_TileScanIdle)
+         return StopTileScan();
+      if (IsScanRunning())
+         return DEVICE_OK;
+      return StartTileScan(tileScan_[TILE_ORIGIN_X], tileScan_[TILE_ORIGIN_Y], tileScan_[TILE_WIDTH],
+         tileScan_[TILE_HEIGHT], tileScan_[TILE_OVERLAP], (long) tileScan_[TILE_ROWS],
+         (long) tileScan_[TILE_COLUMNS], tileScan_[TILE_DWELL]);
+   }
+
+   return DEVICE_OK;
+}
+
+int XYStage::OnTileScanProgress(MM::PropertyBase* pProp, MM::ActionType eAct) 
+{
+   if (eAct == MM::BeforeGet) 
+   {
+      long tile, total;
+      GetTileScanProgress(tile, total);
+      ostringstream os;
+      os << tile + 1 << "/" << total;
+      pProp->Set(os.str().c_str());
+   } 
+
+   return DEVICE_OK;
+}
+
+int XYStage::OnTileScanCurrentTile(MM::PropertyBase* pProp, MM::ActionType eAct) 
+{
+   if (eAct == MM::BeforeGet) 
+   {
+      long tile, total;
+      GetTileScanProgress(tile, total);
+      pProp->Set(tile);
+   } 
+
+   return DEVICE_OK;
+}
+
+/**
+ * Region, row pitch and camera frame pitch and period of the fly scan
+ */
+int XYStage::OnFlyScanParameter(MM::PropertyBase* pProp, MM::ActionType eAct, long index) 
+{
+   if (eAct == MM::BeforeGet) 
+   {
+      pProp->Set(flyScan_[index]);
+   } 
+   else if (eAct == MM::AfterSet) 
+   {
+      pProp->Get(flyScan_[index]);
+   }
+
+   return DEVICE_OK;
+}
+
+/**
+ * Running starts a fly scan with the Fly* properties and writes the expected
+ * trigger positions to FlyScanTriggerFile as CSV, Idle stops it
+ */
+int XYStage::OnFlyScan(MM::PropertyBase* pProp, MM::ActionType eAct) 
+{
+   if (eAct == MM::BeforeGet) 
+   {
+      pProp->Set(IsScanRunning() ? g_TileScanRunning : g_TileScanIdle);
+   } 
+   else if (eAct == MM::AfterSet) 
+   {
+      std::string value;
+      pProp->Get(value);
+      if (value == g_TileScanIdle)
+         return StopFlyScan();
+      if (IsScanRunning())
+         return DEVICE_OK;
+      std::vector<GrblFlyScanTrigger> triggers;
+      int ret = StartFlyScan(flyScan_[FLY_ORIGIN_X], flyScan_[FLY_ORIGIN_Y], flyScan_[FLY_ROW_LENGTH],
+         (long) flyScan_[FLY_ROWS], flyScan_[FLY_ROW_PITCH], flyScan_[FLY_FRAME_PITCH],
+         flyScan_[FLY_FRAME_PERIOD], triggers);
+      if (ret != DEVICE_OK || flyScanTriggerFile_.empty())
+         return ret;
+      ofstream out(flyScanTriggerFile_.c_str());
+      out << "row,x_um,y_um,in_region\n";
+      for (std::vector<GrblFlyScanTrigger>::size_type i = 0; i < triggers.size(); ++i)
+         out << triggers[i].row << "," << triggers[i].xUm << "," << triggers[i].yUm << ","
+            << (triggers[i].inRegion ? 1 : 0) << "\n";
+      if (!out)
+         return DEVICE_ERR;
+   }
+
+   return DEVICE_OK;
+}
+
+int XYStage::OnFlyScanTriggerFile(MM::PropertyBase* pProp, MM::ActionType eAct) 
+{
+   if (eAct == MM::BeforeGet) 
+   {
+      pProp->Set(flyScanTriggerFile_.c_str());
+   } 
+   else if (eAct == MM::AfterSet) 
+   {
+      pProp->Get(flyScanTriggerFile_);
    }
 
    return DEVICE_OK;
@@ -498,21 +997,15 @@ int XYStage::OnSyncStep(MM::PropertyBase* pProp, MM::ActionType eAct)
 
 
 /**
- * Sends move command to both axes and waits for responses, blocking the calling thread.
- * If expected answers do not come within timeout interval, returns with error.
+ * Sends move command to both axes and waits until the stage has stopped, blocking the calling thread.
+ * If the move does not finish within MoveTimeoutMs of the time it should take, returns with error.
  */
 int XYStage::MoveBlocking(long x, long y, bool relative)
 {
-   int ret;
-
-   //if (!home_)
-   //   return ERR_HOME_REQUIRED; 
-
-   //// send command to X axis
-   //ret = xstage_->MoveBlocking(x, relative);
+   int ret = MoveSteps(x, y, relative);
    if (ret != DEVICE_OK)
       return ret;
-   // send command to Y axis
-   return ret;//ystage_->MoveBlocking(y, relative);
+   CEVA_NDE_GrblHub* hub = static_cast<CEVA_NDE_GrblHub*>(GetParentHub());
+   return hub->WaitForMotionEnd(moveTimeoutMs_);
 }
 
@@ -26,6 +26,11 @@
 
 #include "../../MMDevice/MMDevice.h"
 #include "../../MMDevice/DeviceBase.h"
+#include "GrblPrimitives.h"
+#include "GrblProtocol.h"
+
+class GrblScanSource;
+struct GrblFlyScanTrigger;
 
 
 
@@ -61,7 +66,31 @@ public:
    int GetStepLimits(long& xMin, long& xMax, long& yMin, long& yMax);
    double GetStepSizeXUm();
    double GetStepSizeYUm();
-   int IsXYStageSequenceable(bool& isSequenceable) const {isSequenceable = false; return DEVICE_OK;}
+   int IsXYStageSequenceable(bool& isSequenceable) const {isSequenceable = true; return DEVICE_OK;}
+   int GetXYStageSequenceMaxLength(long& nrEvents) const;
+   int StartXYStageSequence();
+   int StopXYStageSequence();
+   int ClearXYStageSequence();
+   int AddToXYStageSequence(double positionX, double positionY);
+   int SendXYStageSequence();
+
+   // serpentine tile scan streamed as one job
+   int StartTileScan(double originXUm, double originYUm, double tileWidthUm, double tileHeightUm,
+      double overlap, long rows, long columns, double dwellMs);
+   int StopTileScan();
+   int GetTileScanProgress(long& tile, long& total);
+   bool IsScanRunning();
+   // blocks until the stage has stopped or GrblNowMs() reaches deadlineMs
+   int WaitForMotion(double deadlineMs);
+   // GrblNowMs() at which the queued moves will have finished, and at which
+   // a move to (xUm, yUm) queued after them would
+   int GetMotionEndMs(double& endMs);
+   int EstimateMoveEndMs(double xUm, double yUm, double& endMs);
+
+   // continuous rows with sync pulses every frame pitch
+   int StartFlyScan(double originXUm, double originYUm, double rowLengthUm, long rows, double rowPitchUm,
+      double framePitchUm, double framePeriodMs, std::vector<GrblFlyScanTrigger>& triggers);
+   int StopFlyScan();
 
    // action interface
    // ----------------
@@ -71,30 +100,52 @@ public:
    int OnAcceleration(MM::PropertyBase* pProp, MM::ActionType eAct);
    int OnMoveTimeout(MM::PropertyBase* pProp, MM::ActionType eAct);
    int OnSyncStep(MM::PropertyBase* pProp, MM::ActionType eAct);   
+   int OnSequenceDwell(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnTileScanParameter(MM::PropertyBase* pProp, MM::ActionType eAct, long index);
+   int OnTileScan(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnTileScanProgress(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnTileScanCurrentTile(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnFlyScanParameter(MM::PropertyBase* pProp, MM::ActionType eAct, long index);
+   int OnFlyScan(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnFlyScanTriggerFile(MM::PropertyBase* pProp, MM::ActionType eAct);
    int SetPositionUm(double x, double y);
    int SetRelativePositionUm(double dx, double dy);
    int GetPositionUm(double& x, double& y);
+   // where the stage was at timeMs (GrblNowMs), from the reported positions
+   int GetPositionAtUm(double timeMs, double& x, double& y);
 private:
    
    enum Axis {X, Y};
+   enum TileScanParameter {TILE_ORIGIN_X, TILE_ORIGIN_Y, TILE_WIDTH, TILE_HEIGHT, TILE_OVERLAP,
+      TILE_ROWS, TILE_COLUMNS, TILE_DWELL, TILE_PARAMETERS};
+   enum FlyScanParameter {FLY_ORIGIN_X, FLY_ORIGIN_Y, FLY_ROW_LENGTH, FLY_ROWS, FLY_ROW_PITCH,
+      FLY_FRAME_PITCH, FLY_FRAME_PERIOD, FLY_PARAMETERS};
 
    int MoveBlocking(long x, long y, bool relative = false);
+   int MoveSteps(long x, long y, bool relative);
+   void GetStepScale(GrblStepScale& scale);
    int SetCommand(const unsigned char* command, unsigned cmdLength);
    int GetCommand(unsigned char* answer, unsigned answerLength, double TimeoutMs);
+   int StartScan(GrblScanSource* source);
+   int StopScan();
 
    double syncStep_;
-   class CommandThread;
+   class ScanThread;
 
    bool initialized_;            // true if the device is intitalized
    bool home_;                   // true if stage is homed
    double answerTimeoutMs_;      // max wait for the device to answer
-   double moveTimeoutMs_;        // max wait for stage to finish moving
-  
-   enum MOVE_MODE {MOVE, MOVEREL, HOME};
-   MOVE_MODE lastMode_;
+   double moveTimeoutMs_;        // max wait for stage to finish moving beyond the estimate
 
    std::vector<double> *  parameters_;
-   CommandThread* cmdThread_;    // thread used to execute move commands
+   GrblSeqLock<GrblStepScale> stepScale_;  // from parameters_, in steps
+   ScanThread* scanThread_;      // thread streaming a sequence or tile scan
+   std::vector<std::pair<double, double> > sequence_;      // positions in um
+   std::vector<std::pair<double, double> > sentSequence_;  // run by StartXYStageSequence
+   double sequenceDwellMs_;
+   double tileScan_[TILE_PARAMETERS];
+   double flyScan_[FLY_PARAMETERS];
+   std::string flyScanTriggerFile_;
 };
 
 #endif //_XYSTAGE_H_
@@ -0,0 +1,261 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          AsioClientBenchmark.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Write throughput of AsioClient against a pseudo terminal, and
+//                the io_service handlers it runs per G-code line, one JSON
+//                object per line:
+//                   {"benchmark":"asio_write","mode":"burst","lines":...,"bytes_per_line":...,
+//                    "bytes_per_s":...,"handlers_per_line":...}
+//                Build it with the Makefile in this directory (needs boost).
+// LICENSE:       LGPL
+//
+
+#include "../../../MMDevice/DeviceUtils.h"
+#include "../../../MMDevice/DeviceThreads.h"
+#include "../GrblPrimitives.h"
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#include <boost/bind.hpp>
+#include <boost/asio.hpp>
+#include <boost/asio/serial_port.hpp>
+#include <boost/thread.hpp>
+#include <boost/array.hpp>
+#include <boost/lexical_cast.hpp>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+// what AsioClient needs of the serial port device adapter that owns it
+class SerialPort
+{
+public:
+   SerialPort(bool verbose) : verbose_(verbose) {}
+
+   int LogMessage(const char* msg, bool debugOnly = false) const
+   {
+      if (verbose_ || !debugOnly)
+         fprintf(stderr, "%s\n", msg);
+      return 0;
+   }
+
+private:
+   bool verbose_;
+};
+
+#include "../AsioClient.h"
+
+namespace {
+
+// a move line as the stage writes it
+const char* g_line = "G1X12.345Y-6.789F1000\n";
+
+///////////////////////////////////////////////////////////////////////////////
+// Service class
+// (runs the io service and counts the handlers it has run)
+///////////////////////////////////////////////////////////////////////////////
+
+class Service : public MMDeviceThreadBase
+{
+   public:
+      Service(boost::asio::io_service& io) : io_(io), handlers_(0) {}
+
+      int svc()
+      {
+         while (io_.run_one() > 0)
+            GrblAtomicIncrement(&handlers_);
+         return 0;
+      }
+      long GetHandlers() {return GrblAtomicLoad(&handlers_);}
+
+   private:
+      boost::asio::io_service& io_;
+      volatile long handlers_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Drain class
+// (reads the master side of the pty until the expected bytes have arrived)
+///////////////////////////////////////////////////////////////////////////////
+
+class Drain : public MMDeviceThreadBase
+{
+   public:
+      Drain(int fd, long expected) : fd_(fd), expected_(expected), received_(0), finishedNs_(0) {}
+
+      int svc()
+      {
+         char buff[4096];
+         while (GrblAtomicLoad(&received_) < expected_)
+         {
+            struct pollfd pfd = {fd_, POLLIN, 0};
+            // the client has stopped writing
+            if (poll(&pfd, 1, 5000) <= 0)
+               return 0;
+            ssize_t n = read(fd_, buff, sizeof(buff));
+            if (n <= 0)
+               return 0;
+            GrblAtomicAdd(&received_, (long) n);
+         }
+         finishedNs_ = GrblNowNs();
+         return 0;
+      }
+      long GetReceived() {return GrblAtomicLoad(&received_);}
+      bool Complete() {return GetReceived() == expected_;}
+      unsigned long long GetFinishedNs() const {return finishedNs_;}
+
+   private:
+      int fd_;
+      long expected_;
+      volatile long received_;
+      unsigned long long finishedNs_;
+};
+
+} // namespace
+
+// Writes the same move line many times through WriteCharactersAsynchronously.
+// In burst mode the lines are written back to back, as when a program is
+// streamed; in paced mode each line is written once the previous one has
+// arrived, as the hub does for single commands, so that every line needs an
+// async_write of its own. The per-byte writes AsioClient had before ran two
+// handlers per byte, 44 for this line.
+class AsioClientBenchmark
+{
+public:
+   AsioClientBenchmark(long lines, bool verbose) : lines_(lines), port_(verbose) {}
+
+   int Run(std::ostream& out);
+
+private:
+   int RunMode(bool paced, std::ostream& out);
+
+   long lines_;
+   SerialPort port_;
+};
+
+int AsioClientBenchmark::Run(std::ostream& out)
+{
+   int ret = RunMode(false, out);
+   if (ret != 0)
+      return ret;
+   return RunMode(true, out);
+}
+
+int AsioClientBenchmark::RunMode(bool paced, std::ostream& out)
+{
+   int master = posix_openpt(O_RDWR | O_NOCTTY);
+   if (master < 0)
+      return 1;
+   if (grantpt(master) != 0 || unlockpt(master) != 0)
+   {
+      close(master);
+      return 1;
+   }
+   struct termios tio;
+   tcgetattr(master, &tio);
+   cfmakeraw(&tio);
+   tcsetattr(master, TCSANOW, &tio);
+   std::string device = ptsname(master);
+
+   const int length = (int) strlen(g_line);
+   boost::asio::io_service io;
+   boost::asio::io_service::work* work = new boost::asio::io_service::work(io);
+   AsioClient* client = new AsioClient(io, 115200, device,
+      boost::asio::serial_port_base::flow_control::none,
+      boost::asio::serial_port_base::parity::none,
+      boost::asio::serial_port_base::stop_bits::one,
+      &port_);
+   Service service(io);
+   service.activate();
+   Drain drain(master, length * lines_);
+   drain.activate();
+
+   long handlers = service.GetHandlers();
+   unsigned long long startNs = GrblNowNs();
+   for (long i = 0; i < lines_; ++i)
+   {
+      long before = service.GetHandlers();
+      client->WriteCharactersAsynchronously(g_line, length);
+      if (paced)
+      {
+         // the line has arrived and the completion of its write has run,
+         // which is the second handler after the one that started it
+         while (drain.GetReceived() < length * (i + 1) || service.GetHandlers() < before + 2)
+            CDeviceUtils::SleepMs(0);
+      }
+   }
+   drain.wait();
+   unsigned long long finishedNs = drain.GetFinishedNs();
+   // lets the completion of the last write run
+   CDeviceUtils::SleepMs(20);
+   handlers = service.GetHandlers() - handlers;
+
+   client->ShutDownInProgress(true);
+   client->Close();
+   delete work;
+   service.wait();
+   delete client;
+   close(master);
+   if (!drain.Complete())
+      return 1;
+
+   double seconds = (finishedNs - startNs) / 1e9;
+   out << "{\"benchmark\":\"asio_write\""
+       << ",\"mode\":\"" << (paced ? "paced" : "burst") << "\""
+       << ",\"lines\":" << lines_
+       << ",\"bytes_per_line\":" << length
+       << ",\"bytes_per_s\":" << (seconds > 0.0 ? length * lines_ / seconds : 0.0)
+       << ",\"handlers_per_line\":" << (double) handlers / lines_
+       << "}" << std::endl;
+   return 0;
+}
+
+int main(int argc, char* argv[])
+{
+   long lines = 10000;
+   const char* outFile = 0;
+   bool verbose = false;
+   for (int i = 1; i < argc; ++i)
+   {
+      if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+         lines = atol(argv[++i]);
+      else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+         outFile = argv[++i];
+      else if (strcmp(argv[i], "-v") == 0)
+         verbose = true;
+      else
+      {
+         fprintf(stderr, "usage: %s [-n <lines per run>] [-o <output file>] [-v]\n", argv[0]);
+         return 2;
+      }
+   }
+   if (lines <= 0)
+   {
+      fprintf(stderr, "%s: the number of lines must be positive\n", argv[0]);
+      return 2;
+   }
+
+   AsioClientBenchmark benchmark(lines, verbose);
+   int ret;
+   if (outFile)
+   {
+      std::ofstream out(outFile);
+      ret = out ? benchmark.Run(out) : 1;
+   }
+   else
+      ret = benchmark.Run(std::cout);
+   if (ret != 0)
+   {
+      fprintf(stderr, "%s: failed\n", argv[0]);
+      return 1;
+   }
+   return 0;
+}
@@ -0,0 +1,635 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblBenchmark.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Throughput and latency measurements of the hub and the XY
+//                stage on the simulator transport, one JSON object per line:
+//                   {"benchmark":"send_command","threads":2,"ops":...,"ops_per_s":...,
+//                    "p50_us":...,"p90_us":...,"p99_us":...,"max_us":...}
+//                Build it with the Makefile in this directory.
+// LICENSE:       LGPL
+//
+
+#include "GrblToolCore.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+// Runs each operation from 1, 2, 4 and 8 threads at once for a fixed time.
+// The operations are SendCommand round trips, SetPositionUm moves and
+// GetStatus polls. The status report parse is timed single-threaded, with
+// the tokenizing parse the hub used before as the baseline, and so is the
+// encoding of move lines, with their size in bytes_per_line. The reply
+// timeout of a command is timed both ways: set on the port's AnswerTimeout
+// property through the core, as the hub did for every command before, and
+// taken from the command itself.
+// Last, '?', '!' and '~' are timed from the call to their TX record in the
+// traffic recorder while a stream keeps the controller's receive buffer full.
+class GrblBenchmark
+{
+public:
+   enum Operation {SEND_COMMAND, MOVE, STATUS};
+
+   GrblBenchmark(CEVA_NDE_GrblHub* hub, XYStage* stage, GrblToolCore* core, double durationMs);
+
+   int Run(std::ostream& out);
+
+private:
+   class Worker;
+   class Stream;
+
+   int RunOperation(Operation op, int threads, std::ostream& out);
+   int RunRealtime(std::ostream& out);
+   int MeasureRealtime(const char* commands, int count, std::vector<double>* latenciesUs, long& unmatched);
+   int RunParse(std::ostream& out);
+   int RunEncode(std::ostream& out);
+   int RunTimeout(std::ostream& out);
+   int Execute(Operation op, int thread, long iteration);
+   static const char* GetOperationName(Operation op);
+   static double Percentile(const std::vector<double>& sorted, double p);
+
+   CEVA_NDE_GrblHub* hub_;
+   XYStage* stage_;
+   GrblToolCore* core_;
+   double durationMs_;
+   double originUm_[2];
+};
+
+namespace {
+
+// written by the traffic recorder of the hub for the realtime benchmark
+const char* g_trafficFile = "GrblBenchmark-traffic.bin";
+const char* g_portLabel = "BenchmarkPort";
+
+// A port device as far as the hub used it before commands carried their
+// timeout: an AnswerTimeout property with a handler, like the serial ports
+// of Micro-Manager have
+class AnswerTimeoutPort : public CGenericBase<AnswerTimeoutPort>
+{
+public:
+   AnswerTimeoutPort() : answerTimeoutMs_(2000.0) {}
+
+   int Initialize()
+   {
+      CPropertyAction* pAct = new CPropertyAction(this, &AnswerTimeoutPort::OnAnswerTimeout);
+      return CreateProperty("AnswerTimeout", CDeviceUtils::ConvertToString(answerTimeoutMs_), MM::Float, false, pAct);
+   }
+   int Shutdown() {return DEVICE_OK;}
+   void GetName(char* name) const {CDeviceUtils::CopyLimitedString(name, g_portLabel);}
+   bool Busy() {return false;}
+
+   int OnAnswerTimeout(MM::PropertyBase* pProp, MM::ActionType eAct)
+   {
+      if (eAct == MM::BeforeGet)
+         pProp->Set(answerTimeoutMs_);
+      else if (eAct == MM::AfterSet)
+         pProp->Get(answerTimeoutMs_);
+      return DEVICE_OK;
+   }
+
+private:
+   double answerTimeoutMs_;
+};
+
+template <class Type>
+Type stringToNum(const std::string& str)
+{
+   std::istringstream iss(str);
+   Type num;
+   iss >> num;
+   return num;
+}
+
+// the status parse of the hub before ParseGrblStatusReport, kept as the
+// baseline of the parse_status benchmark
+bool LegacyParseStatusReport(const std::string& returnString, GrblStatusReport& report)
+{
+   std::vector<std::string> tokenInput;
+   CDeviceUtils::Tokenize(returnString, tokenInput, "<>,:\r\n");
+   //sample: <Idle,MPos:0.000,0.000,0.000,WPos:0.000,0.000,0.000>
+   if (tokenInput.size() != 9)
+      return false;
+   std::string status;
+   status.assign(tokenInput[0].c_str());
+   CDeviceUtils::CopyLimitedString(report.status, status.substr(0, sizeof(report.status) - 1).c_str());
+   report.MPos[0] = stringToNum<double>(tokenInput[2]);
+   report.MPos[1] = stringToNum<double>(tokenInput[3]);
+   report.MPos[2] = stringToNum<double>(tokenInput[4]);
+   report.WPos[0] = stringToNum<double>(tokenInput[6]);
+   report.WPos[1] = stringToNum<double>(tokenInput[7]);
+   report.WPos[2] = stringToNum<double>(tokenInput[8]);
+   return true;
+}
+
+} // namespace
+
+///////////////////////////////////////////////////////////////////////////////
+// Worker class
+// (repeats one operation until the deadline, timing each call)
+///////////////////////////////////////////////////////////////////////////////
+
+class GrblBenchmark::Worker : public MMDeviceThreadBase
+{
+   public:
+      Worker(GrblBenchmark* benchmark, Operation op, int thread, double deadlineMs) :
+         benchmark_(benchmark), op_(op), thread_(thread), deadlineMs_(deadlineMs), errCode_(DEVICE_OK) {}
+
+      int svc()
+      {
+         for (long i = 0; GrblNowMs() < deadlineMs_; ++i)
+         {
+            double start = GrblNowMs();
+            errCode_ = benchmark_->Execute(op_, thread_, i);
+            if (errCode_ != DEVICE_OK)
+               break;
+            latenciesUs_.push_back(1000.0 * (GrblNowMs() - start));
+         }
+         return 0;
+      }
+      int GetErrorCode() const {return errCode_;}
+      const std::vector<double>& GetLatenciesUs() const {return latenciesUs_;}
+
+   private:
+      GrblBenchmark* benchmark_;
+      Operation op_;
+      int thread_;
+      double deadlineMs_;
+      int errCode_;
+      std::vector<double> latenciesUs_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Stream class
+// (streams short relative moves until stopped, so that the receive buffer
+// of the controller stays full)
+///////////////////////////////////////////////////////////////////////////////
+
+class GrblBenchmark::Stream : public MMDeviceThreadBase, private GrblLineSource
+{
+   public:
+      Stream(CEVA_NDE_GrblHub* hub) : hub_(hub), stop_(0), lines_(0), errCode_(DEVICE_OK) {}
+
+      int svc()
+      {
+         errCode_ = hub_->StreamCommands(*this);
+         return 0;
+      }
+      void Stop() {GrblAtomicStore(&stop_, 1);}
+      int GetErrorCode() const {return errCode_;}
+
+   private:
+      bool NextLine(std::string& line)
+      {
+         if (GrblAtomicLoad(&stop_))
+         {
+            if (lines_ < 0)
+               return false;
+            line = "G90";
+            lines_ = -1;
+            return true;
+         }
+         // back and forth, ending where it started
+         line = (lines_++ & 1) ? "G91G1X-0.01F600" : "G91G1X0.01F600";
+         return true;
+      }
+
+      CEVA_NDE_GrblHub* hub_;
+      volatile long stop_;
+      long lines_;
+      int errCode_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// GrblBenchmark implementation
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+
+GrblBenchmark::GrblBenchmark(CEVA_NDE_GrblHub* hub, XYStage* stage, GrblToolCore* core, double durationMs) :
+   hub_(hub),
+   stage_(stage),
+   core_(core),
+   durationMs_(durationMs)
+{
+   originUm_[0] = 0.0;
+   originUm_[1] = 0.0;
+}
+
+int GrblBenchmark::Run(std::ostream& out)
+{
+   int ret = stage_->GetPositionUm(originUm_[0], originUm_[1]);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   ret = RunParse(out);
+   if (ret != DEVICE_OK)
+      return ret;
+   ret = RunEncode(out);
+   if (ret != DEVICE_OK)
+      return ret;
+   ret = RunTimeout(out);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   const Operation ops[] = {SEND_COMMAND, MOVE, STATUS};
+   for (int i = 0; i < 3; ++i)
+   {
+      for (int threads = 1; threads <= 8; threads *= 2)
+      {
+         ret = RunOperation(ops[i], threads, out);
+         if (ret != DEVICE_OK)
+            return ret;
+      }
+   }
+   return RunRealtime(out);
+}
+
+int GrblBenchmark::RunOperation(Operation op, int threads, std::ostream& out)
+{
+   std::vector<Worker*> workers;
+   double start = GrblNowMs();
+   for (int i = 0; i < threads; ++i)
+   {
+      workers.push_back(new Worker(this, op, i, start + durationMs_));
+      workers.back()->activate();
+   }
+
+   int ret = DEVICE_OK;
+   std::vector<double> latencies;
+   for (int i = 0; i < threads; ++i)
+   {
+      workers[i]->wait();
+      if (workers[i]->GetErrorCode() != DEVICE_OK)
+         ret = workers[i]->GetErrorCode();
+      const std::vector<double>& l = workers[i]->GetLatenciesUs();
+      latencies.insert(latencies.end(), l.begin(), l.end());
+      delete workers[i];
+   }
+   double elapsedMs = GrblNowMs() - start;
+
+   // leave the stage at rest where it started before the next run
+   if (op == MOVE)
+   {
+      std::string reply;
+      int drained = hub_->SendCommand(GrblCommand("G4P0", 60000.0), reply);
+      if (ret == DEVICE_OK)
+         ret = drained;
+   }
+   if (ret != DEVICE_OK)
+      return ret;
+
+   std::sort(latencies.begin(), latencies.end());
+   out << "{\"benchmark\":\"" << GetOperationName(op) << "\""
+       << ",\"threads\":" << threads
+       << ",\"ops\":" << latencies.size()
+       << ",\"ops_per_s\":" << 1000.0 * latencies.size() / elapsedMs
+       << ",\"p50_us\":" << Percentile(latencies, 0.50)
+       << ",\"p90_us\":" << Percentile(latencies, 0.90)
+       << ",\"p99_us\":" << Percentile(latencies, 0.99)
+       << ",\"max_us\":" << (latencies.empty() ? 0.0 : latencies.back())
+       << "}" << std::endl;
+   return DEVICE_OK;
+}
+
+// time from SendRealtime to the TX record of the character, which the hub
+// writes right after the transport has taken it, with a stream in flight
+int GrblBenchmark::RunRealtime(std::ostream& out)
+{
+   const char commands[] = {GRBL_RT_STATUS, GRBL_RT_FEED_HOLD, GRBL_RT_CYCLE_START};
+   const char* names[] = {"status", "feed_hold", "cycle_start"};
+
+   // the status poller would write '?' of its own
+   char pollInterval[MM::MaxStrLength];
+   int ret = hub_->GetProperty("StatusPollIntervalMs", pollInterval);
+   if (ret == DEVICE_OK)
+      ret = hub_->SetProperty("StatusPollIntervalMs", "0");
+   if (ret == DEVICE_OK)
+      ret = hub_->SetProperty("TrafficFile", g_trafficFile);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   Stream stream(hub_);
+   stream.activate();
+   // until the receive buffer has filled up
+   CDeviceUtils::SleepMs(200);
+
+   std::vector<double> latenciesUs[3];
+   long unmatched = 0;
+   double start = GrblNowMs();
+   while (ret == DEVICE_OK && GrblNowMs() < start + durationMs_)
+   {
+      // batches small enough that the recorder keeps all of their records
+      ret = MeasureRealtime(commands, 16, latenciesUs, unmatched);
+   }
+   stream.Stop();
+   stream.wait();
+   remove(g_trafficFile);
+   hub_->SetProperty("StatusPollIntervalMs", pollInterval);
+   if (ret == DEVICE_OK)
+      ret = stream.GetErrorCode();
+   if (ret != DEVICE_OK)
+      return ret;
+
+   for (int i = 0; i < 3; ++i)
+   {
+      std::vector<double>& latencies = latenciesUs[i];
+      std::sort(latencies.begin(), latencies.end());
+      out << "{\"benchmark\":\"realtime\""
+          << ",\"command\":\"" << names[i] << "\""
+          << ",\"threads\":1"
+          << ",\"ops\":" << latencies.size()
+          << ",\"unmatched\":" << unmatched
+          << ",\"p50_us\":" << Percentile(latencies, 0.50)
+          << ",\"p90_us\":" << Percentile(latencies, 0.90)
+          << ",\"p99_us\":" << Percentile(latencies, 0.99)
+          << ",\"max_us\":" << (latencies.empty() ? 0.0 : latencies.back())
+          << "}" << std::endl;
+   }
+   return DEVICE_OK;
+}
+
+// sends each of the three commands count times, then pairs every call with
+// the first TX record of its character recorded after it; calls whose
+// record has already been overwritten are counted in unmatched
+int GrblBenchmark::MeasureRealtime(const char* commands, int count, std::vector<double>* latenciesUs, long& unmatched)
+{
+   std::vector<std::pair<int, unsigned long long> > calls;
+   for (int n = 0; n < count; ++n)
+   {
+      for (int i = 0; i < 3; ++i)
+      {
+         unsigned long long callNs = GrblNowNs();
+         int ret = hub_->SendRealtime(commands[i]);
+         if (ret != DEVICE_OK)
+            return ret;
+         calls.push_back(std::make_pair(i, callNs));
+         // lets a hold take effect before the motion is resumed
+         CDeviceUtils::SleepMs(2);
+      }
+   }
+
+   int ret = hub_->SetProperty("TrafficDump", "Write");
+   if (ret != DEVICE_OK)
+      return ret;
+   std::vector<GrblTraceRecord> records;
+   FILE* fp = fopen(g_trafficFile, "rb");
+   if (!fp)
+      return DEVICE_ERR;
+   GrblTraceHeader header;
+   if (fread(&header, sizeof(header), 1, fp) == 1 && header.recordSize == sizeof(GrblTraceRecord) &&
+      header.recordCount > 0)
+   {
+      records.resize(header.recordCount);
+      records.resize(fread(&records[0], sizeof(GrblTraceRecord), header.recordCount, fp));
+   }
+   fclose(fp);
+
+   // the oldest calls are lost once the ring has wrapped around during the batch
+   if (records.empty() || records[0].timestampNs > calls[0].second)
+   {
+      unmatched += (long) calls.size();
+      return DEVICE_OK;
+   }
+   // the records are in the order of the calls
+   size_t next[3] = {0, 0, 0};
+   for (size_t k = 0; k < calls.size(); ++k)
+   {
+      int i = calls[k].first;
+      size_t& r = next[i];
+      for (; r < records.size(); ++r)
+      {
+         const GrblTraceRecord& record = records[r];
+         if (record.type == GrblTraceRecord::TX && record.length == 1 && record.data[0] == commands[i] &&
+            record.timestampNs >= calls[k].second)
+            break;
+      }
+      if (r == records.size())
+      {
+         ++unmatched;
+         continue;
+      }
+      latenciesUs[i].push_back((records[r].timestampNs - calls[k].second) / 1000.0);
+      ++r;
+   }
+   return DEVICE_OK;
+}
+
+// cost of turning a received status line into a snapshot, without any I/O,
+// for the single-pass parser and the tokenizing parse it replaced
+int GrblBenchmark::RunParse(std::ostream& out)
+{
+   const std::string frame = "<Idle,MPos:12.345,-6.789,0.000,WPos:12.345,-6.789,0.000>\r\n";
+   const char* begin = frame.c_str();
+   const char* end = begin + frame.length();
+   const long iterations = 100000;
+
+   for (int parser = 0; parser < 2; ++parser)
+   {
+      GrblStatusReport report;
+      double start = GrblNowMs();
+      for (long i = 0; i < iterations; ++i)
+      {
+         bool parsed = parser == 0 ? LegacyParseStatusReport(frame, report) :
+            ParseGrblStatusReport(begin, end, report);
+         if (!parsed)
+            return DEVICE_ERR;
+      }
+      double elapsedMs = GrblNowMs() - start;
+      out << "{\"benchmark\":\"parse_status\""
+          << ",\"parser\":\"" << (parser == 0 ? "tokenize" : "single_pass") << "\""
+          << ",\"threads\":1"
+          << ",\"ops\":" << iterations
+          << ",\"ns_per_report\":" << 1000000.0 * elapsedMs / iterations
+          << "}" << std::endl;
+   }
+   return DEVICE_OK;
+}
+
+// cost and size of a move line, formatted with printf as before and
+// quantized to steps and written by the decimal encoder
+int GrblBenchmark::RunEncode(std::ostream& out)
+{
+   if (hub_->parameters.size() <= 12)
+      return DEVICE_ERR;
+   GrblStepScale scale;
+   scale.stepsPerMm[0] = hub_->parameters[0];
+   scale.stepsPerMm[1] = hub_->parameters[1];
+   scale.decimals = (int) hub_->parameters[12];
+   if (scale.decimals < 0 || scale.decimals > 9)
+      return DEVICE_ERR;
+
+   // positions spread over the travel range, the same for both encoders
+   const long iterations = 100000;
+   std::vector<double> positionsUm(2 * 1024);
+   unsigned long seed = 12345;
+   for (size_t i = 0; i < positionsUm.size(); ++i)
+   {
+      seed = seed * 1103515245UL + 12345UL;
+      positionsUm[i] = ((seed >> 8) & 0xffff) * (110000.0 / 0xffff);
+   }
+
+   for (int encoder = 0; encoder < 2; ++encoder)
+   {
+      char buff[64];
+      unsigned long bytes = 0;
+      double start = GrblNowMs();
+      for (long i = 0; i < iterations; ++i)
+      {
+         double x = positionsUm[(2 * i) & 2047];
+         double y = positionsUm[(2 * i + 1) & 2047];
+         if (encoder == 0)
+            bytes += sprintf(buff, "G00X%fY%f", x / 1000.0, y / 1000.0);
+         else
+         {
+            memcpy(buff, "G0", 2);
+            bytes += 2 + scale.EncodeAxes(scale.ToSteps(0, x), scale.ToSteps(1, y), buff + 2);
+         }
+      }
+      double elapsedMs = GrblNowMs() - start;
+      out << "{\"benchmark\":\"encode_move\""
+          << ",\"encoder\":\"" << (encoder == 0 ? "printf" : "decimal") << "\""
+          << ",\"threads\":1"
+          << ",\"ops\":" << iterations
+          << ",\"ns_per_op\":" << 1000000.0 * elapsedMs / iterations
+          << ",\"bytes_per_line\":" << (double) bytes / iterations + 1.0   // and the newline
+          << "}" << std::endl;
+   }
+   return DEVICE_OK;
+}
+
+// the per-command cost of the reply timeout, without any I/O. The core of
+// this tool passes the property straight on to the port device; the
+// Micro-Manager core also locks the device and notifies the GUI, so the
+// port_property figure is a lower bound.
+int GrblBenchmark::RunTimeout(std::ostream& out)
+{
+   const char* lines[] = {"G90G1X12.5Y-.004F600", "$$", "?", "$H"};
+   const long iterations = 100000;
+
+   AnswerTimeoutPort port;
+   port.SetLabel(g_portLabel);
+   int ret = port.Initialize();
+   if (ret != DEVICE_OK)
+      return ret;
+   core_->SetPort(&port);
+
+   for (int path = 0; path < 2; ++path)
+   {
+      double sum = 0.0;
+      double start = GrblNowMs();
+      for (long i = 0; i < iterations && ret == DEVICE_OK; ++i)
+      {
+         GrblCommand command(lines[i & 3]);
+         if (path == 0)
+            ret = core_->SetDeviceProperty(g_portLabel, "AnswerTimeout", CDeviceUtils::ConvertToString(command.timeoutMs));
+         else
+            sum += command.timeoutMs;
+      }
+      double elapsedMs = GrblNowMs() - start;
+      if (ret != DEVICE_OK)
+         break;
+      out << "{\"benchmark\":\"answer_timeout\""
+          << ",\"path\":\"" << (path == 0 ? "port_property" : "command_deadline") << "\""
+          << ",\"threads\":1"
+          << ",\"ops\":" << iterations
+          << ",\"ns_per_command\":" << 1000000.0 * elapsedMs / iterations
+          << "}" << std::endl;
+      // keeps the loop from being optimized away
+      if (sum < 0.0)
+         ret = DEVICE_ERR;
+   }
+   core_->SetPort(0);
+   return ret;
+}
+
+int GrblBenchmark::Execute(Operation op, int thread, long iteration)
+{
+   std::string reply;
+   switch (op)
+   {
+      case SEND_COMMAND:
+         // acknowledged at once by an idle controller
+         return hub_->SendCommand(GrblCommand("G4P0"), reply);
+      case MOVE:
+      {
+         // short hops next to the start so the planner stays busy
+         double offset = ((iteration + thread) & 1) ? 5.0 : 0.0;
+         return stage_->SetPositionUm(originUm_[0] + offset, originUm_[1] + offset);
+      }
+      case STATUS:
+         return hub_->GetStatus();
+   }
+   return DEVICE_ERR;
+}
+
+const char* GrblBenchmark::GetOperationName(Operation op)
+{
+   switch (op)
+   {
+      case SEND_COMMAND: return "send_command";
+      case MOVE: return "move";
+      case STATUS: return "get_status";
+   }
+   return "unknown";
+}
+
+double GrblBenchmark::Percentile(const std::vector<double>& sorted, double p)
+{
+   if (sorted.empty())
+      return 0.0;
+   return sorted[(size_t) (p * (sorted.size() - 1) + 0.5)];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// main
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char* argv[])
+{
+   double durationMs = 1000.0;
+   long baud = 115200;
+   const char* outFile = 0;
+   bool verbose = false;
+   for (int i = 1; i < argc; ++i)
+   {
+      if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+         durationMs = atof(argv[++i]);
+      else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+         baud = atol(argv[++i]);
+      else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+         outFile = argv[++i];
+      else if (strcmp(argv[i], "-v") == 0)
+         verbose = true;
+      else
+      {
+         fprintf(stderr, "usage: %s [-d <ms per run>] [-b <simulated baud rate>] [-o <output file>] [-v]\n", argv[0]);
+         return 2;
+      }
+   }
+
+   GrblSimulatedRig rig;
+   rig.core.SetVerbose(verbose);
+   int ret = rig.Initialize(baud);
+   if (ret == DEVICE_OK)
+   {
+      GrblBenchmark benchmark(&rig.hub, &rig.stage, &rig.core, durationMs);
+      if (outFile)
+      {
+         std::ofstream out(outFile);
+         ret = out ? benchmark.Run(out) : DEVICE_ERR;
+      }
+      else
+         ret = benchmark.Run(std::cout);
+   }
+   rig.Shutdown();
+   if (ret != DEVICE_OK)
+   {
+      fprintf(stderr, "%s: failed with error %d\n", argv[0], ret);
+      return 1;
+   }
+   return 0;
+}
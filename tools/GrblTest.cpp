@@ -0,0 +1,865 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblTest.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Regression tests of the protocol helpers, the histograms,
+//                the position history, the motion model, the command queue,
+//                and the hub, the scan generators and the stage on the
+//                simulator transport. Prints each failed check and exits
+//                with 1 if there was any.
+//                Build and run it with make check in this directory.
+// LICENSE:       LGPL
+//
+
+#include "GrblToolCore.h"
+#include "../GrblScan.h"
+#include "../GrblDetector.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+
+int g_checks = 0;
+int g_failures = 0;
+
+#define CHECK(condition) \
+   do { \
+      ++g_checks; \
+      if (!(condition)) \
+      { \
+         ++g_failures; \
+         fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+      } \
+   } while (0)
+
+#define CHECK_EQUAL(expected, actual) \
+   do { \
+      ++g_checks; \
+      if (!((expected) == (actual))) \
+      { \
+         ++g_failures; \
+         fprintf(stderr, "%s:%d: CHECK_EQUAL(%s, %s) failed\n", __FILE__, __LINE__, #expected, #actual); \
+      } \
+   } while (0)
+
+bool Near(double expected, double actual)
+{
+   return fabs(expected - actual) < 1e-6;
+}
+
+std::string Decimal(long long scaled, int decimals)
+{
+   char buff[32];
+   unsigned length = FormatGrblDecimal(scaled, decimals, buff);
+   return std::string(buff, length);
+}
+
+bool Parse(const char* report, GrblStatusReport& parsed)
+{
+   return ParseGrblStatusReport(report, report + strlen(report), parsed);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// protocol helpers
+///////////////////////////////////////////////////////////////////////////////
+
+void TestFormatGrblDecimal()
+{
+   CHECK_EQUAL(std::string("12.5"), Decimal(12500, 3));
+   CHECK_EQUAL(std::string("-.5"), Decimal(-500, 3));
+   CHECK_EQUAL(std::string(".004"), Decimal(4, 3));
+   CHECK_EQUAL(std::string("0"), Decimal(0, 3));
+   CHECK_EQUAL(std::string("1"), Decimal(1000, 3));
+   CHECK_EQUAL(std::string("-250"), Decimal(-250, 0));
+   CHECK_EQUAL(std::string("-123.456789"), Decimal(-123456789, 6));
+   CHECK_EQUAL(std::string(".000000001"), Decimal(1, 9));
+   CHECK_EQUAL(std::string("-9223372036.854775808"), Decimal(-9223372036854775807LL - 1, 9));
+}
+
+void TestParseStatusReport()
+{
+   GrblStatusReport report;
+   CHECK(Parse("<Idle,MPos:1.000,-2.500,0.000,WPos:0.500,-3.000,12.345>", report));
+   CHECK_EQUAL(std::string("Idle"), std::string(report.status));
+   CHECK(Near(1.0, report.MPos[0]));
+   CHECK(Near(-2.5, report.MPos[1]));
+   CHECK(Near(0.0, report.MPos[2]));
+   CHECK(Near(0.5, report.WPos[0]));
+   CHECK(Near(-3.0, report.WPos[1]));
+   CHECK(Near(12.345, report.WPos[2]));
+
+   CHECK(Parse("<Run,MPos:.5,-.25,3,WPos:.5,-.25,3>\r\n", report));
+   CHECK_EQUAL(std::string("Run"), std::string(report.status));
+   CHECK(Near(-0.25, report.MPos[1]));
+
+   CHECK(!Parse("", report));
+   CHECK(!Parse("ok", report));
+   CHECK(!Parse("<Idle,MPos:1.000,2.000,3.000,WPos:1.000,2.000,3.000", report));
+   CHECK(!Parse("<Idle,MPos:1.000,2.000,WPos:1.000,2.000,3.000>", report));
+   CHECK(!Parse("<Idle,MPos:1.000,x,3.000,WPos:1.000,2.000,3.000>", report));
+   CHECK(!Parse("<Idle,WPos:1.000,2.000,3.000,MPos:1.000,2.000,3.000>", report));
+}
+
+void TestModalState()
+{
+   GrblModalState state;
+   // nothing is known yet, every modal word is sent
+   CHECK_EQUAL(std::string("G21G90G0X1Y2"),
+      state.Encode(GrblModalState::ABSOLUTE_DISTANCE, GrblModalState::RAPID, "X1Y2"));
+   state.Observe("G21G90G0X1Y2");
+   CHECK_EQUAL(GrblModalState::MILLIMETERS, state.GetUnits());
+   CHECK_EQUAL(GrblModalState::ABSOLUTE_DISTANCE, state.GetDistance());
+   CHECK_EQUAL(GrblModalState::RAPID, state.GetMotion());
+
+   // then only the words that differ from what the controller has
+   CHECK_EQUAL(std::string("X3"), state.Encode(GrblModalState::ABSOLUTE_DISTANCE, GrblModalState::RAPID, "X3"));
+   CHECK_EQUAL(std::string("G1X3F100.000"),
+      state.Encode(GrblModalState::ABSOLUTE_DISTANCE, GrblModalState::LINEAR, "X3", 100.0));
+   state.Observe("G1X3F100.000");
+   CHECK(Near(100.0, state.GetFeed()));
+   CHECK_EQUAL(std::string("G91X1"),
+      state.Encode(GrblModalState::RELATIVE_DISTANCE, GrblModalState::LINEAR, "X1", 100.0));
+   // a feed that prints as the current one is left out
+   CHECK_EQUAL(std::string("X1"),
+      state.Encode(GrblModalState::ABSOLUTE_DISTANCE, GrblModalState::LINEAR, "X1", 100.0004));
+   CHECK_EQUAL(std::string("X1F120.000"),
+      state.Encode(GrblModalState::ABSOLUTE_DISTANCE, GrblModalState::LINEAR, "X1", 120.0));
+   CHECK_EQUAL(std::string("G0X1"),
+      state.Encode(GrblModalState::DISTANCE_UNKNOWN, GrblModalState::RAPID, "X1"));
+
+   // lower case words count, words in comments do not
+   state.Observe("g91 (G90 G0)");
+   CHECK_EQUAL(GrblModalState::RELATIVE_DISTANCE, state.GetDistance());
+   CHECK_EQUAL(GrblModalState::LINEAR, state.GetMotion());
+
+   // a feed set in inches is not known in millimetres
+   state.Observe("G20");
+   CHECK(state.GetFeed() < 0.0);
+   CHECK_EQUAL(std::string("G21X1F100.000"),
+      state.Encode(GrblModalState::RELATIVE_DISTANCE, GrblModalState::LINEAR, "X1", 100.0));
+
+   // arcs leave the motion mode unknown
+   state.Observe("G21G2X1Y1I1");
+   CHECK_EQUAL(GrblModalState::MOTION_UNKNOWN, state.GetMotion());
+   CHECK_EQUAL(std::string("G1X1F100.000"),
+      state.Encode(GrblModalState::RELATIVE_DISTANCE, GrblModalState::LINEAR, "X1", 100.0));
+
+   state.Invalidate();
+   CHECK_EQUAL(std::string("G21G90G0X1Y2"),
+      state.Encode(GrblModalState::ABSOLUTE_DISTANCE, GrblModalState::RAPID, "X1Y2"));
+}
+
+void TestSettingLines()
+{
+   CHECK(IsGrblSettingLine("$4=250"));
+   CHECK(IsGrblSettingLine("$12=3"));
+   CHECK(!IsGrblSettingLine("$$"));
+   CHECK(!IsGrblSettingLine("$H"));
+   CHECK(!IsGrblSettingLine("$=1"));
+   CHECK(!IsGrblSettingLine("$4"));
+   CHECK(!IsGrblSettingLine("G10L2P1X0"));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// histograms and the position history
+///////////////////////////////////////////////////////////////////////////////
+
+// the bound GetPercentileUs reports for a lone value below a much larger one
+double BucketUpperUs(double us)
+{
+   GrblLatencyHistogram histogram;
+   histogram.Record(us);
+   histogram.Record(1e9);
+   return histogram.GetPercentileUs(0.5);
+}
+
+void TestLatencyHistogram()
+{
+   GrblLatencyHistogram histogram;
+   CHECK_EQUAL(0L, histogram.GetCount());
+   CHECK(Near(0.0, histogram.GetPercentileUs(0.5)));
+
+   // exact below 16 us, then within 12.5% above the value
+   for (long us = 0; us < 16; ++us)
+      CHECK(Near((double) us, BucketUpperUs((double) us)));
+   bool bounded = true;
+   for (double us = 16.0; us < 1e8; us *= 1.37)
+   {
+      double upper = BucketUpperUs(floor(us));
+      bounded = bounded && upper >= floor(us) && upper <= 1.125 * floor(us);
+   }
+   CHECK(bounded);
+   // bucket edges: 100 lies in [96, 103], 104 opens the next bucket
+   CHECK(Near(103.0, BucketUpperUs(96.0)));
+   CHECK(Near(103.0, BucketUpperUs(100.0)));
+   CHECK(Near(111.0, BucketUpperUs(104.0)));
+
+   // a bound above everything recorded is cut to the maximum
+   histogram.Record(100.0);
+   CHECK(Near(100.0, histogram.GetPercentileUs(0.5)));
+   for (int i = 0; i < 98; ++i)
+      histogram.Record(10.0);
+   histogram.Record(5000.0);
+   CHECK_EQUAL(100L, histogram.GetCount());
+   CHECK(Near(10.0, histogram.GetPercentileUs(0.5)));
+   CHECK(Near(103.0, histogram.GetPercentileUs(0.99)));
+   CHECK(Near(5000.0, histogram.GetPercentileUs(1.0)));
+   CHECK_EQUAL(5000L, histogram.GetMaxUs());
+
+   // negative times count as 0, huge ones are clamped
+   histogram.Reset();
+   histogram.Record(-3.0);
+   CHECK(Near(0.0, histogram.GetPercentileUs(1.0)));
+   histogram.Record(1e12);
+   CHECK_EQUAL(0x7fffffffL, histogram.GetMaxUs());
+}
+
+GrblPositionSample Sample(double timeMs, double x)
+{
+   GrblPositionSample sample;
+   sample.timeMs = timeMs;
+   sample.MPos[0] = x;
+   sample.MPos[1] = -x;
+   sample.MPos[2] = 0.0;
+   return sample;
+}
+
+void TestPositionHistory()
+{
+   GrblPositionHistory history(3);
+   CHECK_EQUAL(4ul, history.GetCapacity());
+   double position[3];
+   CHECK(!history.GetPositionAt(0.0, position));
+
+   history.Add(Sample(10.0, 1.0));
+   CHECK(history.GetPositionAt(10.0, position));
+   CHECK(Near(1.0, position[0]));
+   history.Add(Sample(20.0, 2.0));
+   history.Add(Sample(30.0, 4.0));
+   CHECK(history.GetPositionAt(15.0, position));
+   CHECK(Near(1.5, position[0]));
+   CHECK(Near(-1.5, position[1]));
+   CHECK(history.GetPositionAt(25.0, position));
+   CHECK(Near(3.0, position[0]));
+   CHECK(history.GetPositionAt(30.0, position));
+   CHECK(Near(4.0, position[0]));
+   CHECK(!history.GetPositionAt(9.0, position));
+   CHECK(!history.GetPositionAt(31.0, position));
+
+   // a sample older than the newest is moved up to its time
+   history.Add(Sample(25.0, 5.0));
+   std::vector<GrblPositionSample> samples;
+   history.Export(samples);
+   CHECK_EQUAL(4u, samples.size());
+   if (samples.size() == 4)
+      CHECK(Near(30.0, samples[3].timeMs));
+
+   // the oldest samples are overwritten
+   history.Add(Sample(40.0, 6.0));
+   CHECK(!history.GetPositionAt(15.0, position));
+   CHECK(history.GetPositionAt(35.0, position));
+   CHECK(Near(5.5, position[0]));
+   history.Export(samples, 30.0);
+   CHECK_EQUAL(3u, samples.size());
+   history.Export(samples, 41.0);
+   CHECK(samples.empty());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// motion model
+///////////////////////////////////////////////////////////////////////////////
+
+void TestMoveEstimator()
+{
+   // the simulator's default settings
+   GrblMachineLimits limits;
+   GrblMoveEstimator estimator(limits);
+   double origin[2] = {0.0, 0.0};
+   double target[2] = {2.0, 0.0};
+
+   // 2 mm at 10 mm/s^2 never reaches 5 mm/s: 1 mm up and 1 mm down
+   estimator.Reset(origin);
+   estimator.AddMove(target, 1, false, false, 300.0);
+   CHECK(fabs(2000.0 * sqrt(2.0 * 1.0 / 10.0) - estimator.Plan()) < 0.1);
+
+   // 10 mm: 0.5 s up to 5 mm/s and down again, 7.5 mm at 5 mm/s
+   target[0] = 10.0;
+   estimator.Reset(origin);
+   estimator.AddMove(target, 1, false, false, 300.0);
+   double singleMs = estimator.Plan();
+   CHECK(fabs(2500.0 - singleMs) < 0.1);
+
+   // in two straight halves the junction is passed at full speed
+   target[0] = 5.0;
+   estimator.Reset(origin);
+   estimator.AddMove(target, 1, false, false, 300.0);
+   estimator.AddMove(target, 1, true, false, 300.0);
+   CHECK(fabs(singleMs - estimator.Plan()) < 0.1);
+   CHECK_EQUAL((size_t) 2, estimator.GetMoveCount());
+
+   // a right angle slows the stage down at the corner
+   double corner[2] = {0.0, 5.0};
+   estimator.Reset(origin);
+   estimator.AddMove(target, 1, false, false, 300.0);
+   estimator.AddMove(corner, 2, true, false, 300.0);
+   double cornerMs = estimator.Plan();
+   CHECK(cornerMs > singleMs && cornerMs < 2.0 * 1500.0);
+   if (estimator.GetMoveCount() == 2)
+   {
+      CHECK(Near(5.0, estimator.GetMove(1).end[0]));
+      CHECK(Near(5.0, estimator.GetMove(1).end[1]));
+   }
+
+   // G0 runs at the $5 seek rate, 500 mm/min
+   target[0] = 20.0;
+   estimator.Reset(origin);
+   estimator.AddMove(target, 1, false, true, -1.0);
+   double rapidMs = estimator.Plan();
+   double seek = 500.0 / 60.0;
+   double cruiseS = (20.0 - seek * seek / 10.0) / seek;
+   CHECK(fabs(1000.0 * (2.0 * seek / 10.0 + cruiseS) - rapidMs) < 0.1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GrblCommandQueue
+///////////////////////////////////////////////////////////////////////////////
+
+const int g_producers = 4;
+const int g_requestsPerProducer = 20000;
+
+// pushes its requests, whose lines are "<producer> <index>", as fast as it can
+class Producer : public MMDeviceThreadBase
+{
+   public:
+      Producer(GrblCommandQueue& queue, std::vector<GrblCommandRequest*>& requests) :
+         queue_(queue), requests_(requests) {}
+
+      int svc()
+      {
+         for (size_t i = 0; i < requests_.size(); ++i)
+            queue_.Push(requests_[i]);
+         return 0;
+      }
+
+   private:
+      GrblCommandQueue& queue_;
+      std::vector<GrblCommandRequest*>& requests_;
+};
+
+void TestCommandQueue()
+{
+   GrblCommandQueue queue;
+   CHECK(queue.Pop() == 0);
+
+   // first in, first out
+   GrblCommandRequest a(GrblCommand("G90")), b(GrblCommand("G91")), c(GrblCommand("G21"));
+   queue.Push(&a);
+   queue.Push(&b);
+   CHECK(queue.Pop() == &a);
+   queue.Push(&c);
+   CHECK(queue.Pop() == &b);
+   CHECK(queue.Pop() == &c);
+   CHECK(queue.Pop() == 0);
+
+   // every request pushed concurrently is popped once, in the order of its producer
+   std::vector<GrblCommandRequest*> requests[g_producers];
+   std::vector<Producer*> producers;
+   for (int p = 0; p < g_producers; ++p)
+   {
+      for (int i = 0; i < g_requestsPerProducer; ++i)
+      {
+         char line[32];
+         snprintf(line, sizeof(line), "%d %d", p, i);
+         requests[p].push_back(new GrblCommandRequest(GrblCommand(line)));
+      }
+      producers.push_back(new Producer(queue, requests[p]));
+   }
+   for (int p = 0; p < g_producers; ++p)
+      producers[p]->activate();
+
+   int next[g_producers] = {0};
+   bool ordered = true;
+   int popped = 0;
+   double deadlineMs = GrblNowMs() + 10000.0;
+   while (popped < g_producers * g_requestsPerProducer && GrblNowMs() < deadlineMs)
+   {
+      GrblCommandRequest* request = queue.Pop();
+      if (!request)
+         continue;
+      ++popped;
+      int p = -1, i = -1;
+      sscanf(request->GetLine().c_str(), "%d %d", &p, &i);
+      if (p < 0 || p >= g_producers || i != next[p])
+         ordered = false;
+      else
+         ++next[p];
+   }
+   for (int p = 0; p < g_producers; ++p)
+      producers[p]->wait();
+   CHECK_EQUAL(g_producers * g_requestsPerProducer, popped);
+   CHECK(ordered);
+   CHECK(queue.Pop() == 0);
+
+   for (int p = 0; p < g_producers; ++p)
+   {
+      delete producers[p];
+      for (size_t i = 0; i < requests[p].size(); ++i)
+         delete requests[p][i];
+   }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// hub on the simulator
+///////////////////////////////////////////////////////////////////////////////
+
+// count lines, alternating G90 and G91 and ending in G90, remembering the
+// order in which they were acknowledged
+class ModalLines : public GrblLineSource
+{
+   public:
+      ModalLines(unsigned long count) : count_(count), lines_(0) {}
+
+      bool NextLine(std::string& line)
+      {
+         if (lines_ == count_)
+            return false;
+         ++lines_;
+         line = (lines_ & 1) && lines_ != count_ ? "G91" : "G90";
+         return true;
+      }
+      void LineAcknowledged(unsigned long lineNumber) {acks_.push_back(lineNumber);}
+
+      const std::vector<unsigned long>& GetAcks() const {return acks_;}
+
+   private:
+      unsigned long count_;
+      unsigned long lines_;
+      std::vector<unsigned long> acks_;
+};
+
+void TestStreamingAcks(CEVA_NDE_GrblHub& hub)
+{
+   // many more bytes than the receive buffer of the controller holds
+   ModalLines source(500);
+   CHECK_EQUAL(DEVICE_OK, hub.StreamCommands(source));
+   const std::vector<unsigned long>& acks = source.GetAcks();
+   CHECK_EQUAL(500u, acks.size());
+   bool ordered = true;
+   for (size_t i = 0; i < acks.size(); ++i)
+      ordered = ordered && acks[i] == i + 1;
+   CHECK(ordered);
+
+   // a rejected line fails the stream
+   std::vector<std::string> lines;
+   lines.push_back("G90");
+   lines.push_back("M999");
+   lines.push_back("G90");
+   CHECK_EQUAL(ERR_COMMAND_REJECTED, hub.StreamCommands(lines));
+
+   std::string answer;
+   CHECK_EQUAL(DEVICE_OK, hub.SendCommand("G90", answer));
+}
+
+void TestStatus(CEVA_NDE_GrblHub& hub)
+{
+   std::string answer;
+   CHECK_EQUAL(DEVICE_OK, hub.SendCommand("G90G1X0.5Y-0.25F600", answer));
+   CHECK_EQUAL(DEVICE_OK, hub.WaitForMotion(GrblNowMs() + 5000.0));
+   CHECK_EQUAL(DEVICE_OK, hub.GetStatus());
+   GrblStatusSnapshot snapshot;
+   CHECK_EQUAL(DEVICE_OK, hub.GetStatusSnapshot(snapshot, 0.0));
+   CHECK_EQUAL(std::string("Idle"), std::string(snapshot.status));
+   CHECK(Near(0.5, snapshot.MPos[0]));
+   CHECK(Near(-0.25, snapshot.MPos[1]));
+   CHECK(Near(0.0, snapshot.MPos[2]));
+
+   // the '?' written through the command path answers with the report
+   CHECK_EQUAL(DEVICE_OK, hub.SendCommand("?", answer));
+   CHECK_EQUAL(std::string("<Idle,MPos:0.500,-0.250,0.000,WPos:0.500,-0.250,0.000>"), answer);
+
+   CHECK_EQUAL(DEVICE_OK, hub.SendCommand("G90G0X0Y0", answer));
+   CHECK_EQUAL(DEVICE_OK, hub.WaitForMotion(GrblNowMs() + 5000.0));
+}
+
+void TestParameters(CEVA_NDE_GrblHub& hub)
+{
+   CHECK_EQUAL(DEVICE_OK, hub.GetParameters());
+   CHECK_EQUAL((size_t) PARAMETERS_COUNT, hub.parameters.size());
+   if (hub.parameters.size() != PARAMETERS_COUNT)
+      return;
+   CHECK(Near(250.0, hub.parameters[0]));
+   CHECK(Near(3.0, hub.parameters[12]));
+
+   // $N= is read back with $$
+   long version = hub.GetParametersVersion();
+   CHECK_EQUAL(DEVICE_OK, hub.SetParameter(4, 321.5));
+   CHECK(Near(321.5, hub.parameters[4]));
+   CHECK(hub.GetParametersVersion() != version);
+   CHECK_EQUAL(DEVICE_OK, hub.SetParameter(4, 250.0));
+   CHECK(Near(250.0, hub.parameters[4]));
+}
+
+// slow relative moves, far more than are acknowledged before the reset
+class SlowMoves : public MMDeviceThreadBase, private GrblLineSource
+{
+   public:
+      SlowMoves(CEVA_NDE_GrblHub& hub) : hub_(hub), lines_(0), result_(DEVICE_OK) {}
+
+      int svc()
+      {
+         result_ = hub_.StreamCommands(*this);
+         return 0;
+      }
+      int GetResult() const {return result_;}
+
+   private:
+      bool NextLine(std::string& line)
+      {
+         if (lines_++ == 40)
+            return false;
+         line = "G91G1X0.1F60";
+         return true;
+      }
+
+      CEVA_NDE_GrblHub& hub_;
+      int lines_;
+      int result_;
+};
+
+void TestSoftResetMidStream(CEVA_NDE_GrblHub& hub)
+{
+   SlowMoves stream(hub);
+   stream.activate();
+   // until the stream has filled the planner
+   CDeviceUtils::SleepMs(300);
+   CHECK(hub.IsMoving());
+   CHECK_EQUAL(DEVICE_OK, hub.SoftReset());
+   stream.wait();
+   CHECK_EQUAL(ERR_CONTROLLER_RESET, stream.GetResult());
+   CHECK(!hub.IsMoving());
+
+   // the controller takes commands again and has stopped where it was
+   std::string answer;
+   CHECK_EQUAL(DEVICE_OK, hub.SendCommand("G90", answer));
+   CHECK_EQUAL(DEVICE_OK, hub.GetStatus());
+   GrblStatusSnapshot snapshot;
+   CHECK_EQUAL(DEVICE_OK, hub.GetStatusSnapshot(snapshot, 0.0));
+   CHECK_EQUAL(std::string("Idle"), std::string(snapshot.status));
+   CHECK(snapshot.MPos[0] > 0.0 && snapshot.MPos[0] < 4.0);
+   CHECK_EQUAL(DEVICE_OK, hub.GetParameters());
+   CHECK_EQUAL((size_t) PARAMETERS_COUNT, hub.parameters.size());
+}
+
+void TestTrajectory(CEVA_NDE_GrblHub& hub)
+{
+   // moves are only modelled once the units are known
+   std::string answer;
+   CHECK_EQUAL(DEVICE_OK, hub.SendCommand("G21G90G0X0Y0", answer));
+   CHECK_EQUAL(DEVICE_OK, hub.WaitForMotion(GrblNowMs() + 5000.0));
+   hub.GetMetrics().Reset();
+
+   // the model expects 2 mm at 300 mm/min to take 894 ms
+   double startMs = GrblNowMs();
+   CHECK_EQUAL(DEVICE_OK, hub.SendCommand("G1X2F300", answer));
+   double endMs = 0.0;
+   CHECK(hub.GetMotionEndMs(endMs));
+   CHECK(fabs(endMs - startMs - 894.4) < 50.0);
+
+   // halfway the prediction matches what the controller reports
+   CDeviceUtils::SleepMs(450);
+   CHECK_EQUAL(DEVICE_OK, hub.GetStatus());
+   GrblStatusSnapshot snapshot;
+   CHECK_EQUAL(DEVICE_OK, hub.GetStatusSnapshot(snapshot, 1000.0));
+   double predicted[2];
+   CHECK(hub.PredictPosition(snapshot.timestampMs, predicted));
+   CHECK(fabs(predicted[0] - snapshot.MPos[0]) < 0.1);
+   CHECK(snapshot.MPos[0] > 0.5 && snapshot.MPos[0] < 1.5);
+
+   CHECK_EQUAL(DEVICE_OK, hub.WaitForMotion(GrblNowMs() + 5000.0));
+   double stoppedMs = GrblNowMs();
+   CHECK(fabs(stoppedMs - endMs) < 100.0);
+   // an Idle report anchors the model where the stage stopped
+   CHECK_EQUAL(DEVICE_OK, hub.GetStatus());
+   CHECK(hub.PredictPosition(GrblNowMs(), predicted));
+   CHECK(Near(2.0, predicted[0]));
+   CHECK(Near(0.0, predicted[1]));
+
+   // each status report during the move was checked against the model
+   const GrblLatencyHistogram& error = hub.GetMetrics().GetPredictionError();
+   CHECK(error.GetCount() > 0);
+   CHECK(error.GetPercentileUs(0.99) < 100000.0);
+
+   // the reported positions tell where the stage was at any time between
+   double position[3];
+   CHECK_EQUAL(DEVICE_OK, hub.GetPositionAt(startMs + 447.0, position));
+   CHECK(fabs(position[0] - 1.0) < 0.15);
+   CHECK(Near(0.0, position[1]));
+   CHECK_EQUAL(ERR_UNKNOWN_POSITION, hub.GetPositionAt(GrblNowMs() + 60000.0, position));
+   std::vector<GrblPositionSample> samples;
+   hub.ExportPositionHistory(samples, startMs);
+   CHECK(samples.size() > 5);
+   bool ordered = true;
+   for (size_t i = 1; i < samples.size(); ++i)
+      ordered = ordered && samples[i].timeMs >= samples[i - 1].timeMs && samples[i].MPos[0] >= samples[i - 1].MPos[0];
+   CHECK(ordered);
+
+   CHECK_EQUAL(DEVICE_OK, hub.SendCommand("G90G0X0Y0", answer));
+   CHECK_EQUAL(DEVICE_OK, hub.WaitForMotion(GrblNowMs() + 5000.0));
+}
+
+// the settings the hub holds, and its cache file, follow every $N= line
+void TestSettingsCache(CEVA_NDE_GrblHub& hub)
+{
+   CHECK_EQUAL(DEVICE_OK, hub.GetParameters());
+   GrblSettingsCache cache("", GrblPortScanner::GetDeviceId("Simulator"));
+   std::string banner;
+   std::vector<double> cached;
+   CHECK(cache.Load(banner, cached));
+   CHECK_EQUAL(std::string("Grbl 0.8c ['$' for help]"), banner);
+
+   std::string answer;
+   long version = hub.GetParametersVersion();
+   CHECK_EQUAL(DEVICE_OK, hub.SendCommand("$4=300", answer));
+   CHECK(hub.GetParametersVersion() != version);
+   CHECK(Near(300.0, hub.parameters[4]));
+   CHECK(Near(300.0, hub.GetMachineLimits().feedMmPerMin));
+   CHECK(cache.Load(banner, cached) && cached.size() == PARAMETERS_COUNT && Near(300.0, cached[4]));
+
+   std::vector<std::string> lines;
+   lines.push_back("G90");
+   lines.push_back("$8=20");
+   CHECK_EQUAL(DEVICE_OK, hub.StreamCommands(lines));
+   CHECK(Near(20.0, hub.parameters[8]));
+   CHECK(Near(20.0, hub.GetMachineLimits().accelerationMmPerS2));
+
+   CHECK_EQUAL(DEVICE_OK, hub.SetProperty("Command", "$4=250"));
+   CHECK(Near(250.0, hub.parameters[4]));
+   CHECK_EQUAL(DEVICE_OK, hub.SendCommand("$8=10", answer));
+   CHECK(Near(10.0, hub.GetMachineLimits().accelerationMmPerS2));
+
+   // a rejected line changes nothing
+   version = hub.GetParametersVersion();
+   CHECK(hub.SendCommand("$99=1", answer) != DEVICE_OK);
+   CHECK_EQUAL(version, hub.GetParametersVersion());
+   CHECK(cache.Load(banner, cached));
+
+   hub.InvalidateParameters();
+   CHECK(!cache.Load(banner, cached));
+   CHECK_EQUAL(DEVICE_OK, hub.GetParameters());
+   CHECK(cache.Load(banner, cached) && cached == hub.parameters);
+}
+
+// a stage shut down in the middle of a scan stops it and can be used again
+void TestStageShutdown(GrblSimulatedRig& rig)
+{
+   CHECK_EQUAL(DEVICE_OK, rig.stage.StartTileScan(0.0, 0.0, 500.0, 500.0, 0.0, 1, 3, 0.0));
+   CDeviceUtils::SleepMs(50);
+   CHECK(rig.stage.IsScanRunning());
+   CHECK_EQUAL(DEVICE_OK, rig.stage.Shutdown());
+   CHECK(!rig.stage.IsScanRunning());
+   long tile, total;
+   CHECK_EQUAL(DEVICE_OK, rig.stage.GetTileScanProgress(tile, total));
+   CHECK(tile < 2);
+   CHECK_EQUAL(DEVICE_OK, rig.hub.WaitForMotion(GrblNowMs() + 5000.0));
+   CHECK(!rig.stage.Busy());
+
+   CHECK_EQUAL(DEVICE_OK, rig.stage.Initialize());
+   CHECK_EQUAL(DEVICE_OK, rig.stage.StartTileScan(0.0, 0.0, 100.0, 100.0, 0.0, 1, 2, 0.0));
+   double deadlineMs = GrblNowMs() + 10000.0;
+   while (rig.stage.IsScanRunning() && GrblNowMs() < deadlineMs)
+      CDeviceUtils::SleepMs(10);
+   CHECK_EQUAL(DEVICE_OK, rig.stage.GetTileScanProgress(tile, total));
+   CHECK_EQUAL(1L, tile);
+   CHECK_EQUAL(2L, total);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// scan generators
+///////////////////////////////////////////////////////////////////////////////
+
+// hands the lines of a scan to the hub, keeping them together with the step
+// the scan reports after each acknowledgement
+class RecordedScan : public GrblLineSource
+{
+   public:
+      RecordedScan(GrblScanSource& scan) : scan_(scan) {}
+
+      bool NextLine(std::string& line)
+      {
+         if (!scan_.NextLine(line))
+            return false;
+         lines_.push_back(line);
+         return true;
+      }
+      void LineAcknowledged(unsigned long lineNumber)
+      {
+         scan_.LineAcknowledged(lineNumber);
+         acks_.push_back(lineNumber);
+         steps_.push_back(scan_.GetCurrentStep());
+      }
+
+      const std::vector<std::string>& GetLines() const {return lines_;}
+      const std::vector<unsigned long>& GetAcks() const {return acks_;}
+      const std::vector<long>& GetSteps() const {return steps_;}
+
+   private:
+      GrblScanSource& scan_;
+      std::vector<std::string> lines_;
+      std::vector<unsigned long> acks_;
+      std::vector<long> steps_;
+};
+
+// true if, after each acknowledgement, the scan reported as its step the
+// number of G4 P0 lines answered right after a move starting with
+// movePrefix, less one
+bool StepsFollowArrivals(const RecordedScan& recorded, const char* movePrefix)
+{
+   const std::vector<std::string>& lines = recorded.GetLines();
+   const std::vector<unsigned long>& acks = recorded.GetAcks();
+   if (acks.size() != lines.size())
+      return false;
+   long arrivals = 0;
+   for (size_t i = 0; i < acks.size(); ++i)
+   {
+      if (acks[i] != i + 1)
+         return false;
+      if (i > 0 && lines[i] == "G4P0" && lines[i - 1].compare(0, strlen(movePrefix), movePrefix) == 0)
+         ++arrivals;
+      if (recorded.GetSteps()[i] != arrivals - 1)
+         return false;
+   }
+   return true;
+}
+
+void TestStopScans(CEVA_NDE_GrblHub& hub)
+{
+   // with a dwell each stop takes three lines
+   std::vector<std::pair<double, double> > positions;
+   positions.push_back(std::make_pair(100.0, 50.0));
+   positions.push_back(std::make_pair(200.0, -50.0));
+   positions.push_back(std::make_pair(0.0, 0.0));
+   GrblPositionListSource list(positions, 1.0, 20.0);
+   RecordedScan recordedList(list);
+   CHECK_EQUAL(DEVICE_OK, hub.StreamCommands(recordedList));
+   CHECK_EQUAL(2u + 3u * 3u, recordedList.GetLines().size());
+   CHECK(StepsFollowArrivals(recordedList, "G00"));
+   CHECK_EQUAL(2L, list.GetCurrentStep());
+   if (recordedList.GetLines().size() > 4)
+   {
+      CHECK_EQUAL(std::string("G00X0.1000Y0.0500"), recordedList.GetLines()[2]);
+      CHECK_EQUAL(std::string("G4P0.020"), recordedList.GetLines()[4]);
+   }
+
+   // without, two; tiles in serpentine order
+   GrblTileScanSource tiles(0.0, 0.0, 100.0, 80.0, 0.25, 2, 2, 1.0, 0.0);
+   RecordedScan recordedTiles(tiles);
+   CHECK_EQUAL(DEVICE_OK, hub.StreamCommands(recordedTiles));
+   const std::vector<std::string>& lines = recordedTiles.GetLines();
+   CHECK_EQUAL(2u + 4u * 2u, lines.size());
+   CHECK(StepsFollowArrivals(recordedTiles, "G00"));
+   CHECK_EQUAL(3L, tiles.GetCurrentStep());
+   if (lines.size() == 10)
+   {
+      CHECK_EQUAL(std::string("G00X0.0000Y0.0000"), lines[2]);
+      CHECK_EQUAL(std::string("G00X0.0750Y0.0000"), lines[4]);
+      CHECK_EQUAL(std::string("G00X0.0750Y0.0600"), lines[6]);
+      CHECK_EQUAL(std::string("G00X0.0000Y0.0600"), lines[8]);
+   }
+
+   // a cancelled scan hands out no further lines
+   GrblTileScanSource cancelled(0.0, 0.0, 100.0, 80.0, 0.0, 2, 2, 1.0, 0.0);
+   std::string line;
+   CHECK(cancelled.NextLine(line));
+   cancelled.Cancel();
+   CHECK(!cancelled.NextLine(line));
+}
+
+void TestFlyScan(CEVA_NDE_GrblHub& hub)
+{
+   // 20 um every 10 ms is 2 mm/s; reaching it at 10 mm/s^2 takes 0.2 mm,
+   // with the margin 0.25 mm, rounded up to whole pitches
+   GrblFlyScanSource fly(0.0, 0.0, 200.0, 2, 50.0, 20.0, 10.0, 10.0, 1.0);
+   CHECK(Near(120.0, fly.GetFeedMmPerMin()));
+   CHECK(Near(260.0, fly.GetRampUm()));
+   std::vector<GrblFlyScanTrigger> triggers;
+   fly.GetTriggers(triggers);
+   CHECK_EQUAL(2u * 36u, triggers.size());
+   int inRegion = 0;
+   for (size_t i = 0; i < triggers.size(); ++i)
+      inRegion += triggers[i].inRegion ? 1 : 0;
+   CHECK_EQUAL(2 * 11, inRegion);
+   if (triggers.size() == 72)
+   {
+      // the second row runs backwards
+      CHECK(Near(-240.0, triggers[0].xUm));
+      CHECK(Near(440.0, triggers[36].xUm));
+      CHECK(Near(50.0, triggers[36].yUm));
+   }
+
+   RecordedScan recorded(fly);
+   CHECK_EQUAL(DEVICE_OK, hub.StreamCommands(recorded));
+   const std::vector<std::string>& lines = recorded.GetLines();
+   CHECK_EQUAL(1u + 2u * 5u + 1u, lines.size());
+   CHECK(StepsFollowArrivals(recorded, "G01"));
+   CHECK_EQUAL(1L, fly.GetCurrentStep());
+   if (lines.size() == 12)
+   {
+      CHECK_EQUAL(std::string("G01X0.4600F120.000"), lines[4]);
+      CHECK_EQUAL(std::string("G01X-0.2600F120.000"), lines[9]);
+      CHECK_EQUAL(std::string("M108P1.000Q0"), lines[11]);
+   }
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+   bool verbose = false;
+   for (int i = 1; i < argc; ++i)
+   {
+      if (strcmp(argv[i], "-v") == 0)
+         verbose = true;
+      else
+      {
+         fprintf(stderr, "usage: %s [-v]\n", argv[0]);
+         return 2;
+      }
+   }
+
+   TestFormatGrblDecimal();
+   TestParseStatusReport();
+   TestModalState();
+   TestSettingLines();
+   TestLatencyHistogram();
+   TestPositionHistory();
+   TestMoveEstimator();
+   TestCommandQueue();
+
+   GrblSimulatedRig rig;
+   rig.core.SetVerbose(verbose);
+   int ret = rig.Initialize(115200);
+   CHECK_EQUAL(DEVICE_OK, ret);
+   if (ret == DEVICE_OK)
+   {
+      // the rejected line and the reset are expected, no trace file for them
+      CHECK_EQUAL(DEVICE_OK, rig.hub.SetProperty("TrafficDumpOnError", "0"));
+      TestStreamingAcks(rig.hub);
+      TestStatus(rig.hub);
+      TestParameters(rig.hub);
+      TestSoftResetMidStream(rig.hub);
+      TestTrajectory(rig.hub);
+      TestSettingsCache(rig.hub);
+      TestStopScans(rig.hub);
+      TestFlyScan(rig.hub);
+      TestStageShutdown(rig);
+   }
+   rig.Shutdown();
+
+   printf("%d checks, %d failed\n", g_checks, g_failures);
+   return g_failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,170 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblToolCore.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Stand-in for the Micro-Manager core, so that the command line
+//                tools can run the hub and the XY stage on the simulator
+// LICENSE:       LGPL
+//
+
+#ifndef _GRBL_TOOL_CORE_H_
+#define _GRBL_TOOL_CORE_H_
+
+#include "../EVA_NDE_Grbl.h"
+#include "../XYStage.h"
+#include <cstdio>
+#include <cstring>
+
+// Answers what the hub and the stage ask of the core: the stage's parent hub,
+// the time, and log messages, which go to stderr if verbose. The hub never
+// asks for the serial port on the simulator transport; properties of a port
+// device set with SetPort are passed on to it. Everything else fails with
+// DEVICE_NOT_SUPPORTED; the list follows MM::Core in MMDevice.h.
+class GrblToolCore : public MM::Core
+{
+public:
+   GrblToolCore() : hub_(0), port_(0), verbose_(false) {}
+
+   void SetHub(MM::Hub* hub) {hub_ = hub;}
+   void SetPort(MM::Device* port) {port_ = port;}
+   void SetVerbose(bool verbose) {verbose_ = verbose;}
+
+   int LogMessage(const MM::Device*, const char* msg, bool) const
+   {
+      if (verbose_)
+         fprintf(stderr, "%s\n", msg);
+      return DEVICE_OK;
+   }
+   MM::Hub* GetParentHub(const MM::Device* caller) const {return caller == hub_ ? 0 : hub_;}
+   MM::MMTime GetCurrentMMTime() {return MM::MMTime(1000.0 * GrblNowMs());}
+   unsigned long GetClockTicksUs(const MM::Device*) {return (unsigned long) (1000.0 * GrblNowMs());}
+
+   MM::Device* GetDevice(const MM::Device*, const char*) {return 0;}
+   int GetDeviceProperty(const char* label, const char* name, char* value)
+   {
+      MM::Device* device = FindPort(label);
+      return device ? device->GetProperty(name, value) : DEVICE_NOT_SUPPORTED;
+   }
+   int SetDeviceProperty(const char* label, const char* name, const char* value)
+   {
+      MM::Device* device = FindPort(label);
+      return device ? device->SetProperty(name, value) : DEVICE_NOT_SUPPORTED;
+   }
+   void GetLoadedDeviceOfType(const MM::Device*, MM::DeviceType, char* pDeviceName, const unsigned int) {pDeviceName[0] = 0;}
+
+   int SetSerialProperties(const char*, const char*, const char*, const char*, const char*, const char*, const char*) {return DEVICE_NOT_SUPPORTED;}
+   int SetSerialCommand(const MM::Device*, const char*, const char*, const char*) {return DEVICE_NOT_SUPPORTED;}
+   int GetSerialAnswer(const MM::Device*, const char*, unsigned long, char*, const char*) {return DEVICE_NOT_SUPPORTED;}
+   int WriteToSerial(const MM::Device*, const char*, const unsigned char*, unsigned long) {return DEVICE_NOT_SUPPORTED;}
+   int ReadFromSerial(const MM::Device*, const char*, unsigned char*, unsigned long, unsigned long& read) {read = 0; return DEVICE_NOT_SUPPORTED;}
+   int PurgeSerial(const MM::Device*, const char*) {return DEVICE_NOT_SUPPORTED;}
+   MM::PortType GetSerialPortType(const char*) const {return MM::InvalidPort;}
+
+   int OnPropertiesChanged(const MM::Device*) {return DEVICE_OK;}
+   int OnPropertyChanged(const MM::Device*, const char*, const char*) {return DEVICE_OK;}
+   int OnStagePositionChanged(const MM::Device*, double) {return DEVICE_OK;}
+   int OnXYStagePositionChanged(const MM::Device*, double, double) {return DEVICE_OK;}
+   int OnExposureChanged(const MM::Device*, double) {return DEVICE_OK;}
+   int OnSLMExposureChanged(const MM::Device*, double) {return DEVICE_OK;}
+   int OnMagnifierChanged(const MM::Device*) {return DEVICE_OK;}
+   int OnShutterOpenChanged(const MM::Device*, bool) {return DEVICE_OK;}
+
+   int AcqFinished(const MM::Device*, int) {return DEVICE_NOT_SUPPORTED;}
+   int PrepareForAcq(const MM::Device*) {return DEVICE_NOT_SUPPORTED;}
+   int InsertImage(const MM::Device*, const ImgBuffer&) {return DEVICE_NOT_SUPPORTED;}
+   int InsertImage(const MM::Device*, const unsigned char*, unsigned, unsigned, unsigned, unsigned, const char*, const bool) {return DEVICE_NOT_SUPPORTED;}
+   int InsertImage(const MM::Device*, const unsigned char*, unsigned, unsigned, unsigned, const Metadata*, const bool) {return DEVICE_NOT_SUPPORTED;}
+   int InsertImage(const MM::Device*, const unsigned char*, unsigned, unsigned, unsigned, const char*, const bool) {return DEVICE_NOT_SUPPORTED;}
+   int InsertMultiChannel(const MM::Device*, const unsigned char*, unsigned, unsigned, unsigned, unsigned, Metadata*) {return DEVICE_NOT_SUPPORTED;}
+   void ClearImageBuffer(const MM::Device*) {}
+   bool InitializeImageBuffer(unsigned, unsigned, unsigned int, unsigned int, unsigned int) {return false;}
+   void SetAcqStatus(const MM::Device*, int) {}
+   int OpenFrame(const MM::Device*) {return DEVICE_NOT_SUPPORTED;}
+   int CloseFrame(const MM::Device*) {return DEVICE_NOT_SUPPORTED;}
+   int AcquireFrame(const MM::Device*) {return DEVICE_NOT_SUPPORTED;}
+
+   const char* GetImage() {return 0;}
+   int GetImageDimensions(int&, int&, int&) {return DEVICE_NOT_SUPPORTED;}
+   int GetFocusPosition(double&) {return DEVICE_NOT_SUPPORTED;}
+   int SetFocusPosition(double) {return DEVICE_NOT_SUPPORTED;}
+   int MoveFocus(double) {return DEVICE_NOT_SUPPORTED;}
+   int SetXYPosition(double, double) {return DEVICE_NOT_SUPPORTED;}
+   int GetXYPosition(double&, double&) {return DEVICE_NOT_SUPPORTED;}
+   int MoveXYStage(double, double) {return DEVICE_NOT_SUPPORTED;}
+   int SetExposure(double) {return DEVICE_NOT_SUPPORTED;}
+   int GetExposure(double&) {return DEVICE_NOT_SUPPORTED;}
+   int SetConfig(const char*, const char*) {return DEVICE_NOT_SUPPORTED;}
+   int GetCurrentConfig(const char*, int, char*) {return DEVICE_NOT_SUPPORTED;}
+   int GetChannelConfig(char*, const unsigned int) {return DEVICE_NOT_SUPPORTED;}
+
+   MM::ImageProcessor* GetImageProcessor(const MM::Device*) {return 0;}
+   MM::AutoFocus* GetAutoFocus(const MM::Device*) {return 0;}
+   MM::State* GetStateDevice(const MM::Device*, const char*) {return 0;}
+   MM::SignalIO* GetSignalIODevice(const MM::Device*, const char*) {return 0;}
+
+   void NextPostedError(int& errorCode, char*, int, int& messageLength) {errorCode = 0; messageLength = 0;}
+   void PostError(const int, const char*) {}
+   void ClearPostedErrors() {}
+
+private:
+   MM::Device* FindPort(const char* label) const
+   {
+      if (!port_)
+         return 0;
+      char portLabel[MM::MaxStrLength];
+      port_->GetLabel(portLabel);
+      return strcmp(label, portLabel) == 0 ? port_ : 0;
+   }
+
+   MM::Hub* hub_;
+   MM::Device* port_;
+   bool verbose_;
+};
+
+// The hub on the simulator transport with the XY stage attached, set up the
+// way the core sets up devices from a configuration file
+class GrblSimulatedRig
+{
+public:
+   GrblSimulatedRig()
+   {
+      hub.SetCallback(&core);
+      stage.SetCallback(&core);
+      core.SetHub(&hub);
+   }
+
+   int Initialize(long baud)
+   {
+      hub.SetLabel("GrblHub");
+      stage.SetLabel("XYStage");
+      int ret = hub.SetProperty(MM::g_Keyword_Port, "Simulator");
+      if (ret == DEVICE_OK)
+         ret = hub.SetProperty("Transport", "Simulator");
+      if (ret == DEVICE_OK)
+         ret = hub.SetProperty("SimulatorBaudRate", CDeviceUtils::ConvertToString(baud));
+      if (ret != DEVICE_OK)
+         return ret;
+      // the simulator starts from its default settings every time, a cache
+      // left by a run with other settings would be stale
+      hub.InvalidateParameters();
+      ret = hub.Initialize();
+      if (ret != DEVICE_OK)
+         return ret;
+      return stage.Initialize();
+   }
+
+   void Shutdown()
+   {
+      stage.Shutdown();
+      hub.Shutdown();
+      // leaves no settings cache behind in the working directory
+      hub.InvalidateParameters();
+   }
+
+   GrblToolCore core;
+   CEVA_NDE_GrblHub hub;
+   XYStage stage;
+};
+
+#endif //_GRBL_TOOL_CORE_H_
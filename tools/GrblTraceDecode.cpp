@@ -0,0 +1,130 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblTraceDecode.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Prints a trace file written by the EVA_NDE_Grbl hub
+//                (TrafficDump property) as text, one frame per line:
+//                   <ms since first frame> <thread> <TX|RX|PURGE|TIMEOUT> "<data>"
+//                Build it on its own, e.g. g++ -o GrblTraceDecode GrblTraceDecode.cpp
+// LICENSE:       LGPL
+//
+
+#include "../GrblRecorder.h"
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+namespace {
+
+const char* TypeName(unsigned char type)
+{
+   switch (type)
+   {
+      case GrblTraceRecord::TX: return "TX";
+      case GrblTraceRecord::RX: return "RX";
+      case GrblTraceRecord::PURGE: return "PURGE";
+      case GrblTraceRecord::TIMEOUT: return "TIMEOUT";
+      default: return "?";
+   }
+}
+
+// control characters, including the real-time commands, as C escapes
+std::string Escape(const std::string& data)
+{
+   std::string out;
+   for (std::string::size_type i = 0; i < data.length(); ++i)
+   {
+      unsigned char c = (unsigned char) data[i];
+      char buff[8];
+      if (c == '\r')
+         out += "\\r";
+      else if (c == '\n')
+         out += "\\n";
+      else if (c == '"' || c == '\\')
+      {
+         out += '\\';
+         out += (char) c;
+      }
+      else if (c < 0x20 || c >= 0x7f)
+      {
+         sprintf(buff, "\\x%02x", c);
+         out += buff;
+      }
+      else
+         out += (char) c;
+   }
+   return out;
+}
+
+void Print(const GrblTraceRecord& first, unsigned long long start, const std::string& frame)
+{
+   printf("%14.6f %6u %-7s \"%s\"\n", (first.timestampNs - start) / 1e6,
+      first.thread, TypeName(first.type), Escape(frame).c_str());
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+   if (argc != 2)
+   {
+      fprintf(stderr, "usage: %s <trace file>\n", argv[0]);
+      return 2;
+   }
+   FILE* fp = fopen(argv[1], "rb");
+   if (!fp)
+   {
+      perror(argv[1]);
+      return 1;
+   }
+   GrblTraceHeader header;
+   if (fread(&header, sizeof(header), 1, fp) != 1 ||
+      memcmp(header.magic, GRBL_TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.recordSize != sizeof(GrblTraceRecord))
+   {
+      fprintf(stderr, "%s: not a trace file of this version\n", argv[1]);
+      fclose(fp);
+      return 1;
+   }
+
+   unsigned long long start = 0;
+   unsigned int expected = 0;
+   bool pending = false;      // a frame is waiting for its continuation
+   GrblTraceRecord first;
+   std::string frame;
+   for (unsigned int n = 0; n < header.recordCount; ++n)
+   {
+      GrblTraceRecord r;
+      if (fread(&r, sizeof(r), 1, fp) != 1)
+      {
+         fprintf(stderr, "%s: truncated after %u records\n", argv[1], n);
+         break;
+      }
+      if (n == 0)
+         start = r.timestampNs;
+      else if (r.index != expected)
+      {
+         if (pending)
+            Print(first, start, frame + "...");
+         pending = false;
+         printf("# %u records lost\n", r.index - expected);
+      }
+      expected = r.index + 1;
+
+      if (!pending)
+      {
+         first = r;
+         frame.clear();
+      }
+      frame.append(r.data, r.length);
+      pending = (r.flags & GrblTraceRecord::CONTINUED) != 0;
+      if (pending)
+         continue;
+      Print(first, start, frame);
+   }
+   if (pending)
+      Print(first, start, frame + "...");
+   fclose(fp);
+   return 0;
+}